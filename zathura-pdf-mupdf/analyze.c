@@ -0,0 +1,462 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include <inttypes.h>
+#include <math.h>
+#include <glib.h>
+
+#include "utils.h"
+
+/* Resolution (in dpi) pages are rasterized at to measure the raster time */
+#define MUPDF_ANALYZE_DPI 96.0f
+/* Maximum number of pixels of a rasterized page */
+#define MUPDF_ANALYZE_MAX_PIXELS (4096.0f * 4096.0f)
+
+typedef struct mupdf_count_device_s {
+  fz_device super;
+  mupdf_page_stats_t* stats; /**< Counters */
+} mupdf_count_device_t;
+
+static void count_moveto(fz_context* GIRARA_UNUSED(ctx), void* GIRARA_UNUSED(arg), float GIRARA_UNUSED(x),
+                         float GIRARA_UNUSED(y)) {}
+
+static void count_lineto(fz_context* GIRARA_UNUSED(ctx), void* arg, float GIRARA_UNUSED(x), float GIRARA_UNUSED(y)) {
+  *(uint64_t*)arg += 1;
+}
+
+static void count_curveto(fz_context* GIRARA_UNUSED(ctx), void* arg, float GIRARA_UNUSED(x1), float GIRARA_UNUSED(y1),
+                          float GIRARA_UNUSED(x2), float GIRARA_UNUSED(y2), float GIRARA_UNUSED(x3),
+                          float GIRARA_UNUSED(y3)) {
+  *(uint64_t*)arg += 1;
+}
+
+static void count_closepath(fz_context* GIRARA_UNUSED(ctx), void* arg) {
+  *(uint64_t*)arg += 1;
+}
+
+static void count_rectto(fz_context* GIRARA_UNUSED(ctx), void* arg, float GIRARA_UNUSED(x1), float GIRARA_UNUSED(y1),
+                         float GIRARA_UNUSED(x2), float GIRARA_UNUSED(y2)) {
+  *(uint64_t*)arg += 4;
+}
+
+static const fz_path_walker count_path_walker = {
+    .moveto    = count_moveto,
+    .lineto    = count_lineto,
+    .curveto   = count_curveto,
+    .closepath = count_closepath,
+    .rectto    = count_rectto,
+};
+
+static void count_path(fz_context* ctx, fz_device* dev, const fz_path* path) {
+  mupdf_page_stats_t* stats = ((mupdf_count_device_t*)dev)->stats;
+
+  stats->paths++;
+  fz_walk_path(ctx, path, &count_path_walker, &stats->path_segments);
+}
+
+static void count_text(fz_context* ctx, fz_device* dev, const fz_text* text) {
+  mupdf_page_stats_t* stats = ((mupdf_count_device_t*)dev)->stats;
+
+  for (const fz_text_span* span = text->head; span != NULL; span = span->next) {
+    stats->text_runs++;
+    if (fz_font_t3_procs(ctx, span->font) != NULL) {
+      stats->type3_runs++;
+    }
+    stats->glyphs += span->len;
+  }
+}
+
+static void count_image(fz_device* dev, const fz_image* image) {
+  mupdf_page_stats_t* stats = ((mupdf_count_device_t*)dev)->stats;
+
+  stats->images++;
+  stats->image_pixels += (uint64_t)image->w * image->h;
+}
+
+static void count_device_fill_path(fz_context* ctx, fz_device* dev, const fz_path* path, int GIRARA_UNUSED(even_odd),
+                                   fz_matrix GIRARA_UNUSED(ctm), fz_colorspace* GIRARA_UNUSED(colorspace),
+                                   const float* GIRARA_UNUSED(color), float GIRARA_UNUSED(alpha),
+                                   fz_color_params GIRARA_UNUSED(color_params)) {
+  count_path(ctx, dev, path);
+}
+
+static void count_device_stroke_path(fz_context* ctx, fz_device* dev, const fz_path* path,
+                                     const fz_stroke_state* GIRARA_UNUSED(stroke), fz_matrix GIRARA_UNUSED(ctm),
+                                     fz_colorspace* GIRARA_UNUSED(colorspace), const float* GIRARA_UNUSED(color),
+                                     float GIRARA_UNUSED(alpha), fz_color_params GIRARA_UNUSED(color_params)) {
+  count_path(ctx, dev, path);
+}
+
+static void count_device_clip_path(fz_context* ctx, fz_device* dev, const fz_path* path, int GIRARA_UNUSED(even_odd),
+                                   fz_matrix GIRARA_UNUSED(ctm), fz_rect GIRARA_UNUSED(scissor)) {
+  count_path(ctx, dev, path);
+}
+
+static void count_device_clip_stroke_path(fz_context* ctx, fz_device* dev, const fz_path* path,
+                                          const fz_stroke_state* GIRARA_UNUSED(stroke), fz_matrix GIRARA_UNUSED(ctm),
+                                          fz_rect GIRARA_UNUSED(scissor)) {
+  count_path(ctx, dev, path);
+}
+
+static void count_device_fill_text(fz_context* ctx, fz_device* dev, const fz_text* text, fz_matrix GIRARA_UNUSED(ctm),
+                                   fz_colorspace* GIRARA_UNUSED(colorspace), const float* GIRARA_UNUSED(color),
+                                   float GIRARA_UNUSED(alpha), fz_color_params GIRARA_UNUSED(color_params)) {
+  count_text(ctx, dev, text);
+}
+
+static void count_device_stroke_text(fz_context* ctx, fz_device* dev, const fz_text* text,
+                                     const fz_stroke_state* GIRARA_UNUSED(stroke), fz_matrix GIRARA_UNUSED(ctm),
+                                     fz_colorspace* GIRARA_UNUSED(colorspace), const float* GIRARA_UNUSED(color),
+                                     float GIRARA_UNUSED(alpha), fz_color_params GIRARA_UNUSED(color_params)) {
+  count_text(ctx, dev, text);
+}
+
+static void count_device_clip_text(fz_context* ctx, fz_device* dev, const fz_text* text, fz_matrix GIRARA_UNUSED(ctm),
+                                   fz_rect GIRARA_UNUSED(scissor)) {
+  count_text(ctx, dev, text);
+}
+
+static void count_device_clip_stroke_text(fz_context* ctx, fz_device* dev, const fz_text* text,
+                                          const fz_stroke_state* GIRARA_UNUSED(stroke), fz_matrix GIRARA_UNUSED(ctm),
+                                          fz_rect GIRARA_UNUSED(scissor)) {
+  count_text(ctx, dev, text);
+}
+
+static void count_device_ignore_text(fz_context* ctx, fz_device* dev, const fz_text* text,
+                                     fz_matrix GIRARA_UNUSED(ctm)) {
+  count_text(ctx, dev, text);
+}
+
+static void count_device_fill_shade(fz_context* GIRARA_UNUSED(ctx), fz_device* dev, fz_shade* GIRARA_UNUSED(shade),
+                                    fz_matrix GIRARA_UNUSED(ctm), float GIRARA_UNUSED(alpha),
+                                    fz_color_params GIRARA_UNUSED(color_params)) {
+  ((mupdf_count_device_t*)dev)->stats->shadings++;
+}
+
+static void count_device_fill_image(fz_context* GIRARA_UNUSED(ctx), fz_device* dev, fz_image* image,
+                                    fz_matrix GIRARA_UNUSED(ctm), float GIRARA_UNUSED(alpha),
+                                    fz_color_params GIRARA_UNUSED(color_params)) {
+  count_image(dev, image);
+}
+
+static void count_device_fill_image_mask(fz_context* GIRARA_UNUSED(ctx), fz_device* dev, fz_image* image,
+                                         fz_matrix GIRARA_UNUSED(ctm), fz_colorspace* GIRARA_UNUSED(colorspace),
+                                         const float* GIRARA_UNUSED(color), float GIRARA_UNUSED(alpha),
+                                         fz_color_params GIRARA_UNUSED(color_params)) {
+  count_image(dev, image);
+}
+
+static void count_device_clip_image_mask(fz_context* GIRARA_UNUSED(ctx), fz_device* dev, fz_image* image,
+                                         fz_matrix GIRARA_UNUSED(ctm), fz_rect GIRARA_UNUSED(scissor)) {
+  count_image(dev, image);
+}
+
+static void count_device_begin_mask(fz_context* GIRARA_UNUSED(ctx), fz_device* dev, fz_rect GIRARA_UNUSED(area),
+                                    int GIRARA_UNUSED(luminosity), fz_colorspace* GIRARA_UNUSED(colorspace),
+                                    const float* GIRARA_UNUSED(backdrop),
+                                    fz_color_params GIRARA_UNUSED(color_params)) {
+  ((mupdf_count_device_t*)dev)->stats->masks++;
+}
+
+static void count_device_begin_group(fz_context* GIRARA_UNUSED(ctx), fz_device* dev, fz_rect GIRARA_UNUSED(area),
+                                     fz_colorspace* GIRARA_UNUSED(colorspace), int GIRARA_UNUSED(isolated),
+                                     int GIRARA_UNUSED(knockout), int GIRARA_UNUSED(blendmode),
+                                     float GIRARA_UNUSED(alpha)) {
+  ((mupdf_count_device_t*)dev)->stats->groups++;
+}
+
+static int count_device_begin_tile(fz_context* GIRARA_UNUSED(ctx), fz_device* dev, fz_rect GIRARA_UNUSED(area),
+                                   fz_rect GIRARA_UNUSED(view), float GIRARA_UNUSED(xstep), float GIRARA_UNUSED(ystep),
+                                   fz_matrix GIRARA_UNUSED(ctm), int GIRARA_UNUSED(id), int GIRARA_UNUSED(doc_id)) {
+  ((mupdf_count_device_t*)dev)->stats->tiles++;
+  /* the cell is counted once, however often it is repeated */
+  return 0;
+}
+
+static fz_device* new_count_device(fz_context* ctx, mupdf_page_stats_t* stats) {
+  mupdf_count_device_t* device = fz_new_derived_device(ctx, mupdf_count_device_t);
+  device->stats                = stats;
+
+  device->super.fill_path        = count_device_fill_path;
+  device->super.stroke_path      = count_device_stroke_path;
+  device->super.clip_path        = count_device_clip_path;
+  device->super.clip_stroke_path = count_device_clip_stroke_path;
+
+  device->super.fill_text        = count_device_fill_text;
+  device->super.stroke_text      = count_device_stroke_text;
+  device->super.clip_text        = count_device_clip_text;
+  device->super.clip_stroke_text = count_device_clip_stroke_text;
+  device->super.ignore_text      = count_device_ignore_text;
+
+  device->super.fill_shade      = count_device_fill_shade;
+  device->super.fill_image      = count_device_fill_image;
+  device->super.fill_image_mask = count_device_fill_image_mask;
+  device->super.clip_image_mask = count_device_clip_image_mask;
+
+  device->super.begin_mask  = count_device_begin_mask;
+  device->super.begin_group = count_device_begin_group;
+  device->super.begin_tile  = count_device_begin_tile;
+
+  return &device->super;
+}
+
+typedef struct mupdf_image_device_s {
+  fz_device super;
+  fz_image* image; /**< The only image drawn so far or NULL */
+  fz_matrix ctm;   /**< Transformation of image */
+  fz_rect clip;    /**< Intersection of all rectangular clips */
+  bool other;      /**< If anything but image and rectangular clips has been drawn */
+} mupdf_image_device_t;
+
+static void image_device_other(fz_device* dev) {
+  ((mupdf_image_device_t*)dev)->other = true;
+}
+
+static void image_device_fill_path(fz_context* GIRARA_UNUSED(ctx), fz_device* dev,
+                                   const fz_path* GIRARA_UNUSED(path), int GIRARA_UNUSED(even_odd),
+                                   fz_matrix GIRARA_UNUSED(ctm), fz_colorspace* GIRARA_UNUSED(colorspace),
+                                   const float* GIRARA_UNUSED(color), float GIRARA_UNUSED(alpha),
+                                   fz_color_params GIRARA_UNUSED(color_params)) {
+  image_device_other(dev);
+}
+
+static void image_device_stroke_path(fz_context* GIRARA_UNUSED(ctx), fz_device* dev,
+                                     const fz_path* GIRARA_UNUSED(path), const fz_stroke_state* GIRARA_UNUSED(stroke),
+                                     fz_matrix GIRARA_UNUSED(ctm), fz_colorspace* GIRARA_UNUSED(colorspace),
+                                     const float* GIRARA_UNUSED(color), float GIRARA_UNUSED(alpha),
+                                     fz_color_params GIRARA_UNUSED(color_params)) {
+  image_device_other(dev);
+}
+
+/* scanned pages are often clipped to the page, which does not matter as long
+ * as the image is inside the clip */
+static void image_device_clip_path(fz_context* ctx, fz_device* dev, const fz_path* path, int GIRARA_UNUSED(even_odd),
+                                   fz_matrix ctm, fz_rect GIRARA_UNUSED(scissor)) {
+  mupdf_image_device_t* device = (mupdf_image_device_t*)dev;
+  if (fz_path_is_rect(ctx, path, ctm) == 0) {
+    device->other = true;
+    return;
+  }
+
+  device->clip = fz_intersect_rect(device->clip, fz_bound_path(ctx, path, NULL, ctm));
+}
+
+static void image_device_clip_stroke_path(fz_context* GIRARA_UNUSED(ctx), fz_device* dev,
+                                          const fz_path* GIRARA_UNUSED(path),
+                                          const fz_stroke_state* GIRARA_UNUSED(stroke), fz_matrix GIRARA_UNUSED(ctm),
+                                          fz_rect GIRARA_UNUSED(scissor)) {
+  image_device_other(dev);
+}
+
+static void image_device_fill_text(fz_context* GIRARA_UNUSED(ctx), fz_device* dev, const fz_text* GIRARA_UNUSED(text),
+                                   fz_matrix GIRARA_UNUSED(ctm), fz_colorspace* GIRARA_UNUSED(colorspace),
+                                   const float* GIRARA_UNUSED(color), float GIRARA_UNUSED(alpha),
+                                   fz_color_params GIRARA_UNUSED(color_params)) {
+  image_device_other(dev);
+}
+
+static void image_device_stroke_text(fz_context* GIRARA_UNUSED(ctx), fz_device* dev,
+                                     const fz_text* GIRARA_UNUSED(text), const fz_stroke_state* GIRARA_UNUSED(stroke),
+                                     fz_matrix GIRARA_UNUSED(ctm), fz_colorspace* GIRARA_UNUSED(colorspace),
+                                     const float* GIRARA_UNUSED(color), float GIRARA_UNUSED(alpha),
+                                     fz_color_params GIRARA_UNUSED(color_params)) {
+  image_device_other(dev);
+}
+
+static void image_device_clip_text(fz_context* GIRARA_UNUSED(ctx), fz_device* dev, const fz_text* GIRARA_UNUSED(text),
+                                   fz_matrix GIRARA_UNUSED(ctm), fz_rect GIRARA_UNUSED(scissor)) {
+  image_device_other(dev);
+}
+
+static void image_device_clip_stroke_text(fz_context* GIRARA_UNUSED(ctx), fz_device* dev,
+                                          const fz_text* GIRARA_UNUSED(text),
+                                          const fz_stroke_state* GIRARA_UNUSED(stroke), fz_matrix GIRARA_UNUSED(ctm),
+                                          fz_rect GIRARA_UNUSED(scissor)) {
+  image_device_other(dev);
+}
+
+static void image_device_fill_shade(fz_context* GIRARA_UNUSED(ctx), fz_device* dev, fz_shade* GIRARA_UNUSED(shade),
+                                    fz_matrix GIRARA_UNUSED(ctm), float GIRARA_UNUSED(alpha),
+                                    fz_color_params GIRARA_UNUSED(color_params)) {
+  image_device_other(dev);
+}
+
+static void image_device_fill_image(fz_context* ctx, fz_device* dev, fz_image* image, fz_matrix ctm, float alpha,
+                                    fz_color_params GIRARA_UNUSED(color_params)) {
+  mupdf_image_device_t* device = (mupdf_image_device_t*)dev;
+  if (device->image != NULL || alpha != 1.0f || image->mask != NULL || image->imagemask != 0) {
+    device->other = true;
+    return;
+  }
+
+  device->image = fz_keep_image(ctx, image);
+  device->ctm   = ctm;
+}
+
+static void image_device_fill_image_mask(fz_context* GIRARA_UNUSED(ctx), fz_device* dev,
+                                         fz_image* GIRARA_UNUSED(image), fz_matrix GIRARA_UNUSED(ctm),
+                                         fz_colorspace* GIRARA_UNUSED(colorspace), const float* GIRARA_UNUSED(color),
+                                         float GIRARA_UNUSED(alpha), fz_color_params GIRARA_UNUSED(color_params)) {
+  image_device_other(dev);
+}
+
+static void image_device_clip_image_mask(fz_context* GIRARA_UNUSED(ctx), fz_device* dev,
+                                         fz_image* GIRARA_UNUSED(image), fz_matrix GIRARA_UNUSED(ctm),
+                                         fz_rect GIRARA_UNUSED(scissor)) {
+  image_device_other(dev);
+}
+
+static void image_device_begin_mask(fz_context* GIRARA_UNUSED(ctx), fz_device* dev, fz_rect GIRARA_UNUSED(area),
+                                    int GIRARA_UNUSED(luminosity), fz_colorspace* GIRARA_UNUSED(colorspace),
+                                    const float* GIRARA_UNUSED(backdrop),
+                                    fz_color_params GIRARA_UNUSED(color_params)) {
+  image_device_other(dev);
+}
+
+static void image_device_begin_group(fz_context* GIRARA_UNUSED(ctx), fz_device* dev, fz_rect GIRARA_UNUSED(area),
+                                     fz_colorspace* GIRARA_UNUSED(colorspace), int GIRARA_UNUSED(isolated),
+                                     int GIRARA_UNUSED(knockout), int GIRARA_UNUSED(blendmode),
+                                     float GIRARA_UNUSED(alpha)) {
+  image_device_other(dev);
+}
+
+static int image_device_begin_tile(fz_context* GIRARA_UNUSED(ctx), fz_device* dev, fz_rect GIRARA_UNUSED(area),
+                                   fz_rect GIRARA_UNUSED(view), float GIRARA_UNUSED(xstep), float GIRARA_UNUSED(ystep),
+                                   fz_matrix GIRARA_UNUSED(ctm), int GIRARA_UNUSED(id), int GIRARA_UNUSED(doc_id)) {
+  image_device_other(dev);
+  return 0;
+}
+
+static void image_device_drop(fz_context* ctx, fz_device* dev) {
+  fz_drop_image(ctx, ((mupdf_image_device_t*)dev)->image);
+}
+
+/* Invisible text, e.g. the recognized text of scanned pages, is ignored */
+static fz_device* new_image_device(fz_context* ctx) {
+  mupdf_image_device_t* device = fz_new_derived_device(ctx, mupdf_image_device_t);
+  device->clip                 = fz_infinite_rect;
+
+  device->super.fill_path        = image_device_fill_path;
+  device->super.stroke_path      = image_device_stroke_path;
+  device->super.clip_path        = image_device_clip_path;
+  device->super.clip_stroke_path = image_device_clip_stroke_path;
+
+  device->super.fill_text        = image_device_fill_text;
+  device->super.stroke_text      = image_device_stroke_text;
+  device->super.clip_text        = image_device_clip_text;
+  device->super.clip_stroke_text = image_device_clip_stroke_text;
+
+  device->super.fill_shade      = image_device_fill_shade;
+  device->super.fill_image      = image_device_fill_image;
+  device->super.fill_image_mask = image_device_fill_image_mask;
+  device->super.clip_image_mask = image_device_clip_image_mask;
+
+  device->super.begin_mask  = image_device_begin_mask;
+  device->super.begin_group = image_device_begin_group;
+  device->super.begin_tile  = image_device_begin_tile;
+
+  device->super.drop_device = image_device_drop;
+
+  return &device->super;
+}
+
+fz_image* mupdf_page_single_image(fz_context* ctx, fz_display_list* list, fz_matrix* ctm) {
+  fz_device* volatile device = NULL;
+  fz_image* image            = NULL;
+
+  fz_try(ctx) {
+    device = new_image_device(ctx);
+    fz_run_display_list(ctx, list, device, fz_identity, fz_infinite_rect, NULL);
+    fz_close_device(ctx, device);
+
+    mupdf_image_device_t* image_device = (mupdf_image_device_t*)device;
+    const fz_rect bounds               = fz_transform_rect(fz_unit_rect, image_device->ctm);
+    if (image_device->image != NULL && image_device->other == false &&
+        fz_contains_rect(fz_expand_rect(image_device->clip, 0.5f), bounds) != 0) {
+      image = fz_keep_image(ctx, image_device->image);
+      *ctm  = image_device->ctm;
+    }
+  }
+  fz_always(ctx) {
+    fz_drop_device(ctx, device);
+  }
+  fz_catch(ctx) {
+    fz_rethrow(ctx);
+  }
+
+  return image;
+}
+
+void mupdf_display_list_count(fz_context* ctx, fz_display_list* list, mupdf_page_stats_t* stats) {
+  fz_device* volatile device = NULL;
+
+  fz_try(ctx) {
+    device = new_count_device(ctx, stats);
+    fz_run_display_list(ctx, list, device, fz_identity, fz_infinite_rect, NULL);
+    fz_close_device(ctx, device);
+  }
+  fz_always(ctx) {
+    fz_drop_device(ctx, device);
+  }
+  fz_catch(ctx) {
+    fz_rethrow(ctx);
+  }
+}
+
+void mupdf_page_analyze(fz_context* ctx, fz_page* page, mupdf_page_stats_t* stats) {
+  fz_display_list* volatile list = NULL;
+  fz_device* volatile device     = NULL;
+  fz_pixmap* volatile pixmap     = NULL;
+  fz_cookie cookie               = {0};
+
+  *stats = (mupdf_page_stats_t){0};
+
+  fz_try(ctx) {
+    const fz_rect bounds = fz_bound_page(ctx, page);
+
+    /* the page is interpreted once into a display list, which is then replayed
+     * to count its contents and to rasterize it */
+    gint64 start = g_get_monotonic_time();
+    list         = fz_new_display_list(ctx, bounds);
+    device       = fz_new_list_device(ctx, list);
+    fz_run_page(ctx, page, device, fz_identity, &cookie);
+    fz_close_device(ctx, device);
+    fz_drop_device(ctx, device);
+    device                     = NULL;
+    stats->interpretation_time = g_get_monotonic_time() - start;
+
+    if (cookie.incomplete != 0) {
+      fz_throw(ctx, FZ_ERROR_TRYLATER, "page is not yet complete");
+    }
+
+    mupdf_display_list_count(ctx, list, stats);
+
+    const float area    = fz_max((bounds.x1 - bounds.x0) * (bounds.y1 - bounds.y0), 1);
+    const float scale   = fz_min(MUPDF_ANALYZE_DPI / 72.0f, sqrtf(MUPDF_ANALYZE_MAX_PIXELS / area));
+    const fz_matrix ctm = fz_scale(scale, scale);
+
+    start  = g_get_monotonic_time();
+    pixmap = fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), fz_round_rect(fz_transform_rect(bounds, ctm)), NULL, 0);
+    fz_clear_pixmap_with_value(ctx, pixmap, 0xFF);
+    device = fz_new_draw_device(ctx, fz_identity, pixmap);
+    fz_run_display_list(ctx, list, device, ctm, fz_infinite_rect, NULL);
+    fz_close_device(ctx, device);
+    stats->raster_time = g_get_monotonic_time() - start;
+  }
+  fz_always(ctx) {
+    fz_drop_device(ctx, device);
+    fz_drop_pixmap(ctx, pixmap);
+    fz_drop_display_list(ctx, list);
+  }
+  fz_catch(ctx) {
+    fz_rethrow(ctx);
+  }
+}
+
+char* mupdf_page_stats_format(const mupdf_page_stats_t* stats) {
+  return g_strdup_printf("%.1f ms interpretation, %.1f ms rasterization, %" PRIu64 " path segments in %u paths, "
+                         "%u images with %.1f megapixels, %u text runs with %" PRIu64 " glyphs, %u shadings, "
+                         "%u transparency groups, %u soft masks, %u tiling patterns",
+                         stats->interpretation_time / 1000.0, stats->raster_time / 1000.0, stats->path_segments,
+                         stats->paths, stats->images, stats->image_pixels / 1e6, stats->text_runs, stats->glyphs,
+                         stats->shadings, stats->groups, stats->masks, stats->tiles);
+}
@@ -22,7 +22,7 @@ girara_list_t* pdf_document_attachments_get(zathura_document_t* document, void*
   }
 
   /* Extract attachments */
-  g_mutex_lock(&mupdf_document->mutex);
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_BACKGROUND);
   fz_try(mupdf_document->ctx) {
     pdf_document* pdf_doc = pdf_specifics(mupdf_document->ctx, mupdf_document->document);
     pdf_filespec_params fs_params;
@@ -41,10 +41,10 @@ girara_list_t* pdf_document_attachments_get(zathura_document_t* document, void*
     if (error != NULL) {
       *error = ZATHURA_ERROR_UNKNOWN;
     }
-    g_mutex_unlock(&mupdf_document->mutex);
+    mupdf_document_unlock(mupdf_document);
     goto error_free;
   }
-  g_mutex_unlock(&mupdf_document->mutex);
+  mupdf_document_unlock(mupdf_document);
 
   return list;
 
@@ -70,7 +70,7 @@ zathura_error_t pdf_document_attachment_save(zathura_document_t* document, void*
   }
   mupdf_document_t* mupdf_document = data;
 
-  g_mutex_lock(&mupdf_document->mutex);
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_BACKGROUND);
   fz_try(mupdf_document->ctx) {
     pdf_document* pdf_doc = pdf_specifics(mupdf_document->ctx, mupdf_document->document);
     pdf_filespec_params fs_params;
@@ -92,10 +92,10 @@ zathura_error_t pdf_document_attachment_save(zathura_document_t* document, void*
     }
   }
   fz_catch(mupdf_document->ctx) {
-    g_mutex_unlock(&mupdf_document->mutex);
+    mupdf_document_unlock(mupdf_document);
     return ZATHURA_ERROR_UNKNOWN;
   }
-  g_mutex_unlock(&mupdf_document->mutex);
+  mupdf_document_unlock(mupdf_document);
 
   return ZATHURA_ERROR_OK;
 }
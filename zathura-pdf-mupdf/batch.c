@@ -0,0 +1,366 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "utils.h"
+
+/* Default size of the longer side of thumbnails in pixels */
+#define BATCH_DEFAULT_THUMBNAIL_SIZE 256
+
+typedef struct batch_options_s {
+  gint jobs;            /**< Number of worker threads */
+  gint size;            /**< Size of the longer side of thumbnails */
+  gchar* format;        /**< Thumbnail format (png or ppm) */
+  gchar* output;        /**< Output directory */
+  gchar* list;          /**< File with one document path per line or - for stdin */
+  gboolean no_thumbnails;
+  gboolean no_text;
+  gboolean no_info;
+  gboolean analyze;     /**< Measure the complexity of pages */
+  gchar* recolor;       /**< Recoloring of thumbnails, see mupdf_recolor_parse */
+  gchar** files;        /**< Documents given on the command line */
+} batch_options_t;
+
+static mupdf_recolor_t recolor;
+
+static batch_options_t options = {
+    .size = BATCH_DEFAULT_THUMBNAIL_SIZE,
+};
+
+static gint files_processed = 0;
+static gint files_failed    = 0;
+
+/* Every worker thread uses its own clone of the base context */
+static GPrivate worker_context = G_PRIVATE_INIT((GDestroyNotify)fz_drop_context);
+
+static const char* information_name(zathura_document_information_type_t type) {
+  switch (type) {
+  case ZATHURA_DOCUMENT_INFORMATION_TITLE:
+    return "Title";
+  case ZATHURA_DOCUMENT_INFORMATION_AUTHOR:
+    return "Author";
+  case ZATHURA_DOCUMENT_INFORMATION_SUBJECT:
+    return "Subject";
+  case ZATHURA_DOCUMENT_INFORMATION_KEYWORDS:
+    return "Keywords";
+  case ZATHURA_DOCUMENT_INFORMATION_CREATOR:
+    return "Creator";
+  case ZATHURA_DOCUMENT_INFORMATION_PRODUCER:
+    return "Producer";
+  case ZATHURA_DOCUMENT_INFORMATION_CREATION_DATE:
+    return "CreationDate";
+  case ZATHURA_DOCUMENT_INFORMATION_MODIFICATION_DATE:
+    return "ModDate";
+  default:
+    return "Other";
+  }
+}
+
+static void append_information(zathura_document_information_type_t type, const char* value, void* data) {
+  g_string_append_printf(data, "%s: %s\n", information_name(type), value);
+}
+
+/* Creates the output directory of a document; documents with the same name
+ * get a numeric suffix */
+static char* create_output_dir(const char* path) {
+  char* basename = g_path_get_basename(path);
+  char* dir      = g_build_filename(options.output, basename, NULL);
+
+  for (unsigned int i = 1; g_mkdir(dir, 0755) != 0; i++) {
+    g_free(dir);
+    if (errno != EEXIST) {
+      dir = NULL;
+      break;
+    }
+
+    char* name = g_strdup_printf("%s.%u", basename, i);
+    dir        = g_build_filename(options.output, name, NULL);
+    g_free(name);
+  }
+
+  g_free(basename);
+  return dir;
+}
+
+static void write_information(fz_context* ctx, fz_document* document, int pages, const char* output_dir) {
+  GString* information = g_string_new(NULL);
+  g_string_append_printf(information, "Pages: %d\n", pages);
+  mupdf_document_information(ctx, document, append_information, information);
+
+  char* path = g_build_filename(output_dir, "info.txt", NULL);
+  g_file_set_contents(path, information->str, information->len, NULL);
+  g_free(path);
+
+  g_string_free(information, TRUE);
+}
+
+static void append_page_stats(GString* analysis, int index, const mupdf_page_stats_t* stats) {
+  g_string_append_printf(analysis,
+                         "%d\t%" G_GINT64_FORMAT "\t%" G_GINT64_FORMAT "\t%u\t%" PRIu64 "\t%u\t%" PRIu64 "\t%u\t%" PRIu64
+                         "\t%u\t%u\t%u\t%u\n",
+                         index + 1, stats->interpretation_time, stats->raster_time, stats->paths, stats->path_segments,
+                         stats->images, stats->image_pixels, stats->text_runs, stats->glyphs, stats->shadings,
+                         stats->groups, stats->masks, stats->tiles);
+}
+
+static void process_page(fz_context* ctx, fz_document* document, int index, const char* output_dir,
+                         GString* analysis) {
+  fz_page* volatile page     = NULL;
+  fz_pixmap* volatile pixmap = NULL;
+  fz_buffer* volatile text   = NULL;
+  char* volatile path        = NULL;
+
+  fz_try(ctx) {
+    page = fz_load_page(ctx, document, index);
+
+    if (options.no_thumbnails == FALSE) {
+      pixmap = mupdf_page_thumbnail(ctx, page, options.size);
+      if (recolor.enabled == true) {
+        fz_tint_pixmap(ctx, pixmap, recolor.dark_color, recolor.light_color);
+      }
+      path   = g_strdup_printf("%s/page-%04d.%s", output_dir, index + 1, options.format);
+      if (g_strcmp0(options.format, "ppm") == 0) {
+        fz_save_pixmap_as_pnm(ctx, pixmap, path);
+      } else {
+        fz_save_pixmap_as_png(ctx, pixmap, path);
+      }
+      g_free(path);
+      path = NULL;
+    }
+
+    if (options.no_text == FALSE) {
+      text = fz_new_buffer_from_page(ctx, page, NULL);
+      path = g_strdup_printf("%s/page-%04d.txt", output_dir, index + 1);
+      fz_save_buffer(ctx, text, path);
+    }
+
+    if (analysis != NULL) {
+      mupdf_page_stats_t stats;
+      mupdf_page_analyze(ctx, page, &stats);
+      append_page_stats(analysis, index, &stats);
+    }
+  }
+  fz_always(ctx) {
+    g_free(path);
+    fz_drop_buffer(ctx, text);
+    fz_drop_pixmap(ctx, pixmap);
+    fz_drop_page(ctx, page);
+  }
+  fz_catch(ctx) {
+    fz_rethrow(ctx);
+  }
+}
+
+static bool process_file(fz_context* ctx, const char* path) {
+  char* output_dir = create_output_dir(path);
+  if (output_dir == NULL) {
+    fprintf(stderr, "%s: failed to create output directory: %s\n", path, g_strerror(errno));
+    return false;
+  }
+
+  fz_stream* volatile stream     = NULL;
+  fz_document* volatile document = NULL;
+  GString* volatile analysis     = NULL;
+  bool success                   = true;
+
+  fz_try(ctx) {
+    stream   = mupdf_open_file_stream(ctx, path, true);
+    document = fz_open_document_with_stream(ctx, path, stream);
+    if (fz_needs_password(ctx, document) != 0) {
+      fz_throw(ctx, FZ_ERROR_ARGUMENT, "document is encrypted");
+    }
+
+    const int pages = fz_count_pages(ctx, document);
+    if (options.no_info == FALSE) {
+      write_information(ctx, document, pages, output_dir);
+    }
+
+    /* pages are processed one after another, so the memory used per worker is
+     * bounded by the largest page, not by the size of the document */
+    if (options.analyze == TRUE) {
+      analysis = g_string_new("page\tinterpretation_us\traster_us\tpaths\tpath_segments\timages\timage_pixels\t"
+                              "text_runs\tglyphs\tshadings\tgroups\tmasks\ttiles\n");
+    }
+
+    if (options.no_thumbnails == FALSE || options.no_text == FALSE || analysis != NULL) {
+      for (int i = 0; i < pages; i++) {
+        process_page(ctx, document, i, output_dir, analysis);
+      }
+    }
+
+    if (analysis != NULL) {
+      char* analysis_path = g_build_filename(output_dir, "analysis.tsv", NULL);
+      g_file_set_contents(analysis_path, analysis->str, analysis->len, NULL);
+      g_free(analysis_path);
+    }
+  }
+  fz_always(ctx) {
+    if (analysis != NULL) {
+      g_string_free(analysis, TRUE);
+    }
+    fz_drop_document(ctx, document);
+    fz_drop_stream(ctx, stream);
+  }
+  fz_catch(ctx) {
+    fprintf(stderr, "%s: %s\n", path, fz_caught_message(ctx));
+    success = false;
+  }
+
+  if (success == false) {
+    /* only succeeds if nothing has been written */
+    g_rmdir(output_dir);
+  }
+
+  g_free(output_dir);
+  return success;
+}
+
+static void worker(gpointer data, gpointer GIRARA_UNUSED(user_data)) {
+  char* path = data;
+
+  fz_context* ctx = g_private_get(&worker_context);
+  if (ctx == NULL) {
+    ctx = mupdf_context_new();
+    g_private_set(&worker_context, ctx);
+  }
+
+  if (ctx == NULL || process_file(ctx, path) == false) {
+    g_atomic_int_inc(&files_failed);
+  }
+  g_atomic_int_inc(&files_processed);
+
+  g_free(path);
+}
+
+static bool push_file(GThreadPool* pool, const char* path) {
+  GError* error = NULL;
+  if (g_thread_pool_push(pool, g_strdup(path), &error) == FALSE) {
+    fprintf(stderr, "failed to queue %s: %s\n", path, error->message);
+    g_error_free(error);
+    return false;
+  }
+
+  return true;
+}
+
+/* Queues all documents listed in a file, one path per line */
+static bool push_list(GThreadPool* pool, const char* list) {
+  FILE* file = g_strcmp0(list, "-") == 0 ? stdin : fopen(list, "r");
+  if (file == NULL) {
+    fprintf(stderr, "failed to open %s: %s\n", list, g_strerror(errno));
+    return false;
+  }
+
+  char* line    = NULL;
+  size_t length = 0;
+  bool success  = true;
+
+  while (success == true && getline(&line, &length, file) != -1) {
+    g_strchomp(line);
+    if (line[0] != '\0') {
+      success = push_file(pool, line);
+    }
+  }
+
+  free(line);
+  if (file != stdin) {
+    fclose(file);
+  }
+
+  return success;
+}
+
+int main(int argc, char* argv[]) {
+  GOptionEntry entries[] = {
+      {"jobs", 'j', 0, G_OPTION_ARG_INT, &options.jobs, "Number of parallel workers (default: number of CPUs)", "N"},
+      {"output", 'o', 0, G_OPTION_ARG_FILENAME, &options.output, "Output directory", "DIR"},
+      {"list", 'l', 0, G_OPTION_ARG_FILENAME, &options.list, "Read document paths from FILE (- for stdin)", "FILE"},
+      {"size", 's', 0, G_OPTION_ARG_INT, &options.size, "Size of the longer side of thumbnails", "PIXELS"},
+      {"format", 'f', 0, G_OPTION_ARG_STRING, &options.format, "Thumbnail format: png or ppm", "FORMAT"},
+      {"no-thumbnails", 0, 0, G_OPTION_ARG_NONE, &options.no_thumbnails, "Do not render thumbnails", NULL},
+      {"no-text", 0, 0, G_OPTION_ARG_NONE, &options.no_text, "Do not extract text", NULL},
+      {"no-info", 0, 0, G_OPTION_ARG_NONE, &options.no_info, "Do not write document information", NULL},
+      {"analyze", 'a', 0, G_OPTION_ARG_NONE, &options.analyze, "Measure the complexity of every page", NULL},
+      {"recolor", 'r', 0, G_OPTION_ARG_STRING, &options.recolor, "Recolor thumbnails: invert or #DARK:#LIGHT",
+       "SPEC"},
+      {G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &options.files, NULL, "FILE..."},
+      {NULL, 0, 0, 0, NULL, NULL, NULL},
+  };
+
+  GOptionContext* context = g_option_context_new("- render thumbnails and extract text of documents");
+  g_option_context_add_main_entries(context, entries, NULL);
+
+  GError* error = NULL;
+  if (g_option_context_parse(context, &argc, &argv, &error) == FALSE) {
+    fprintf(stderr, "%s\n", error->message);
+    g_error_free(error);
+    g_option_context_free(context);
+    return 1;
+  }
+  g_option_context_free(context);
+
+  if (options.output == NULL || (options.files == NULL && options.list == NULL)) {
+    fprintf(stderr, "an output directory and at least one document are required\n");
+    return 1;
+  }
+  if (options.format == NULL) {
+    options.format = g_strdup("png");
+  } else if (g_strcmp0(options.format, "png") != 0 && g_strcmp0(options.format, "ppm") != 0) {
+    fprintf(stderr, "unsupported thumbnail format: %s\n", options.format);
+    return 1;
+  }
+  if (options.recolor != NULL && mupdf_recolor_parse(options.recolor, &recolor) == false) {
+    fprintf(stderr, "invalid recoloring: %s\n", options.recolor);
+    return 1;
+  }
+  if (options.size <= 0) {
+    options.size = BATCH_DEFAULT_THUMBNAIL_SIZE;
+  }
+  if (options.jobs <= 0) {
+    options.jobs = g_get_num_processors();
+  }
+
+  if (g_mkdir_with_parents(options.output, 0755) != 0) {
+    fprintf(stderr, "failed to create %s: %s\n", options.output, g_strerror(errno));
+    return 1;
+  }
+
+  GThreadPool* pool = g_thread_pool_new(worker, NULL, options.jobs, TRUE, &error);
+  if (pool == NULL) {
+    fprintf(stderr, "failed to start workers: %s\n", error->message);
+    g_error_free(error);
+    return 1;
+  }
+
+  const gint64 start = g_get_monotonic_time();
+  bool success       = true;
+
+  for (gchar** file = options.files; file != NULL && *file != NULL && success == true; file++) {
+    success = push_file(pool, *file);
+  }
+  if (options.list != NULL && success == true) {
+    success = push_list(pool, options.list);
+  }
+
+  /* wait for all queued documents */
+  g_thread_pool_free(pool, FALSE, TRUE);
+
+  const double seconds = (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC;
+  const gint processed = g_atomic_int_get(&files_processed);
+  const gint failed    = g_atomic_int_get(&files_failed);
+
+  fprintf(stderr, "%d files (%d failed) in %.2f s: %.2f files/s\n", processed, failed, seconds,
+          seconds > 0 ? processed / seconds : 0.0);
+
+  g_strfreev(options.files);
+  g_free(options.format);
+  g_free(options.output);
+  g_free(options.list);
+  g_free(options.recolor);
+
+  return success == true && failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include "cache.h"
+
+typedef struct mupdf_cache_entry_s {
+  void* key;
+  void* value;
+  size_t size;
+  GList link; /**< Link in the recently used queue */
+} mupdf_cache_entry_t;
+
+struct mupdf_cache_s {
+  GHashTable* entries;               /**< Key to entry */
+  GQueue queue;                      /**< Entries, most recently used first */
+  size_t size;                       /**< Sum of the sizes of all entries */
+  size_t budget;                     /**< Maximal size */
+  GDestroyNotify key_destroy_func;   /**< Frees keys */
+  GDestroyNotify value_destroy_func; /**< Frees values */
+};
+
+static void cache_entry_free(mupdf_cache_t* cache, mupdf_cache_entry_t* entry) {
+  if (cache->key_destroy_func != NULL) {
+    cache->key_destroy_func(entry->key);
+  }
+  if (cache->value_destroy_func != NULL) {
+    cache->value_destroy_func(entry->value);
+  }
+  g_free(entry);
+}
+
+static void cache_entry_remove(mupdf_cache_t* cache, mupdf_cache_entry_t* entry) {
+  g_hash_table_remove(cache->entries, entry->key);
+  g_queue_unlink(&cache->queue, &entry->link);
+  cache->size -= entry->size;
+
+  cache_entry_free(cache, entry);
+}
+
+mupdf_cache_t* mupdf_cache_new(size_t budget, GHashFunc hash_func, GEqualFunc key_equal_func,
+                               GDestroyNotify key_destroy_func, GDestroyNotify value_destroy_func) {
+  mupdf_cache_t* cache = g_malloc0(sizeof(mupdf_cache_t));
+
+  cache->entries            = g_hash_table_new(hash_func, key_equal_func);
+  cache->budget             = budget;
+  cache->key_destroy_func   = key_destroy_func;
+  cache->value_destroy_func = value_destroy_func;
+  g_queue_init(&cache->queue);
+
+  return cache;
+}
+
+void mupdf_cache_free(mupdf_cache_t* cache) {
+  if (cache == NULL) {
+    return;
+  }
+
+  mupdf_cache_clear(cache);
+  g_hash_table_unref(cache->entries);
+  g_free(cache);
+}
+
+void* mupdf_cache_lookup(mupdf_cache_t* cache, const void* key) {
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  mupdf_cache_entry_t* entry = g_hash_table_lookup(cache->entries, key);
+  if (entry == NULL) {
+    return NULL;
+  }
+
+  g_queue_unlink(&cache->queue, &entry->link);
+  g_queue_push_head_link(&cache->queue, &entry->link);
+
+  return entry->value;
+}
+
+bool mupdf_cache_insert(mupdf_cache_t* cache, void* key, void* value, size_t size) {
+  if (cache == NULL) {
+    return false;
+  }
+
+  mupdf_cache_entry_t* entry = g_malloc0(sizeof(mupdf_cache_entry_t));
+  entry->key                 = key;
+  entry->value               = value;
+  entry->size                = size;
+  entry->link.data           = entry;
+
+  mupdf_cache_remove(cache, key);
+  if (size > cache->budget) {
+    cache_entry_free(cache, entry);
+    return false;
+  }
+
+  while (cache->size + size > cache->budget) {
+    cache_entry_remove(cache, g_queue_peek_tail(&cache->queue));
+  }
+
+  g_hash_table_insert(cache->entries, key, entry);
+  g_queue_push_head_link(&cache->queue, &entry->link);
+  cache->size += size;
+
+  return true;
+}
+
+void mupdf_cache_remove(mupdf_cache_t* cache, const void* key) {
+  if (cache == NULL) {
+    return;
+  }
+
+  mupdf_cache_entry_t* entry = g_hash_table_lookup(cache->entries, key);
+  if (entry != NULL) {
+    cache_entry_remove(cache, entry);
+  }
+}
+
+void mupdf_cache_clear(mupdf_cache_t* cache) {
+  if (cache == NULL) {
+    return;
+  }
+
+  while (g_queue_is_empty(&cache->queue) == FALSE) {
+    cache_entry_remove(cache, g_queue_peek_head(&cache->queue));
+  }
+}
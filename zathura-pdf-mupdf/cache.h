@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: Zlib */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <glib.h>
+
+/**
+ * Least recently used cache with a byte budget
+ *
+ * The cache is not thread-safe; callers serialize access, usually with the
+ * document lock.
+ */
+typedef struct mupdf_cache_s mupdf_cache_t;
+
+/**
+ * Creates a new cache
+ *
+ * @param budget Maximal sum of the sizes of all entries in bytes
+ * @param hash_func Hash function for keys
+ * @param key_equal_func Equality function for keys
+ * @param key_destroy_func Function to free keys or NULL
+ * @param value_destroy_func Function to free values or NULL
+ * @return The cache
+ */
+mupdf_cache_t* mupdf_cache_new(size_t budget, GHashFunc hash_func, GEqualFunc key_equal_func,
+                               GDestroyNotify key_destroy_func, GDestroyNotify value_destroy_func);
+
+/**
+ * Frees the cache and all its entries
+ *
+ * @param cache The cache
+ */
+void mupdf_cache_free(mupdf_cache_t* cache);
+
+/**
+ * Looks up an entry and marks it as most recently used
+ *
+ * @param cache The cache
+ * @param key The key
+ * @return The value or NULL if there is no entry for key
+ */
+void* mupdf_cache_lookup(mupdf_cache_t* cache, const void* key);
+
+/**
+ * Adds an entry to the cache
+ *
+ * An existing entry with the same key is replaced. Least recently used
+ * entries are evicted until the entry fits into the budget; entries larger
+ * than the budget are freed immediately. The cache takes ownership of key and
+ * value in any case.
+ *
+ * @param cache The cache
+ * @param key The key
+ * @param value The value
+ * @param size Size of the entry in bytes
+ * @return true if the entry has been added, false if it was too large
+ */
+bool mupdf_cache_insert(mupdf_cache_t* cache, void* key, void* value, size_t size);
+
+/**
+ * Removes an entry from the cache
+ *
+ * @param cache The cache
+ * @param key The key
+ */
+void mupdf_cache_remove(mupdf_cache_t* cache, const void* key);
+
+/**
+ * Removes all entries from the cache
+ *
+ * @param cache The cache
+ */
+void mupdf_cache_clear(mupdf_cache_t* cache);
+
+#endif // CACHE_H
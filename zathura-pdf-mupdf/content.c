@@ -0,0 +1,710 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include <glib.h>
+#include <girara/utils.h>
+#include <mupdf/pdf.h>
+
+#include "plugin.h"
+#include "utils.h"
+
+/* Maximal number of pages whose display lists are kept */
+#define MUPDF_DISPLAY_LIST_CACHE_PAGES 64
+/* Maximal nesting of objects that is hashed for page fingerprints */
+#define MUPDF_FINGERPRINT_MAX_DEPTH 64
+/* Maximal number of pages whose contents are stashed */
+#define MUPDF_STASH_PAGES 256
+/* Seconds after which stashed contents are dropped; reloads open the
+ * document again right after closing it */
+#define MUPDF_STASH_TIMEOUT 10
+
+/* Page contents of the last closed document, so that they can be reused if
+ * the same file is opened again */
+static GMutex stash_mutex;
+static char* stash_path          = NULL;
+static GPtrArray* stash_contents = NULL;
+static guint stash_generation    = 0;
+
+/* Identifier of the next page contents */
+static gint next_content_id = 0;
+
+mupdf_page_content_t* mupdf_page_content_new(fz_context* ctx, fz_rect bbox) {
+  mupdf_page_content_t* content = g_malloc0(sizeof(mupdf_page_content_t));
+  content->ref_count            = 1;
+  content->id                   = g_atomic_int_add(&next_content_id, 1);
+  content->list_link.data       = content;
+
+  fz_try(ctx) {
+    content->text = fz_new_stext_page(ctx, bbox);
+  }
+  fz_catch(ctx) {
+    g_free(content);
+    return NULL;
+  }
+
+  return content;
+}
+
+static bool has_display_lists(const mupdf_page_content_t* content) {
+  for (unsigned int i = 0; i < MUPDF_LAYER_COUNT; i++) {
+    if (content->lists[i] != NULL) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void drop_display_list(fz_context* ctx, mupdf_page_content_t* content, unsigned int layer) {
+  fz_drop_display_list(ctx, content->lists[layer]);
+  content->lists[layer]    = NULL;
+  content->portable[layer] = false;
+}
+
+static void drop_display_lists(fz_context* ctx, mupdf_page_content_t* content) {
+  for (unsigned int i = 0; i < MUPDF_LAYER_COUNT; i++) {
+    drop_display_list(ctx, content, i);
+  }
+}
+
+/* Moves a recorded layer to contents that have not recorded it yet */
+static void move_display_list(mupdf_page_content_t* to, mupdf_page_content_t* from, unsigned int layer) {
+  to->lists[layer]      = from->lists[layer];
+  to->portable[layer]   = from->portable[layer];
+  from->lists[layer]    = NULL;
+  from->portable[layer] = false;
+}
+
+mupdf_page_content_t* mupdf_page_content_ref(mupdf_page_content_t* content) {
+  if (content != NULL) {
+    g_atomic_int_inc(&content->ref_count);
+  }
+
+  return content;
+}
+
+void mupdf_page_content_unref(fz_context* ctx, mupdf_page_content_t* content) {
+  if (content == NULL || g_atomic_int_dec_and_test(&content->ref_count) == FALSE) {
+    return;
+  }
+
+  fz_drop_stext_page(ctx, content->text);
+  drop_display_lists(ctx, content);
+  fz_drop_image(ctx, content->image);
+  if (content->links != NULL) {
+    g_array_free(content->links, TRUE);
+  }
+  g_free(content);
+}
+
+void mupdf_page_contents_free(fz_context* ctx, GPtrArray* contents) {
+  if (contents == NULL) {
+    return;
+  }
+
+  for (unsigned int i = 0; i < contents->len; i++) {
+    mupdf_page_content_unref(ctx, g_ptr_array_index(contents, i));
+  }
+  g_ptr_array_free(contents, TRUE);
+}
+
+static void hash_stream(fz_context* ctx, pdf_document* pdf, GHashTable* digests, GChecksum* checksum, int num) {
+  guint8* digest = g_hash_table_lookup(digests, GINT_TO_POINTER(num));
+  if (digest == NULL) {
+    fz_buffer* data = pdf_load_raw_stream_number(ctx, pdf, num);
+
+    GChecksum* stream_checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_checksum_update(stream_checksum, data->data, data->len);
+    fz_drop_buffer(ctx, data);
+
+    gsize length = MUPDF_LAYER_FINGERPRINT_LENGTH;
+    digest       = g_malloc(length);
+    g_checksum_get_digest(stream_checksum, digest, &length);
+    g_checksum_free(stream_checksum);
+
+    g_hash_table_insert(digests, GINT_TO_POINTER(num), digest);
+  }
+
+  g_checksum_update(checksum, digest, MUPDF_LAYER_FINGERPRINT_LENGTH);
+}
+
+static void hash_string(GChecksum* checksum, const char* format, ...) G_GNUC_PRINTF(2, 3);
+
+static void hash_string(GChecksum* checksum, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  char* string = g_strdup_vprintf(format, args);
+  va_end(args);
+
+  /* including the terminator keeps consecutive values apart */
+  g_checksum_update(checksum, (const guchar*)string, strlen(string) + 1);
+  g_free(string);
+}
+
+/* Hashes an object and everything it references. Object numbers are not
+ * hashed, since they change whenever the file is written again. */
+static void hash_object(fz_context* ctx, pdf_document* pdf, GHashTable* digests, GHashTable* path,
+                        GChecksum* checksum, pdf_obj* obj, unsigned int depth) {
+  if (depth > MUPDF_FINGERPRINT_MAX_DEPTH) {
+    hash_string(checksum, "deep");
+    return;
+  }
+
+  if (pdf_is_indirect(ctx, obj) != 0) {
+    const int num = pdf_to_num(ctx, obj);
+    if (g_hash_table_contains(path, GINT_TO_POINTER(num)) == TRUE) {
+      hash_string(checksum, "cycle");
+      return;
+    }
+
+    /* references to pages, e.g. link destinations, only matter by number */
+    pdf_obj* resolved = pdf_resolve_indirect(ctx, obj);
+    if (pdf_name_eq(ctx, pdf_dict_get(ctx, resolved, PDF_NAME(Type)), PDF_NAME(Page)) != 0) {
+      hash_string(checksum, "page %d", pdf_lookup_page_number(ctx, pdf, resolved));
+      return;
+    }
+
+    g_hash_table_add(path, GINT_TO_POINTER(num));
+    hash_object(ctx, pdf, digests, path, checksum, resolved, depth + 1);
+    if (pdf_obj_num_is_stream(ctx, pdf, num) != 0) {
+      hash_stream(ctx, pdf, digests, checksum, num);
+    }
+    g_hash_table_remove(path, GINT_TO_POINTER(num));
+  } else if (pdf_is_null(ctx, obj) != 0) {
+    hash_string(checksum, "null");
+  } else if (pdf_is_bool(ctx, obj) != 0) {
+    hash_string(checksum, "%s", pdf_to_bool(ctx, obj) != 0 ? "true" : "false");
+  } else if (pdf_is_int(ctx, obj) != 0) {
+    hash_string(checksum, "i%" G_GINT64_FORMAT, (gint64)pdf_to_int64(ctx, obj));
+  } else if (pdf_is_real(ctx, obj) != 0) {
+    hash_string(checksum, "r%g", pdf_to_real(ctx, obj));
+  } else if (pdf_is_name(ctx, obj) != 0) {
+    hash_string(checksum, "/%s", pdf_to_name(ctx, obj));
+  } else if (pdf_is_string(ctx, obj) != 0) {
+    hash_string(checksum, "(%zu", pdf_to_str_len(ctx, obj));
+    g_checksum_update(checksum, (const guchar*)pdf_to_str_buf(ctx, obj), pdf_to_str_len(ctx, obj));
+  } else if (pdf_is_array(ctx, obj) != 0) {
+    hash_string(checksum, "[%d", pdf_array_len(ctx, obj));
+    for (int i = 0; i < pdf_array_len(ctx, obj); i++) {
+      hash_object(ctx, pdf, digests, path, checksum, pdf_array_get(ctx, obj, i), depth + 1);
+    }
+  } else if (pdf_is_dict(ctx, obj) != 0) {
+    hash_string(checksum, "<<%d", pdf_dict_len(ctx, obj));
+    for (int i = 0; i < pdf_dict_len(ctx, obj); i++) {
+      /* skip references back to the page tree and to the page */
+      pdf_obj* key = pdf_dict_get_key(ctx, obj, i);
+      if (pdf_name_eq(ctx, key, PDF_NAME(Parent)) != 0 || pdf_name_eq(ctx, key, PDF_NAME(P)) != 0) {
+        continue;
+      }
+
+      hash_string(checksum, "/%s", pdf_to_name(ctx, key));
+      hash_object(ctx, pdf, digests, path, checksum, pdf_dict_get_val(ctx, obj, i), depth + 1);
+    }
+  }
+}
+
+/* Hashes the value and the appearance settings of a form field, which a
+ * widget may inherit from its parent fields */
+static void hash_field(fz_context* ctx, pdf_document* pdf, GHashTable* digests, GHashTable* path,
+                       GChecksum* checksum, pdf_obj* widget) {
+  pdf_obj* keys[] = {
+      PDF_NAME(FT), PDF_NAME(Ff), PDF_NAME(V), PDF_NAME(DA), PDF_NAME(Q), PDF_NAME(Opt),
+  };
+  for (unsigned int i = 0; i < G_N_ELEMENTS(keys); i++) {
+    hash_string(checksum, "/%s", pdf_to_name(ctx, keys[i]));
+    hash_object(ctx, pdf, digests, path, checksum, pdf_dict_get_inheritable(ctx, widget, keys[i]), 0);
+  }
+}
+
+/* Computes a digest for every layer of a PDF page over everything the layer
+ * is made of: the boxes, content streams and resources of the page, its
+ * annotations, and its form fields together with the defaults of the form */
+static bool page_fingerprint(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page,
+                             guint8 fingerprint[MUPDF_PAGE_FINGERPRINT_LENGTH]) {
+  fz_context* ctx    = mupdf_document->ctx;
+  pdf_page* pdf_page = mupdf_page->page != NULL ? pdf_page_from_fz_page(ctx, mupdf_page->page) : NULL;
+  if (pdf_page == NULL) {
+    return false;
+  }
+
+  if (mupdf_document->stream_digests == NULL) {
+    mupdf_document->stream_digests = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  }
+
+  GChecksum* checksums[MUPDF_LAYER_COUNT];
+  for (unsigned int i = 0; i < MUPDF_LAYER_COUNT; i++) {
+    checksums[i] = g_checksum_new(G_CHECKSUM_SHA256);
+  }
+
+  pdf_document* pdf   = pdf_page->doc;
+  GHashTable* digests = mupdf_document->stream_digests;
+  GHashTable* path    = g_hash_table_new(g_direct_hash, g_direct_equal);
+  GChecksum* contents = checksums[MUPDF_LAYER_CONTENTS];
+  GChecksum* widgets  = checksums[MUPDF_LAYER_WIDGETS];
+  bool success        = true;
+
+  fz_try(ctx) {
+    pdf_obj* keys[] = {
+        PDF_NAME(MediaBox),  PDF_NAME(CropBox),  PDF_NAME(Rotate), PDF_NAME(UserUnit),
+        PDF_NAME(Resources), PDF_NAME(Contents), PDF_NAME(Group),
+    };
+    for (unsigned int i = 0; i < G_N_ELEMENTS(keys); i++) {
+      hash_string(contents, "/%s", pdf_to_name(ctx, keys[i]));
+      hash_object(ctx, pdf, digests, path, contents, pdf_dict_get_inheritable(ctx, pdf_page->obj, keys[i]), 0);
+    }
+
+    /* every annotation belongs to the layer it is drawn in */
+    pdf_obj* annots = pdf_dict_get(ctx, pdf_page->obj, PDF_NAME(Annots));
+    for (int i = 0; i < pdf_array_len(ctx, annots); i++) {
+      pdf_obj* annot = pdf_array_get(ctx, annots, i);
+      if (pdf_name_eq(ctx, pdf_dict_get(ctx, annot, PDF_NAME(Subtype)), PDF_NAME(Widget)) != 0) {
+        hash_object(ctx, pdf, digests, path, widgets, annot, 0);
+        hash_field(ctx, pdf, digests, path, widgets, annot);
+      } else {
+        hash_object(ctx, pdf, digests, path, checksums[MUPDF_LAYER_ANNOTS], annot, 0);
+      }
+    }
+
+    /* appearances of form fields are generated from the defaults of the form */
+    pdf_obj* root        = pdf_dict_get(ctx, pdf_trailer(ctx, pdf), PDF_NAME(Root));
+    pdf_obj* acroform    = pdf_dict_get(ctx, root, PDF_NAME(AcroForm));
+    pdf_obj* form_keys[] = {PDF_NAME(NeedAppearances), PDF_NAME(DA), PDF_NAME(DR), PDF_NAME(Q)};
+    for (unsigned int i = 0; i < G_N_ELEMENTS(form_keys); i++) {
+      hash_string(widgets, "/%s", pdf_to_name(ctx, form_keys[i]));
+      hash_object(ctx, pdf, digests, path, widgets, pdf_dict_get(ctx, acroform, form_keys[i]), 0);
+    }
+
+    /* the visibility of optional content is defined for the whole document */
+    for (unsigned int i = 0; i < MUPDF_LAYER_COUNT; i++) {
+      hash_object(ctx, pdf, digests, path, checksums[i], pdf_dict_get(ctx, root, PDF_NAME(OCProperties)), 0);
+    }
+  }
+  fz_always(ctx) {
+    g_hash_table_destroy(path);
+  }
+  fz_catch(ctx) {
+    girara_debug("failed to compute fingerprint of page %u: %s", mupdf_page->index, fz_caught_message(ctx));
+    success = false;
+  }
+
+  for (unsigned int i = 0; i < MUPDF_LAYER_COUNT; i++) {
+    if (success == true) {
+      gsize length = MUPDF_LAYER_FINGERPRINT_LENGTH;
+      g_checksum_get_digest(checksums[i], fingerprint + i * MUPDF_LAYER_FINGERPRINT_LENGTH, &length);
+    }
+    g_checksum_free(checksums[i]);
+  }
+
+  return success;
+}
+
+static bool display_list_queued(mupdf_document_t* mupdf_document, mupdf_page_content_t* content) {
+  return content->list_link.prev != NULL || mupdf_document->lists.head == &content->list_link;
+}
+
+static void unqueue_display_list(mupdf_document_t* mupdf_document, mupdf_page_content_t* content) {
+  if (display_list_queued(mupdf_document, content) == true) {
+    g_queue_unlink(&mupdf_document->lists, &content->list_link);
+  }
+}
+
+/* Moves a page to the front of the queue of display lists and drops the lists
+ * of the least recently used pages */
+static void queue_display_list(mupdf_document_t* mupdf_document, mupdf_page_content_t* content) {
+  unqueue_display_list(mupdf_document, content);
+  g_queue_push_head_link(&mupdf_document->lists, &content->list_link);
+
+  while (mupdf_document->lists.length > MUPDF_DISPLAY_LIST_CACHE_PAGES) {
+    mupdf_page_content_t* oldest = g_queue_peek_tail(&mupdf_document->lists);
+    g_queue_unlink(&mupdf_document->lists, &oldest->list_link);
+    drop_display_lists(mupdf_document->ctx, oldest);
+  }
+}
+
+static guint fingerprint_hash(gconstpointer key) {
+  guint hash;
+  memcpy(&hash, key, sizeof(hash));
+  return hash;
+}
+
+static gboolean fingerprint_equal(gconstpointer a, gconstpointer b) {
+  return memcmp(a, b, MUPDF_PAGE_FINGERPRINT_LENGTH) == 0;
+}
+
+/* Replaces the contents of a page by those of an identical page, or offers
+ * them to identical pages if there is none yet. The fingerprint of the
+ * contents has to be set. */
+static void share_content(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page) {
+  mupdf_page_content_t* content = mupdf_page->content;
+
+  if (mupdf_document->contents == NULL) {
+    mupdf_document->contents = g_hash_table_new(fingerprint_hash, fingerprint_equal);
+  }
+
+  mupdf_page_content_t* shared = g_hash_table_lookup(mupdf_document->contents, content->fingerprint);
+  if (shared == content) {
+    return;
+  } else if (shared == NULL) {
+    g_hash_table_insert(mupdf_document->contents, content->fingerprint, mupdf_page_content_ref(content));
+    return;
+  }
+
+  /* keep whatever has been computed for this page already */
+  if (shared->extracted_text == false && content->extracted_text == true) {
+    fz_stext_page* text     = shared->text;
+    shared->text            = content->text;
+    shared->extracted_text  = true;
+    content->text           = text;
+    content->extracted_text = false;
+  }
+  for (unsigned int i = 0; i < MUPDF_LAYER_COUNT; i++) {
+    if (shared->lists[i] == NULL && content->lists[i] != NULL) {
+      move_display_list(shared, content, i);
+      queue_display_list(mupdf_document, shared);
+    }
+  }
+  if (shared->links == NULL) {
+    shared->links  = content->links;
+    content->links = NULL;
+  }
+
+  unqueue_display_list(mupdf_document, content);
+  content->pages--;
+  mupdf_page_content_unref(mupdf_document->ctx, content);
+
+  shared->pages++;
+  mupdf_page->content = mupdf_page_content_ref(shared);
+}
+
+static bool layer_unchanged(const mupdf_page_content_t* content, const mupdf_page_content_t* previous,
+                            unsigned int layer) {
+  const size_t offset = layer * MUPDF_LAYER_FINGERPRINT_LENGTH;
+  return memcmp(content->fingerprint + offset, previous->fingerprint + offset, MUPDF_LAYER_FINGERPRINT_LENGTH) == 0;
+}
+
+/* Moves what is derived from the layers that did not change alone from the
+ * previous contents of a page to its new contents */
+static void keep_unchanged_layers(mupdf_page_content_t* content, mupdf_page_content_t* previous) {
+  for (unsigned int i = 0; i < MUPDF_LAYER_COUNT; i++) {
+    if (layer_unchanged(content, previous, i) == true && previous->lists[i] != NULL) {
+      move_display_list(content, previous, i);
+    }
+  }
+
+  if (layer_unchanged(content, previous, MUPDF_LAYER_CONTENTS) == true) {
+    content->image         = previous->image;
+    content->image_ctm     = previous->image_ctm;
+    content->tested_image  = previous->tested_image;
+    previous->image        = NULL;
+    previous->tested_image = false;
+  }
+
+  /* links are annotations */
+  if (layer_unchanged(content, previous, MUPDF_LAYER_ANNOTS) == true) {
+    content->links  = previous->links;
+    previous->links = NULL;
+  }
+}
+
+/* Switches a page to its contents from before the document was reloaded if
+ * nothing the page is made of changed. The fingerprint of the contents has to
+ * be set, and nothing else may have been computed for them yet. */
+static void adopt_previous(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page) {
+  if (mupdf_document->previous == NULL || mupdf_page->index >= mupdf_document->previous->len) {
+    return;
+  }
+
+  mupdf_page_content_t* previous = g_ptr_array_index(mupdf_document->previous, mupdf_page->index);
+  g_ptr_array_index(mupdf_document->previous, mupdf_page->index) = NULL;
+  if (previous == NULL) {
+    return;
+  }
+
+  mupdf_page_content_t* content = mupdf_page->content;
+  if (memcmp(content->fingerprint, previous->fingerprint, MUPDF_PAGE_FINGERPRINT_LENGTH) != 0) {
+    keep_unchanged_layers(content, previous);
+    mupdf_page_content_unref(mupdf_document->ctx, previous);
+    if (has_display_lists(content) == true) {
+      queue_display_list(mupdf_document, content);
+    }
+    return;
+  }
+
+  content->pages--;
+  mupdf_page_content_unref(mupdf_document->ctx, content);
+
+  previous->pages++;
+  mupdf_page->content = previous;
+  if (has_display_lists(previous) == true) {
+    queue_display_list(mupdf_document, previous);
+  }
+}
+
+void mupdf_page_content_share(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page) {
+  mupdf_page_content_t* content = mupdf_page->content;
+  if (content == NULL) {
+    return;
+  }
+
+  /* the fingerprint is computed when the page is first used rather than when
+   * it is initialized, which happens for many pages at once on zathura's
+   * main thread */
+  if (content->has_fingerprint == false) {
+    content->has_fingerprint = page_fingerprint(mupdf_document, mupdf_page, content->fingerprint);
+    if (content->has_fingerprint == true) {
+      adopt_previous(mupdf_document, mupdf_page);
+    }
+  }
+  if (mupdf_page->content->has_fingerprint == true) {
+    share_content(mupdf_document, mupdf_page);
+  }
+}
+
+bool mupdf_page_content_attach(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page) {
+  /* the previous contents of the page are only compared once it is used, see
+   * mupdf_page_content_share */
+  mupdf_page->content = mupdf_page_content_new(mupdf_document->ctx, mupdf_page->bbox);
+  if (mupdf_page->content == NULL) {
+    return false;
+  }
+
+  mupdf_page->content->pages++;
+  return true;
+}
+
+/* Keeps contents that are no longer shown for the next time the document is
+ * opened; their display lists stay in the queue so that they are bounded */
+static void retire_content(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page,
+                           mupdf_page_content_t* content) {
+  if (mupdf_document->retired == NULL) {
+    mupdf_document->retired = g_ptr_array_new();
+  }
+  if (mupdf_page->index >= mupdf_document->retired->len) {
+    g_ptr_array_set_size(mupdf_document->retired, mupdf_page->index + 1);
+  }
+
+  mupdf_page_content_t* replaced = g_ptr_array_index(mupdf_document->retired, mupdf_page->index);
+  if (replaced != NULL && replaced != content && replaced->pages == 0) {
+    unqueue_display_list(mupdf_document, replaced);
+  }
+  mupdf_page_content_unref(mupdf_document->ctx, replaced);
+  g_ptr_array_index(mupdf_document->retired, mupdf_page->index) = content;
+}
+
+void mupdf_page_content_detach(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page) {
+  mupdf_page_content_t* content = mupdf_page->content;
+  mupdf_page->content           = NULL;
+  if (content == NULL) {
+    return;
+  }
+
+  content->pages--;
+
+  /* keep everything that was expensive to compute, in case the document is
+   * about to be reloaded; such contents have been fingerprinted when they
+   * were first used */
+  const bool reusable = content->extracted_text == true || content->tested_color == true || content->links != NULL ||
+                        has_display_lists(content) == true;
+  if (reusable == true && content->has_fingerprint == true) {
+    retire_content(mupdf_document, mupdf_page, content);
+    return;
+  }
+
+  if (content->pages == 0) {
+    unqueue_display_list(mupdf_document, content);
+  }
+  mupdf_page_content_unref(mupdf_document->ctx, content);
+
+  /* a page that was not used since the last reload keeps its contents from
+   * before, they are still compared by fingerprint */
+  if (mupdf_document->previous == NULL || mupdf_page->index >= mupdf_document->previous->len) {
+    return;
+  }
+  content = g_ptr_array_index(mupdf_document->previous, mupdf_page->index);
+  g_ptr_array_index(mupdf_document->previous, mupdf_page->index) = NULL;
+  if (content != NULL) {
+    if (has_display_lists(content) == true) {
+      queue_display_list(mupdf_document, content);
+    }
+    retire_content(mupdf_document, mupdf_page, content);
+  }
+}
+
+void mupdf_page_contents_table_free(fz_context* ctx, GHashTable* contents) {
+  if (contents == NULL) {
+    return;
+  }
+
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, contents);
+  while (g_hash_table_iter_next(&iter, NULL, &value) == TRUE) {
+    mupdf_page_content_unref(ctx, value);
+  }
+  g_hash_table_unref(contents);
+}
+
+void mupdf_run_page_layer(fz_context* ctx, fz_page* page, mupdf_layer_t layer, fz_device* device, fz_matrix ctm,
+                          fz_cookie* cookie) {
+  switch (layer) {
+  case MUPDF_LAYER_CONTENTS:
+    fz_run_page_contents(ctx, page, device, ctm, cookie);
+    break;
+  case MUPDF_LAYER_ANNOTS:
+    fz_run_page_annots(ctx, page, device, ctm, cookie);
+    break;
+  case MUPDF_LAYER_WIDGETS:
+    fz_run_page_widgets(ctx, page, device, ctm, cookie);
+    break;
+  default:
+    break;
+  }
+}
+
+fz_display_list* mupdf_record_page_layer(fz_context* ctx, fz_page* page, fz_rect bounds, mupdf_layer_t layer,
+                                         fz_cookie* cookie) {
+  fz_display_list* volatile list = NULL;
+  fz_device* volatile device     = NULL;
+
+  fz_try(ctx) {
+    list   = fz_new_display_list(ctx, bounds);
+    device = fz_new_list_device(ctx, list);
+    mupdf_run_page_layer(ctx, page, layer, device, fz_identity, cookie);
+    fz_close_device(ctx, device);
+  }
+  fz_always(ctx) {
+    fz_drop_device(ctx, device);
+  }
+  fz_catch(ctx) {
+    fz_drop_display_list(ctx, list);
+    return NULL;
+  }
+
+  return list;
+}
+
+/* Checks whether a display list can be kept after the document is dropped,
+ * which detaches the glyph procedures of its Type3 fonts */
+static bool display_list_portable(fz_context* ctx, fz_display_list* list) {
+  mupdf_page_stats_t stats = {0};
+
+  fz_try(ctx) {
+    mupdf_display_list_count(ctx, list, &stats);
+  }
+  fz_catch(ctx) {
+    return false;
+  }
+
+  return stats.type3_runs == 0;
+}
+
+bool mupdf_page_get_display_lists(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page,
+                                  fz_display_list* lists[MUPDF_LAYER_COUNT], fz_cookie* cookie) {
+  mupdf_page_content_share(mupdf_document, mupdf_page);
+
+  fz_context* ctx               = mupdf_document->ctx;
+  mupdf_page_content_t* content = mupdf_page->content;
+
+  for (unsigned int i = 0; i < MUPDF_LAYER_COUNT; i++) {
+    if (content->lists[i] != NULL) {
+      lists[i] = fz_keep_display_list(ctx, content->lists[i]);
+      continue;
+    }
+
+    fz_cookie layer_cookie = {0};
+    lists[i]               = mupdf_record_page_layer(ctx, mupdf_page->page, mupdf_page->bbox, i, &layer_cookie);
+    if (lists[i] == NULL) {
+      for (unsigned int j = 0; j < i; j++) {
+        fz_drop_display_list(ctx, lists[j]);
+        lists[j] = NULL;
+      }
+      return false;
+    }
+
+    /* layers of pages that are still loading are recorded again next time */
+    if (layer_cookie.incomplete == 0) {
+      content->lists[i]    = fz_keep_display_list(ctx, lists[i]);
+      content->portable[i] = display_list_portable(ctx, lists[i]);
+    }
+    cookie->incomplete |= layer_cookie.incomplete;
+  }
+
+  if (has_display_lists(content) == true) {
+    queue_display_list(mupdf_document, content);
+  }
+
+  return true;
+}
+
+/* Drops the stash unless it has been replaced or taken in the meantime */
+static gboolean stash_expire(gpointer data) {
+  g_mutex_lock(&stash_mutex);
+  if (GPOINTER_TO_UINT(data) == stash_generation && stash_contents != NULL) {
+    fz_context* ctx = mupdf_context_new();
+    if (ctx != NULL) {
+      mupdf_page_contents_free(ctx, stash_contents);
+      fz_drop_context(ctx);
+      g_free(stash_path);
+      stash_path     = NULL;
+      stash_contents = NULL;
+    }
+  }
+  g_mutex_unlock(&stash_mutex);
+
+  return G_SOURCE_REMOVE;
+}
+
+void mupdf_page_contents_stash(fz_context* ctx, const char* path, GPtrArray* contents) {
+  unsigned int kept = 0;
+  for (unsigned int i = 0; contents != NULL && i < contents->len; i++) {
+    mupdf_page_content_t* content = g_ptr_array_index(contents, i);
+    if (content == NULL) {
+      continue;
+    } else if (kept++ >= MUPDF_STASH_PAGES) {
+      mupdf_page_content_unref(ctx, content);
+      g_ptr_array_index(contents, i) = NULL;
+      continue;
+    }
+
+    /* the glyph procedures of Type3 fonts are detached when the document is
+     * dropped, so layers drawing them are recorded again from the reopened
+     * document */
+    for (unsigned int j = 0; j < MUPDF_LAYER_COUNT; j++) {
+      if (content->portable[j] == false) {
+        drop_display_list(ctx, content, j);
+      }
+    }
+
+    /* the queue of recorded pages is dropped with the document */
+    content->list_link.prev = NULL;
+    content->list_link.next = NULL;
+  }
+
+  g_mutex_lock(&stash_mutex);
+  mupdf_page_contents_free(ctx, stash_contents);
+  g_free(stash_path);
+
+  stash_path     = contents != NULL ? g_strdup(path) : NULL;
+  stash_contents = contents;
+  stash_generation++;
+  if (contents != NULL) {
+    g_timeout_add_seconds(MUPDF_STASH_TIMEOUT, stash_expire, GUINT_TO_POINTER(stash_generation));
+  }
+  g_mutex_unlock(&stash_mutex);
+}
+
+GPtrArray* mupdf_page_contents_unstash(fz_context* ctx, const char* path) {
+  g_mutex_lock(&stash_mutex);
+  GPtrArray* contents = stash_contents;
+  if (contents != NULL && g_strcmp0(path, stash_path) != 0) {
+    mupdf_page_contents_free(ctx, contents);
+    contents = NULL;
+  }
+
+  g_free(stash_path);
+  stash_path     = NULL;
+  stash_contents = NULL;
+  stash_generation++;
+  g_mutex_unlock(&stash_mutex);
+
+  return contents;
+}
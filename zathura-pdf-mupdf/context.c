@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include <glib.h>
+#include <girara/utils.h>
+
+#include "utils.h"
+
+static GMutex mupdf_locks[FZ_LOCK_MAX];
+static GMutex mupdf_clone_mutex;
+
+static void mupdf_lock(void* GIRARA_UNUSED(user), int lock) {
+  g_mutex_lock(&mupdf_locks[lock]);
+}
+
+static void mupdf_unlock(void* GIRARA_UNUSED(user), int lock) {
+  g_mutex_unlock(&mupdf_locks[lock]);
+}
+
+/* Sets the user css from zathura/epub.css. The style context is shared by all
+ * clones and is not locked, so the css is only set before the first clone. */
+static void set_user_css(fz_context* ctx) {
+  char* xdg_path = girara_get_xdg_path(XDG_CONFIG);
+  if (xdg_path == NULL) {
+    return;
+  }
+
+  char* css_path  = g_build_filename(xdg_path, "zathura", "epub.css", NULL);
+  gchar* user_css = NULL;
+  if (g_file_get_contents(css_path, &user_css, NULL, NULL) == TRUE) {
+    fz_set_user_css(ctx, user_css);
+  }
+
+  g_free(user_css);
+  g_free(css_path);
+  g_free(xdg_path);
+}
+
+static gpointer mupdf_base_context_new(gpointer GIRARA_UNUSED(data)) {
+  const fz_locks_context locks = {
+      .user   = NULL,
+      .lock   = mupdf_lock,
+      .unlock = mupdf_unlock,
+  };
+
+  fz_context* ctx = fz_new_context(NULL, &locks, FZ_STORE_DEFAULT);
+  if (ctx == NULL) {
+    return NULL;
+  }
+
+  bool registered = true;
+  fz_try(ctx) {
+    fz_register_document_handlers(ctx);
+#ifdef HAVE_FONTCONFIG
+    mupdf_install_system_fonts(ctx);
+#endif
+    set_user_css(ctx);
+  }
+  fz_catch(ctx) {
+    registered = false;
+  }
+
+  if (registered == false) {
+    fz_drop_context(ctx);
+    return NULL;
+  }
+
+  return ctx;
+}
+
+fz_context* mupdf_context_new(void) {
+  static GOnce base_once = G_ONCE_INIT;
+
+  /* The base context is never used directly. It owns the resource store,
+   * glyph cache and font context that all cloned contexts share. */
+  fz_context* base = g_once(&base_once, mupdf_base_context_new, NULL);
+  if (base == NULL) {
+    return NULL;
+  }
+
+  g_mutex_lock(&mupdf_clone_mutex);
+  fz_context* ctx = fz_clone_context(base);
+  g_mutex_unlock(&mupdf_clone_mutex);
+
+  return ctx;
+}
@@ -0,0 +1,236 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <girara/utils.h>
+
+#include "utils.h"
+
+/* Maximal size of the cache directory */
+#define MUPDF_DISK_CACHE_LIMIT (256 * 1024 * 1024)
+/* The size of the cache is checked every that many stores */
+#define MUPDF_DISK_CACHE_TRIM_INTERVAL 32
+/* Name of the cache directory */
+#define MUPDF_DISK_CACHE_NAME "pages"
+/* Maximal number of pages waiting to be written */
+#define MUPDF_DISK_CACHE_QUEUE 4
+/* Magic and version of cache entries */
+#define MUPDF_DISK_CACHE_MAGIC "ZPMP"
+#define MUPDF_DISK_CACHE_VERSION 1
+
+typedef struct mupdf_disk_cache_header_s {
+  char magic[4];    /**< MUPDF_DISK_CACHE_MAGIC */
+  uint32_t version; /**< MUPDF_DISK_CACHE_VERSION */
+  uint32_t width;   /**< Width of the image in pixels */
+  uint32_t height;  /**< Height of the image in pixels */
+  uint64_t length;  /**< Length of the compressed data following the header */
+} mupdf_disk_cache_header_t;
+
+typedef struct mupdf_disk_cache_job_s {
+  char* path;          /**< Path of the entry */
+  unsigned char* rows; /**< BGRA pixels without padding */
+  unsigned int width;  /**< Width of the image in pixels */
+  unsigned int height; /**< Height of the image in pixels */
+} mupdf_disk_cache_job_t;
+
+/* Context of the thread writing entries */
+static fz_context* writer_ctx = NULL;
+/* Number of entries written */
+static unsigned int stores = 0;
+
+/* Returns the cache directory, which is created on first use */
+static const char* disk_cache_dir(void) {
+  static gsize initialized = 0;
+  static char* dir         = NULL;
+
+  if (g_once_init_enter(&initialized) != 0) {
+    dir = mupdf_cache_dir(MUPDF_DISK_CACHE_NAME);
+    g_once_init_leave(&initialized, 1);
+  }
+
+  return dir;
+}
+
+bool mupdf_disk_cache_key(const char* fingerprint, unsigned int index, unsigned int width, unsigned int height,
+                          const mupdf_recolor_t* recolor, char key[MUPDF_DISK_CACHE_KEY_LENGTH + 1]) {
+  if (fingerprint == NULL) {
+    return false;
+  }
+
+  char* data = NULL;
+  if (recolor->enabled == true) {
+    data = g_strdup_printf("%s:%s:%u:%ux%u:%06x:%06x", FZ_VERSION, fingerprint, index, width, height,
+                           recolor->dark_color, recolor->light_color);
+  } else {
+    data = g_strdup_printf("%s:%s:%u:%ux%u", FZ_VERSION, fingerprint, index, width, height);
+  }
+  char* hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, data, -1);
+  g_strlcpy(key, hash, MUPDF_DISK_CACHE_KEY_LENGTH + 1);
+  g_free(hash);
+  g_free(data);
+
+  return true;
+}
+
+bool mupdf_disk_cache_load(const char* key, unsigned char* image, unsigned int width, unsigned int height,
+                           int rowstride) {
+  const char* dir = disk_cache_dir();
+  if (dir == NULL) {
+    return false;
+  }
+
+  char* path    = g_build_filename(dir, key, NULL);
+  gchar* data   = NULL;
+  gsize length  = 0;
+  bool complete = false;
+
+  if (g_file_get_contents(path, &data, &length, NULL) == FALSE) {
+    g_free(path);
+    return false;
+  }
+
+  fz_context* ctx = mupdf_context_new();
+  if (ctx == NULL) {
+    g_free(data);
+    g_free(path);
+    return false;
+  }
+
+  mupdf_disk_cache_header_t header;
+  bool valid = length >= sizeof(header);
+  if (valid == true) {
+    memcpy(&header, data, sizeof(header));
+    valid = memcmp(header.magic, MUPDF_DISK_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+            header.version == MUPDF_DISK_CACHE_VERSION && header.width == width && header.height == height &&
+            header.length == length - sizeof(header);
+  }
+
+  fz_stream* volatile memory = NULL;
+  fz_stream* volatile flated = NULL;
+
+  fz_try(ctx) {
+    if (valid == true) {
+      memory = fz_open_memory(ctx, (unsigned char*)data + sizeof(header), header.length);
+      flated = fz_open_flated(ctx, memory, 15);
+
+      unsigned int y = 0;
+      for (; y < height; y++) {
+        if (fz_read(ctx, flated, image + (size_t)y * rowstride, (size_t)width * 4) != (size_t)width * 4) {
+          break;
+        }
+      }
+      complete = y == height;
+    }
+  }
+  fz_always(ctx) {
+    fz_drop_stream(ctx, flated);
+    fz_drop_stream(ctx, memory);
+  }
+  fz_catch(ctx) {
+    complete = false;
+  }
+  fz_drop_context(ctx);
+
+  if (complete == true) {
+    /* the modification time orders entries for the clean up */
+    utimensat(AT_FDCWD, path, NULL, 0);
+  } else {
+    girara_debug("removing invalid cache entry %s", path);
+    g_unlink(path);
+  }
+
+  g_free(data);
+  g_free(path);
+
+  return complete;
+}
+
+static void disk_cache_job_free(mupdf_disk_cache_job_t* job) {
+  g_free(job->rows);
+  g_free(job->path);
+  g_free(job);
+}
+
+/* Compresses and writes an entry; runs in the thread pool of the cache */
+static void disk_cache_write(gpointer data, gpointer GIRARA_UNUSED(user_data)) {
+  mupdf_disk_cache_job_t* job = data;
+
+  /* the pool runs one job at a time, so the context is never shared */
+  if (writer_ctx == NULL) {
+    writer_ctx = mupdf_context_new();
+  }
+  fz_context* ctx = writer_ctx;
+  if (ctx == NULL) {
+    disk_cache_job_free(job);
+    return;
+  }
+
+  unsigned char* volatile deflated = NULL;
+  size_t deflated_length           = 0;
+
+  fz_try(ctx) {
+    deflated = fz_new_deflated_data(ctx, &deflated_length, job->rows, (size_t)job->width * 4 * job->height,
+                                    FZ_DEFLATE_BEST_SPEED);
+  }
+  fz_catch(ctx) {
+    disk_cache_job_free(job);
+    return;
+  }
+
+  mupdf_disk_cache_header_t header = {
+      .version = MUPDF_DISK_CACHE_VERSION,
+      .width   = job->width,
+      .height  = job->height,
+      .length  = deflated_length,
+  };
+  memcpy(header.magic, MUPDF_DISK_CACHE_MAGIC, sizeof(header.magic));
+
+  gchar* contents = g_malloc(sizeof(header) + deflated_length);
+  memcpy(contents, &header, sizeof(header));
+  memcpy(contents + sizeof(header), deflated, deflated_length);
+  fz_free(ctx, deflated);
+
+  /* written to a temporary file and renamed, so readers never see partial
+   * entries */
+  if (g_file_set_contents(job->path, contents, sizeof(header) + deflated_length, NULL) == FALSE) {
+    girara_debug("failed to write cache entry %s", job->path);
+  }
+  g_free(contents);
+
+  if (stores++ % MUPDF_DISK_CACHE_TRIM_INTERVAL == 0) {
+    mupdf_cache_trim(MUPDF_DISK_CACHE_NAME, MUPDF_DISK_CACHE_LIMIT);
+  }
+
+  disk_cache_job_free(job);
+}
+
+static gpointer disk_cache_writer_new(gpointer GIRARA_UNUSED(data)) {
+  return g_thread_pool_new(disk_cache_write, NULL, 1, FALSE, NULL);
+}
+
+void mupdf_disk_cache_store(const char* key, const unsigned char* image, unsigned int width, unsigned int height,
+                            int rowstride) {
+  static GOnce writer_once = G_ONCE_INIT;
+
+  const char* dir     = disk_cache_dir();
+  GThreadPool* writer = g_once(&writer_once, disk_cache_writer_new, NULL);
+  if (dir == NULL || writer == NULL || g_thread_pool_unprocessed(writer) >= MUPDF_DISK_CACHE_QUEUE) {
+    return;
+  }
+
+  /* the pixels are copied without the padding at the end of the rows */
+  const size_t row_length     = (size_t)width * 4;
+  mupdf_disk_cache_job_t* job = g_malloc(sizeof(mupdf_disk_cache_job_t));
+  job->path                   = g_build_filename(dir, key, NULL);
+  job->rows                   = g_malloc(row_length * height);
+  job->width                  = width;
+  job->height                 = height;
+  for (unsigned int y = 0; y < height; y++) {
+    memcpy(job->rows + y * row_length, image + (size_t)y * rowstride, row_length);
+  }
+
+  g_thread_pool_push(writer, job, NULL);
+}
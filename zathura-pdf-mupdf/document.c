@@ -1,14 +1,156 @@
 /* SPDX-License-Identifier: Zlib */
 
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/stat.h>
 #include <mupdf/fitz.h>
 #include <mupdf/pdf.h>
 
 #include <glib-2.0/glib.h>
+#include <glib/gstdio.h>
 
 #include "plugin.h"
+#include "utils.h"
 #include <girara/utils.h>
 
-#define LENGTH(x) (sizeof(x) / sizeof((x)[0]))
+/* Name and maximal size of the cache directory of layouts */
+#define MUPDF_LAYOUT_CACHE_NAME "layout"
+#define MUPDF_LAYOUT_CACHE_LIMIT (32 * 1024 * 1024)
+/* Number of the most complex pages listed in the document information */
+#define MUPDF_ANALYSIS_HEAVIEST_PAGES 3
+/* Environment variable with the recoloring of rendered pages */
+#define MUPDF_RECOLOR_VARIABLE "ZATHURA_PDF_MUPDF_RECOLOR"
+#ifdef HAVE_WORKERS
+/* Environment variables with the number of render workers, their memory
+ * limit in MiB and the time in seconds after which they are considered
+ * hanging */
+#define MUPDF_WORKERS_VARIABLE "ZATHURA_PDF_MUPDF_WORKERS"
+#define MUPDF_WORKER_MEMORY_VARIABLE "ZATHURA_PDF_MUPDF_WORKER_MEMORY"
+#define MUPDF_WORKER_TIMEOUT_VARIABLE "ZATHURA_PDF_MUPDF_WORKER_TIMEOUT"
+/* Default memory limit of render workers in MiB */
+#define MUPDF_WORKER_MEMORY_DEFAULT 2048
+/* Default time in seconds after which workers are considered hanging */
+#define MUPDF_WORKER_TIMEOUT_DEFAULT 10
+/* Maximal number of render workers */
+#define MUPDF_WORKERS_MAX 16
+#endif
+
+/* Returns the path of the cached layout of a reflowable document. The layout
+ * depends on the user css and on the layout engine, so both are part of the
+ * key; page and font size are checked by mupdf when the layout is loaded. */
+static char* layout_cache_path(const char* fingerprint, const char* user_css) {
+  if (fingerprint == NULL) {
+    return NULL;
+  }
+
+  GChecksum* checksum = g_checksum_new(G_CHECKSUM_SHA256);
+  g_checksum_update(checksum, (const guchar*)FZ_VERSION, -1);
+  g_checksum_update(checksum, (const guchar*)fingerprint, -1);
+  if (user_css != NULL) {
+    g_checksum_update(checksum, (const guchar*)user_css, -1);
+  }
+
+  char* path = mupdf_cache_path(MUPDF_LAYOUT_CACHE_NAME, g_checksum_get_string(checksum));
+  g_checksum_free(checksum);
+
+  return path;
+}
+
+/* Opens the document, using the cached layout at layout_path if there is one.
+ * Reflowable documents opened with their layout only lay out chapters when
+ * their pages are needed. */
+static fz_document* open_document(fz_context* ctx, const char* path, fz_stream* stream, fz_archive* dir,
+                                  const char* layout_path, bool* layout_loaded) {
+  *layout_loaded = false;
+  if (layout_path == NULL || g_file_test(layout_path, G_FILE_TEST_IS_REGULAR) == FALSE) {
+    return fz_open_document_with_stream_and_dir(ctx, path, stream, dir);
+  }
+
+  fz_document* volatile document = NULL;
+  fz_stream* volatile layout     = NULL;
+
+  fz_try(ctx) {
+    layout   = fz_open_file(ctx, layout_path);
+    document = fz_open_accelerated_document_with_stream_and_dir(ctx, path, stream, layout, dir);
+  }
+  fz_always(ctx) {
+    fz_drop_stream(ctx, layout);
+  }
+  fz_catch(ctx) {
+    girara_debug("discarding cached layout %s: %s", layout_path, fz_caught_message(ctx));
+  }
+
+  if (document != NULL) {
+    /* the modification time orders entries for the clean up */
+    utimensat(AT_FDCWD, layout_path, NULL, 0);
+    *layout_loaded = true;
+    return document;
+  }
+
+  /* the cached layout is unusable; start over without it */
+  g_unlink(layout_path);
+  fz_seek(ctx, stream, 0, SEEK_SET);
+
+  return fz_open_document_with_stream_and_dir(ctx, path, stream, dir);
+}
+
+/* Saves the layout of a reflowable document, so that the next time it is
+ * opened the layout does not have to be computed again */
+static void save_layout(fz_context* ctx, fz_document* document, const char* layout_path) {
+  char* tmp_path = g_strconcat(layout_path, ".tmp", NULL);
+
+  fz_try(ctx) {
+    if (fz_is_document_reflowable(ctx, document) != 0 && fz_document_supports_accelerator(ctx, document) != 0) {
+      fz_save_accelerator(ctx, document, tmp_path);
+      if (g_rename(tmp_path, layout_path) != 0) {
+        g_unlink(tmp_path);
+      }
+      mupdf_cache_trim(MUPDF_LAYOUT_CACHE_NAME, MUPDF_LAYOUT_CACHE_LIMIT);
+    }
+  }
+  fz_catch(ctx) {
+    girara_debug("failed to save layout to %s: %s", layout_path, fz_caught_message(ctx));
+    g_unlink(tmp_path);
+  }
+
+  g_free(tmp_path);
+}
+
+#ifdef HAVE_WORKERS
+/* Starts render workers if they are requested. Reflowable documents are
+ * rendered in the process, since workers could lay them out differently, and
+ * so are documents that are still being downloaded, since workers would open
+ * their own copy of the incomplete file. */
+static void start_workers(mupdf_document_t* mupdf_document, const char* path, const char* password) {
+  const char* count = g_getenv(MUPDF_WORKERS_VARIABLE);
+  if (count == NULL || fz_is_document_reflowable(mupdf_document->ctx, mupdf_document->document) != 0 ||
+      mupdf_document->stream->progressive != 0) {
+    return;
+  }
+
+  const guint64 workers = g_ascii_strtoull(count, NULL, 10);
+  if (workers == 0 || workers > MUPDF_WORKERS_MAX) {
+    girara_warning("invalid value of %s: %s", MUPDF_WORKERS_VARIABLE, count);
+    return;
+  }
+
+  const char* memory  = g_getenv(MUPDF_WORKER_MEMORY_VARIABLE);
+  const guint64 limit = memory != NULL ? g_ascii_strtoull(memory, NULL, 10) : MUPDF_WORKER_MEMORY_DEFAULT;
+
+  const char* timeout   = g_getenv(MUPDF_WORKER_TIMEOUT_VARIABLE);
+  guint64 timeout_value = timeout != NULL ? g_ascii_strtoull(timeout, NULL, 10) : MUPDF_WORKER_TIMEOUT_DEFAULT;
+  if (timeout_value == 0) {
+    girara_warning("invalid value of %s: %s", MUPDF_WORKER_TIMEOUT_VARIABLE, timeout);
+    timeout_value = MUPDF_WORKER_TIMEOUT_DEFAULT;
+  }
+
+  mupdf_document->workers =
+      mupdf_workers_new(path, password, workers, MIN(limit, G_MAXUINT), MIN(timeout_value * 1000, G_MAXUINT));
+  if (mupdf_document->workers == NULL) {
+    girara_warning("rendering %s without workers", path);
+  }
+}
+#endif
 
 zathura_error_t pdf_document_open(zathura_document_t* document) {
   zathura_error_t error = ZATHURA_ERROR_OK;
@@ -23,42 +165,92 @@ zathura_error_t pdf_document_open(zathura_document_t* document) {
     goto error_ret;
   }
 
-  g_mutex_init(&mupdf_document->mutex);
+  mupdf_lock_init(&mupdf_document->lock);
 
-  mupdf_document->ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+  mupdf_document->ctx = mupdf_context_new();
   if (mupdf_document->ctx == NULL) {
     error = ZATHURA_ERROR_UNKNOWN;
     goto error_free;
   }
+  mupdf_document->images = mupdf_image_cache_new();
+
+  const char* recolor = g_getenv(MUPDF_RECOLOR_VARIABLE);
+  if (recolor != NULL && mupdf_recolor_parse(recolor, &mupdf_document->recolor) == false) {
+    girara_warning("invalid value of %s: %s", MUPDF_RECOLOR_VARIABLE, recolor);
+  }
 
   /* open document */
-  const char* path     = zathura_document_get_path(document);
-  const char* password = zathura_document_get_password(document);
+  const char* path         = zathura_document_get_path(document);
+  const char* password     = zathura_document_get_password(document);
+  char* dirname            = g_path_get_dirname(path);
+  char* layout_path        = NULL;
+  bool layout_loaded       = false;
+  bool xref_loaded         = false;
+  fz_archive* volatile dir = NULL;
+  fz_buffer* volatile xref = NULL;
+  fz_stream* volatile file = NULL;
+
+  /* contents of the pages from before the document was reloaded */
+  mupdf_document->previous = mupdf_page_contents_unstash(mupdf_document->ctx, path);
+
+  mupdf_document->fingerprint = mupdf_file_fingerprint(path);
+  layout_path                 = layout_cache_path(mupdf_document->fingerprint, fz_user_css(mupdf_document->ctx));
+  xref                        = mupdf_xref_cache_load(mupdf_document->ctx, mupdf_document->fingerprint);
+
+  /* the cross-reference table is read right away on cold storage */
+  mupdf_document_prefetch_file(path);
 
   fz_try(mupdf_document->ctx) {
-    fz_register_document_handlers(mupdf_document->ctx);
-
-    /* read user css from zathura/epub.css */
-    char* xdg_path = girara_get_xdg_path(XDG_CONFIG);
-    if (xdg_path != NULL) {
-      char* css_path  = g_build_filename(xdg_path, "zathura", "epub.css", NULL);
-      gchar* user_css = NULL;
-      if (g_file_get_contents(css_path, &user_css, NULL, NULL) == TRUE) {
-        fz_set_user_css(mupdf_document->ctx, user_css);
-        g_free(user_css);
-      }
-      g_free(css_path);
-      g_free(xdg_path);
+    /* open the file through our own stream, with the containing directory for
+     * formats that reference other files */
+    dir                    = fz_open_directory(mupdf_document->ctx, dirname);
+    mupdf_document->stream = mupdf_open_file_stream(mupdf_document->ctx, path, true);
+
+    /* a damaged PDF is read with its cached cross-reference section appended,
+     * which spares mupdf the reconstruction */
+    if (xref != NULL && mupdf_document->stream->progressive == 0) {
+      file        = mupdf_open_appended_stream(mupdf_document->ctx, mupdf_document->stream, xref);
+      xref_loaded = true;
+    } else {
+      file = fz_keep_stream(mupdf_document->ctx, mupdf_document->stream);
     }
 
-    mupdf_document->document = fz_open_document(mupdf_document->ctx, path);
+    mupdf_stream_advise(mupdf_document->stream, true);
+    fz_try(mupdf_document->ctx) {
+      mupdf_document->document = open_document(mupdf_document->ctx, path, file, dir, layout_path, &layout_loaded);
+    }
+    fz_catch(mupdf_document->ctx) {
+      /* a file that cannot be opened progressively is opened as a whole, so
+       * mupdf repairs it if it is damaged */
+      if (mupdf_document->stream->progressive == 0 || fz_caught(mupdf_document->ctx) == FZ_ERROR_TRYLATER) {
+        fz_rethrow(mupdf_document->ctx);
+      }
+      girara_debug("opening %s as a complete file: %s", path, fz_caught_message(mupdf_document->ctx));
+
+      fz_drop_stream(mupdf_document->ctx, file);
+      file = NULL;
+      fz_drop_stream(mupdf_document->ctx, mupdf_document->stream);
+      mupdf_document->stream   = NULL;
+      mupdf_document->stream   = mupdf_open_file_stream(mupdf_document->ctx, path, false);
+      file                     = fz_keep_stream(mupdf_document->ctx, mupdf_document->stream);
+      mupdf_document->document = open_document(mupdf_document->ctx, path, file, dir, layout_path, &layout_loaded);
+    }
+    mupdf_stream_advise(mupdf_document->stream, false);
+  }
+  fz_always(mupdf_document->ctx) {
+    fz_drop_stream(mupdf_document->ctx, file);
+    fz_drop_buffer(mupdf_document->ctx, xref);
+    fz_drop_archive(mupdf_document->ctx, dir);
+    g_free(dirname);
   }
   fz_catch(mupdf_document->ctx) {
+    g_free(layout_path);
     error = ZATHURA_ERROR_UNKNOWN;
     goto error_free;
   }
 
   if (mupdf_document->document == NULL) {
+    g_free(layout_path);
     error = ZATHURA_ERROR_UNKNOWN;
     goto error_free;
   }
@@ -75,16 +267,37 @@ zathura_error_t pdf_document_open(zathura_document_t* document) {
     error = ZATHURA_ERROR_UNKNOWN;
   }
   if (error != ZATHURA_ERROR_OK) {
+    g_free(layout_path);
     goto error_free;
   }
 
   fz_try(mupdf_document->ctx) {
-    zathura_document_set_number_of_pages(document, fz_count_pages(mupdf_document->ctx, mupdf_document->document));
+    const int n_pages = fz_count_pages(mupdf_document->ctx, mupdf_document->document);
+    zathura_document_set_number_of_pages(document, n_pages);
+
+    mupdf_document->labels = mupdf_page_labels_new(mupdf_document->ctx, mupdf_document->document, n_pages);
   }
   fz_catch(mupdf_document->ctx) {
+    g_free(layout_path);
     error = ZATHURA_ERROR_UNKNOWN;
     goto error_free;
   }
+
+#ifdef HAVE_WORKERS
+  start_workers(mupdf_document, path, password);
+#endif
+
+  /* keep the cross-reference table if mupdf had to reconstruct it */
+  mupdf_xref_cache_update(mupdf_document->ctx, mupdf_document->document, mupdf_document->fingerprint, xref_loaded);
+
+  /* counting the pages laid out the whole document; keep the result */
+  if (layout_path != NULL && layout_loaded == false) {
+    save_layout(mupdf_document->ctx, mupdf_document->document, layout_path);
+  }
+  g_free(layout_path);
+
+  mupdf_document_warm_start(mupdf_document, path);
+
   zathura_document_set_data(document, mupdf_document);
 
   return ZATHURA_ERROR_OK;
@@ -92,13 +305,28 @@ zathura_error_t pdf_document_open(zathura_document_t* document) {
 error_free:
 
   if (mupdf_document != NULL) {
-    g_mutex_clear(&mupdf_document->mutex);
+    mupdf_lock_clear(&mupdf_document->lock);
+    mupdf_cache_free(mupdf_document->images);
+    mupdf_cache_free(mupdf_document->renders);
+    mupdf_cache_free(mupdf_document->levels);
+    mupdf_page_labels_free(mupdf_document->labels);
+    if (mupdf_document->stream_digests != NULL) {
+      g_hash_table_unref(mupdf_document->stream_digests);
+    }
+    if (mupdf_document->ctx != NULL) {
+      mupdf_page_contents_table_free(mupdf_document->ctx, mupdf_document->contents);
+      mupdf_page_contents_free(mupdf_document->ctx, mupdf_document->previous);
+    }
     if (mupdf_document->document != NULL) {
       fz_drop_document(mupdf_document->ctx, mupdf_document->document);
     }
+    if (mupdf_document->stream != NULL) {
+      fz_drop_stream(mupdf_document->ctx, mupdf_document->stream);
+    }
     if (mupdf_document->ctx != NULL) {
       fz_drop_context(mupdf_document->ctx);
     }
+    g_free(mupdf_document->fingerprint);
 
     free(mupdf_document);
   }
@@ -117,13 +345,35 @@ zathura_error_t pdf_document_free(zathura_document_t* document, void* data) {
     return ZATHURA_ERROR_INVALID_ARGUMENTS;
   }
 
-  g_mutex_lock(&mupdf_document->mutex);
+  mupdf_document_warm_stop(mupdf_document);
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_INTERACTIVE);
+
+  mupdf_cache_free(mupdf_document->images);
+  mupdf_cache_free(mupdf_document->renders);
+  mupdf_cache_free(mupdf_document->levels);
+  mupdf_page_labels_free(mupdf_document->labels);
+#ifdef HAVE_WORKERS
+  mupdf_workers_free(mupdf_document->workers);
+#endif
+  if (mupdf_document->stream_digests != NULL) {
+    g_hash_table_unref(mupdf_document->stream_digests);
+  }
+  if (mupdf_document->page_stats != NULL) {
+    g_array_free(mupdf_document->page_stats, TRUE);
+  }
+
+  /* keep the contents of unchanged pages in case the document is reloaded */
+  mupdf_page_contents_table_free(mupdf_document->ctx, mupdf_document->contents);
+  mupdf_page_contents_free(mupdf_document->ctx, mupdf_document->previous);
+  mupdf_page_contents_stash(mupdf_document->ctx, zathura_document_get_path(document), mupdf_document->retired);
 
   fz_drop_document(mupdf_document->ctx, mupdf_document->document);
+  fz_drop_stream(mupdf_document->ctx, mupdf_document->stream);
   fz_drop_context(mupdf_document->ctx);
+  g_free(mupdf_document->fingerprint);
 
-  g_mutex_unlock(&mupdf_document->mutex);
-  g_mutex_clear(&mupdf_document->mutex);
+  mupdf_document_unlock(mupdf_document);
+  mupdf_lock_clear(&mupdf_document->lock);
 
   free(mupdf_document);
   zathura_document_set_data(document, NULL);
@@ -138,19 +388,98 @@ zathura_error_t pdf_document_save_as(zathura_document_t* document, void* data, c
     return ZATHURA_ERROR_INVALID_ARGUMENTS;
   }
 
-  g_mutex_lock(&mupdf_document->mutex);
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_BACKGROUND);
   fz_try(mupdf_document->ctx) {
     pdf_save_document(mupdf_document->ctx, (pdf_document*)mupdf_document->document, path, NULL);
   }
   fz_catch(mupdf_document->ctx) {
-    g_mutex_unlock(&mupdf_document->mutex);
+    mupdf_document_unlock(mupdf_document);
     return ZATHURA_ERROR_UNKNOWN;
   }
-  g_mutex_unlock(&mupdf_document->mutex);
+  mupdf_document_unlock(mupdf_document);
 
   return ZATHURA_ERROR_OK;
 }
 
+static void append_information(zathura_document_information_type_t type, const char* value, void* data) {
+  girara_list_t* list = data;
+
+  zathura_document_information_entry_t* entry = zathura_document_information_entry_new(type, value);
+  if (entry != NULL) {
+    girara_list_append(list, entry);
+  }
+}
+
+static gint64 page_stats_time(const mupdf_page_stats_t* stats) {
+  return stats->interpretation_time + stats->raster_time;
+}
+
+/* Lists the pages that took the longest to interpret and rasterize */
+static void append_page_stats(GArray* page_stats, unsigned int n_pages, girara_list_t* list) {
+  char* value = g_strdup_printf("%u of %u pages analyzed", page_stats->len, n_pages);
+  append_information(ZATHURA_DOCUMENT_INFORMATION_OTHER, value, list);
+  g_free(value);
+
+  unsigned int heaviest[MUPDF_ANALYSIS_HEAVIEST_PAGES];
+  unsigned int n_heaviest = 0;
+
+  for (unsigned int i = 0; i < page_stats->len; i++) {
+    const gint64 time = page_stats_time(&g_array_index(page_stats, mupdf_page_stats_t, i));
+
+    unsigned int position = n_heaviest;
+    for (; position > 0; position--) {
+      const mupdf_page_stats_t* other = &g_array_index(page_stats, mupdf_page_stats_t, heaviest[position - 1]);
+      if (page_stats_time(other) >= time) {
+        break;
+      }
+    }
+    if (position == MUPDF_ANALYSIS_HEAVIEST_PAGES) {
+      continue;
+    }
+
+    if (n_heaviest < MUPDF_ANALYSIS_HEAVIEST_PAGES) {
+      n_heaviest++;
+    }
+    memmove(&heaviest[position + 1], &heaviest[position], (n_heaviest - 1 - position) * sizeof(heaviest[0]));
+    heaviest[position] = i;
+  }
+
+  for (unsigned int i = 0; i < n_heaviest; i++) {
+    char* stats = mupdf_page_stats_format(&g_array_index(page_stats, mupdf_page_stats_t, heaviest[i]));
+    value       = g_strdup_printf("Page %u: %s", heaviest[i] + 1, stats);
+    append_information(ZATHURA_DOCUMENT_INFORMATION_OTHER, value, list);
+    g_free(value);
+    g_free(stats);
+  }
+}
+
+/* Lists how long the requests of every class waited for the document lock */
+static void append_lock_stats(mupdf_document_t* mupdf_document, girara_list_t* list) {
+  static const char* const names[MUPDF_PRIORITY_COUNT] = {"visible", "interactive", "prefetch", "background"};
+
+  mupdf_lock_stats_t stats[MUPDF_PRIORITY_COUNT];
+  unsigned int max_depth = 0;
+  mupdf_document_lock_stats(mupdf_document, stats, &max_depth);
+
+  for (unsigned int i = 0; i < MUPDF_PRIORITY_COUNT; i++) {
+    if (stats[i].requests == 0 && stats[i].dropped == 0) {
+      continue;
+    }
+
+    const double average = stats[i].requests > 0 ? stats[i].wait_time / 1000.0 / stats[i].requests : 0.0;
+    const double maximum = stats[i].max_wait / 1000.0;
+    char* value = g_strdup_printf("Waits of %s requests: %" PRIu64 " served, %.1f ms on average, %.1f ms at most, %" PRIu64
+                                  " superseded",
+                                  names[i], stats[i].requests, average, maximum, stats[i].dropped);
+    append_information(ZATHURA_DOCUMENT_INFORMATION_OTHER, value, list);
+    g_free(value);
+  }
+
+  char* value = g_strdup_printf("At most %u requests waited at once", max_depth);
+  append_information(ZATHURA_DOCUMENT_INFORMATION_OTHER, value, list);
+  g_free(value);
+}
+
 girara_list_t* pdf_document_get_information(zathura_document_t* document, void* data, zathura_error_t* error) {
   mupdf_document_t* mupdf_document = data;
 
@@ -168,73 +497,12 @@ girara_list_t* pdf_document_get_information(zathura_document_t* document, void*
     return NULL;
   }
 
-  g_mutex_lock(&mupdf_document->mutex);
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_BACKGROUND);
   fz_try(mupdf_document->ctx) {
-    pdf_document* pdf_document = pdf_specifics(mupdf_document->ctx, mupdf_document->document);
-    if (pdf_document == NULL) {
+    if (mupdf_document_information(mupdf_document->ctx, mupdf_document->document, append_information, list) ==
+        false) {
       girara_list_free(list);
       list = NULL;
-      break;
-    }
-
-    pdf_obj* trailer   = pdf_trailer(mupdf_document->ctx, pdf_document);
-    pdf_obj* info_dict = pdf_dict_get(mupdf_document->ctx, trailer, PDF_NAME(Info));
-
-    /* get string values */
-    typedef struct info_value_s {
-      const char* property;
-      zathura_document_information_type_t type;
-    } info_value_t;
-
-    static const info_value_t string_values[] = {
-        {"Title", ZATHURA_DOCUMENT_INFORMATION_TITLE},     {"Author", ZATHURA_DOCUMENT_INFORMATION_AUTHOR},
-        {"Subject", ZATHURA_DOCUMENT_INFORMATION_SUBJECT}, {"Keywords", ZATHURA_DOCUMENT_INFORMATION_KEYWORDS},
-        {"Creator", ZATHURA_DOCUMENT_INFORMATION_CREATOR}, {"Producer", ZATHURA_DOCUMENT_INFORMATION_PRODUCER},
-    };
-
-    for (unsigned int i = 0; i < LENGTH(string_values); i++) {
-      pdf_obj* value = pdf_dict_gets(mupdf_document->ctx, info_dict, string_values[i].property);
-      if (value == NULL) {
-        continue;
-      }
-
-      const char* str_value = pdf_to_text_string(mupdf_document->ctx, value);
-      if (str_value == NULL || strlen(str_value) == 0) {
-        continue;
-      }
-
-      zathura_document_information_entry_t* entry =
-          zathura_document_information_entry_new(string_values[i].type, str_value);
-
-      if (entry != NULL) {
-        girara_list_append(list, entry);
-      }
-    }
-
-    static const info_value_t time_values[] = {
-        {"CreationDate", ZATHURA_DOCUMENT_INFORMATION_CREATION_DATE},
-        {"ModDate", ZATHURA_DOCUMENT_INFORMATION_MODIFICATION_DATE},
-    };
-
-    for (unsigned int i = 0; i < LENGTH(time_values); i++) {
-      pdf_obj* value = pdf_dict_gets(mupdf_document->ctx, info_dict, time_values[i].property);
-      if (value == NULL) {
-        continue;
-      }
-
-      const char* str_value = pdf_to_text_string(mupdf_document->ctx, value);
-      if (str_value == NULL || strlen(str_value) == 0) {
-        continue;
-      }
-
-      zathura_document_information_entry_t* entry =
-          zathura_document_information_entry_new(time_values[i].type,
-                                                 str_value // FIXME: Convert to common format
-          );
-
-      if (entry != NULL) {
-        girara_list_append(list, entry);
-      }
     }
   }
   fz_catch(mupdf_document->ctx) {
@@ -244,7 +512,14 @@ girara_list_t* pdf_document_get_information(zathura_document_t* document, void*
     girara_list_free(list);
     list = NULL;
   }
-  g_mutex_unlock(&mupdf_document->mutex);
+
+  if (list != NULL) {
+    /* the pages are analyzed by the warm thread; list the ones analyzed so far */
+    const unsigned int n_pages = zathura_document_get_number_of_pages(document);
+    append_page_stats(mupdf_document->page_stats, n_pages, list);
+    append_lock_stats(mupdf_document, list);
+  }
+  mupdf_document_unlock(mupdf_document);
 
   return list;
 }
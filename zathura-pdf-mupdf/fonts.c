@@ -0,0 +1,417 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fontconfig/fontconfig.h>
+#include <glib.h>
+#include <girara/utils.h>
+#include <mupdf/ucdn.h>
+
+#include "utils.h"
+
+/* Name of the cache directory and of the lookup table in it */
+#define MUPDF_FONT_CACHE_NAME "fonts"
+#define MUPDF_FONT_CACHE_TABLE "lookup"
+/* Groups of the lookup table */
+#define MUPDF_FONT_GROUP_TABLE "table"
+#define MUPDF_FONT_GROUP_FONTS "fonts"
+/* Directory of fontconfig's system cache, which is updated whenever fonts are
+ * installed or removed */
+#define MUPDF_FONTCONFIG_SYSTEM_CACHE "/var/cache/fontconfig"
+
+typedef struct mupdf_font_file_s {
+  unsigned char* data; /**< Start of the mapping */
+  size_t length;       /**< Length of the mapping */
+} mupdf_font_file_t;
+
+/* Protects all of the following */
+static GMutex fonts_mutex;
+/* Resolved requests, see lookup_font; NULL until first used */
+static GKeyFile* font_table = NULL;
+/* Mapped font files by path. Fonts are mapped once and stay mapped, so all
+ * fonts created from a file share its pages. */
+static GHashTable* font_files = NULL;
+static bool fontconfig_initialized = false;
+
+typedef struct mupdf_script_language_s {
+  int script;
+  const char* language;
+} mupdf_script_language_t;
+
+/* Languages whose fonts are looked up for characters of a script if the
+ * language of the text is unknown */
+static const mupdf_script_language_t script_languages[] = {
+    {UCDN_SCRIPT_GREEK, "el"},       {UCDN_SCRIPT_CYRILLIC, "ru"},   {UCDN_SCRIPT_HEBREW, "he"},
+    {UCDN_SCRIPT_ARABIC, "ar"},      {UCDN_SCRIPT_DEVANAGARI, "hi"}, {UCDN_SCRIPT_THAI, "th"},
+    {UCDN_SCRIPT_HANGUL, "ko"},      {UCDN_SCRIPT_HIRAGANA, "ja"},   {UCDN_SCRIPT_KATAKANA, "ja"},
+    {UCDN_SCRIPT_BOPOMOFO, "zh-tw"}, {UCDN_SCRIPT_HAN, "zh-cn"},
+};
+
+static time_t file_mtime(const char* path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? st.st_mtime : 0;
+}
+
+/* Loads the lookup table, unless fontconfig has been updated since it was
+ * written, in which case the resolved fonts might not be the best ones any
+ * more */
+static GKeyFile* load_font_table(void) {
+  GKeyFile* table = g_key_file_new();
+
+  char* path = mupdf_cache_path(MUPDF_FONT_CACHE_NAME, MUPDF_FONT_CACHE_TABLE);
+  if (path == NULL) {
+    return table;
+  }
+
+  char* user_cache      = g_build_filename(g_get_user_cache_dir(), "fontconfig", NULL);
+  const time_t modified = file_mtime(path);
+  const bool outdated   = modified < file_mtime(user_cache) || modified < file_mtime(MUPDF_FONTCONFIG_SYSTEM_CACHE);
+  g_free(user_cache);
+
+  if (outdated == false && g_key_file_load_from_file(table, path, G_KEY_FILE_NONE, NULL) == TRUE &&
+      g_key_file_get_integer(table, MUPDF_FONT_GROUP_TABLE, "version", NULL) != FcGetVersion()) {
+    g_key_file_free(table);
+    table = g_key_file_new();
+  }
+  g_free(path);
+
+  return table;
+}
+
+static void save_font_table(void) {
+  char* path = mupdf_cache_path(MUPDF_FONT_CACHE_NAME, MUPDF_FONT_CACHE_TABLE);
+  if (path == NULL) {
+    return;
+  }
+
+  g_key_file_set_integer(font_table, MUPDF_FONT_GROUP_TABLE, "version", FcGetVersion());
+  if (g_key_file_save_to_file(font_table, path, NULL) == FALSE) {
+    girara_debug("failed to write %s", path);
+  }
+  g_free(path);
+}
+
+/* Compares family names like fontconfig does, i.e. ignoring case and blanks */
+static bool family_equal(const char* a, const char* b) {
+  while (*a != '\0' || *b != '\0') {
+    if (*a == ' ') {
+      a++;
+    } else if (*b == ' ') {
+      b++;
+    } else if (g_ascii_tolower(*a) != g_ascii_tolower(*b)) {
+      return false;
+    } else {
+      a++;
+      b++;
+    }
+  }
+
+  return true;
+}
+
+/* Fonts are only used if they are what was asked for: the family itself or
+ * one of the families that fontconfig binds strongly to it, which are the
+ * metric compatible ones (e.g. Liberation Serif for Times New Roman). The
+ * weak generic fallbacks are worse than mupdf's own substitutes. */
+static bool font_has_family(FcPattern* pattern, FcPattern* match) {
+  FcChar8* family = NULL;
+  if (FcPatternGetString(match, FC_FAMILY, 0, &family) != FcResultMatch) {
+    return false;
+  }
+
+  FcValue value;
+  FcValueBinding binding;
+  for (int i = 0; FcPatternGetWithBinding(pattern, FC_FAMILY, i, &value, &binding) == FcResultMatch; i++) {
+    if (binding == FcValueBindingWeak) {
+      break;
+    }
+    if (value.type == FcTypeString && family_equal((const char*)value.u.s, (const char*)family) == true) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool font_has_language(FcPattern* match, const char* language) {
+  FcLangSet* languages = NULL;
+  return FcPatternGetLangSet(match, FC_LANG, 0, &languages) == FcResultMatch &&
+         FcLangSetHasLang(languages, (const FcChar8*)language) != FcLangDifferentLang;
+}
+
+/* Resolves a font pattern with fontconfig; language is NULL for lookups by
+ * family */
+static bool match_font(FcPattern* pattern, const char* language, char** path, int* index) {
+  if (fontconfig_initialized == false) {
+    fontconfig_initialized = FcInit() == FcTrue;
+    if (fontconfig_initialized == false) {
+      return false;
+    }
+  }
+
+  FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+  FcDefaultSubstitute(pattern);
+
+  FcResult result;
+  FcPattern* match = FcFontMatch(NULL, pattern, &result);
+  if (match == NULL) {
+    return false;
+  }
+
+  FcChar8* file = NULL;
+  bool found    = FcPatternGetString(match, FC_FILE, 0, &file) == FcResultMatch;
+  if (found == true) {
+    found = language != NULL ? font_has_language(match, language) : font_has_family(pattern, match);
+  }
+  if (found == true) {
+    *path = g_strdup((const char*)file);
+    if (FcPatternGetInteger(match, FC_INDEX, 0, index) != FcResultMatch) {
+      *index = 0;
+    }
+  }
+
+  FcPatternDestroy(match);
+  return found;
+}
+
+static mupdf_font_file_t* map_font_file(const char* path) {
+  mupdf_font_file_t* file = g_hash_table_lookup(font_files, path);
+  if (file != NULL) {
+    return file;
+  }
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  struct stat st;
+  void* data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) != 0 && st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+
+  file         = g_new(mupdf_font_file_t, 1);
+  file->data   = data;
+  file->length = st.st_size;
+  g_hash_table_insert(font_files, g_strdup(path), file);
+
+  return file;
+}
+
+/* Looks up a request in the lookup table and resolves it with fontconfig if
+ * it is not there yet. Requests that cannot be resolved are remembered as
+ * well, so fontconfig is not asked again. The pattern is only used for new
+ * requests and is destroyed. */
+static mupdf_font_file_t* lookup_font(const char* request, FcPattern* pattern, const char* language, int* index) {
+  char* key                    = g_uri_escape_string(request, ":", FALSE);
+  mupdf_font_file_t* font_file = NULL;
+
+  g_mutex_lock(&fonts_mutex);
+  if (font_table == NULL) {
+    font_table = load_font_table();
+    font_files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  }
+
+  /* entries are "index:path" or empty if there is no such font */
+  char* entry = g_key_file_get_string(font_table, MUPDF_FONT_GROUP_FONTS, key, NULL);
+  if (entry != NULL) {
+    char* path = strchr(entry, ':');
+    if (path != NULL) {
+      *index    = atoi(entry);
+      font_file = map_font_file(path + 1);
+    }
+
+    /* fonts that have been removed are looked up again */
+    if (path == NULL || font_file != NULL) {
+      g_free(entry);
+      goto out;
+    }
+    g_free(entry);
+  }
+
+  char* path = NULL;
+  if (match_font(pattern, language, &path, index) == true) {
+    font_file = map_font_file(path);
+  }
+
+  if (font_file != NULL) {
+    char* value = g_strdup_printf("%d:%s", *index, path);
+    g_key_file_set_string(font_table, MUPDF_FONT_GROUP_FONTS, key, value);
+    g_free(value);
+  } else {
+    g_key_file_set_string(font_table, MUPDF_FONT_GROUP_FONTS, key, "");
+  }
+  save_font_table();
+  g_free(path);
+
+out:
+  g_mutex_unlock(&fonts_mutex);
+  FcPatternDestroy(pattern);
+  g_free(key);
+
+  return font_file;
+}
+
+static fz_font* load_font(fz_context* ctx, const char* request, FcPattern* pattern, const char* language) {
+  int index                    = 0;
+  mupdf_font_file_t* font_file = lookup_font(request, pattern, language, &index);
+  if (font_file == NULL) {
+    return NULL;
+  }
+
+  fz_buffer* volatile buffer = NULL;
+  fz_font* volatile font     = NULL;
+
+  fz_try(ctx) {
+    buffer = fz_new_buffer_from_shared_data(ctx, font_file->data, font_file->length);
+    font   = fz_new_font_from_buffer(ctx, NULL, buffer, index, 0);
+  }
+  fz_always(ctx) {
+    fz_drop_buffer(ctx, buffer);
+  }
+  fz_catch(ctx) {
+    girara_debug("failed to load font for %s: %s", request, fz_caught_message(ctx));
+    font = NULL;
+  }
+
+  return font;
+}
+
+static FcPattern* new_pattern(const char* family, bool bold, bool italic) {
+  FcPattern* pattern = FcPatternCreate();
+  if (family[0] != '\0') {
+    FcPatternAddString(pattern, FC_FAMILY, (const FcChar8*)family);
+  }
+  FcPatternAddInteger(pattern, FC_WEIGHT, bold == true ? FC_WEIGHT_BOLD : FC_WEIGHT_REGULAR);
+  FcPatternAddInteger(pattern, FC_SLANT, italic == true ? FC_SLANT_ITALIC : FC_SLANT_ROMAN);
+
+  return pattern;
+}
+
+/* Font names in PDFs look like ABCDEF+TimesNewRomanPS-BoldMT or Arial,Bold;
+ * fontconfig only knows the family, e.g. Times New Roman. Hyphens are part
+ * of some families, e.g. MS-Mincho, so only styles are removed after them. */
+static char* font_family(const char* name) {
+  static const char* const styles[] = {"Bold", "Italic", "Oblique", "Regular", "Roman", "Book", "Medium", "Light"};
+
+  const char* plus = strchr(name, '+');
+  if (plus != NULL && plus - name == 6) {
+    name = plus + 1;
+  }
+
+  size_t length      = strcspn(name, ",");
+  const char* hyphen = g_strrstr_len(name, length, "-");
+  if (hyphen != NULL) {
+    for (unsigned int i = 0; i < G_N_ELEMENTS(styles); i++) {
+      if (g_str_has_prefix(hyphen + 1, styles[i]) == TRUE) {
+        length = hyphen - name;
+        break;
+      }
+    }
+  }
+
+  char* family = g_strndup(name, length);
+  if (g_str_has_suffix(family, "MT") == TRUE || g_str_has_suffix(family, "PS") == TRUE) {
+    family[strlen(family) - 2] = '\0';
+  }
+
+  return family;
+}
+
+static fz_font* load_system_font(fz_context* ctx, const char* name, int bold, int italic,
+                                 int GIRARA_UNUSED(needs_exact_metrics)) {
+  if (name == NULL || name[0] == '\0') {
+    return NULL;
+  }
+
+  char* family  = font_family(name);
+  char* request = g_strdup_printf("font:%s:%d%d", family, bold != 0, italic != 0);
+  fz_font* font = load_font(ctx, request, new_pattern(family, bold != 0, italic != 0), NULL);
+  g_free(request);
+  g_free(family);
+
+  return font;
+}
+
+static const char* cjk_language(int ordering) {
+  switch (ordering) {
+  case FZ_ADOBE_CNS:
+    return "zh-tw";
+  case FZ_ADOBE_GB:
+    return "zh-cn";
+  case FZ_ADOBE_JAPAN:
+    return "ja";
+  case FZ_ADOBE_KOREA:
+    return "ko";
+  default:
+    return NULL;
+  }
+}
+
+static fz_font* load_system_cjk_font(fz_context* ctx, const char* name, int ordering, int serif) {
+  const char* language = cjk_language(ordering);
+  if (language == NULL) {
+    return NULL;
+  }
+
+  /* any font of the right language will do, but the named one is preferred */
+  char* family       = name != NULL ? font_family(name) : g_strdup("");
+  char* request      = g_strdup_printf("cjk:%s:%s:%d", family, language, serif != 0);
+  FcPattern* pattern = new_pattern(family, false, false);
+  FcPatternAddString(pattern, FC_FAMILY, (const FcChar8*)(serif != 0 ? "serif" : "sans-serif"));
+  FcPatternAddString(pattern, FC_LANG, (const FcChar8*)language);
+
+  fz_font* font = load_font(ctx, request, pattern, language);
+  g_free(request);
+  g_free(family);
+
+  return font;
+}
+
+static const char* fallback_language(int script, int language, char buffer[8]) {
+  if (language == FZ_LANG_zh_Hant) {
+    return "zh-tw";
+  } else if (language == FZ_LANG_zh_Hans) {
+    return "zh-cn";
+  } else if (language != FZ_LANG_UNSET) {
+    return fz_string_from_text_language(buffer, language);
+  }
+
+  for (unsigned int i = 0; i < G_N_ELEMENTS(script_languages); i++) {
+    if (script_languages[i].script == script) {
+      return script_languages[i].language;
+    }
+  }
+
+  return NULL;
+}
+
+static fz_font* load_system_fallback_font(fz_context* ctx, int script, int language, int serif, int bold,
+                                          int italic) {
+  char buffer[8];
+  const char* fc_language = fallback_language(script, language, buffer);
+  if (fc_language == NULL) {
+    return NULL;
+  }
+
+  char* request = g_strdup_printf("fallback:%s:%d%d%d", fc_language, serif != 0, bold != 0, italic != 0);
+  FcPattern* pattern = new_pattern(serif != 0 ? "serif" : "sans-serif", bold != 0, italic != 0);
+  FcPatternAddString(pattern, FC_LANG, (const FcChar8*)fc_language);
+
+  fz_font* font = load_font(ctx, request, pattern, fc_language);
+  g_free(request);
+
+  return font;
+}
+
+void mupdf_install_system_fonts(fz_context* ctx) {
+  fz_install_load_system_font_funcs(ctx, load_system_font, load_system_cjk_font, load_system_fallback_font);
+}
@@ -7,6 +7,15 @@
 #include "plugin.h"
 #include "utils.h"
 
+/* Memory used for decoded image surfaces per document */
+#define MUPDF_IMAGE_CACHE_BUDGET (64 * 1024 * 1024)
+
+typedef struct mupdf_image_entry_s {
+  fz_context* ctx;          /**< Context the image is dropped with */
+  fz_image* image;          /**< The image, kept alive while it is cached */
+  cairo_surface_t* surface; /**< Decoded image */
+} mupdf_image_entry_t;
+
 static void pdf_zathura_image_free(void* image) {
   g_free(image);
 }
@@ -39,12 +48,12 @@ girara_list_t* pdf_page_images_get(zathura_page_t* page, void* data, zathura_err
   }
 
   /* Extract images */
-  g_mutex_lock(&mupdf_document->mutex);
-  if (!mupdf_page->extracted_text) {
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_INTERACTIVE);
+  if (!mupdf_page->content->extracted_text) {
     mupdf_page_extract_text(mupdf_document, mupdf_page);
   }
 
-  for (fz_stext_block* block = mupdf_page->text->first_block; block; block = block->next) {
+  for (fz_stext_block* block = mupdf_page->content->text->first_block; block; block = block->next) {
     if (block->type == FZ_STEXT_BLOCK_IMAGE) {
       zathura_image_t* zathura_image = g_malloc(sizeof(zathura_image_t));
 
@@ -57,7 +66,7 @@ girara_list_t* pdf_page_images_get(zathura_page_t* page, void* data, zathura_err
       girara_list_append(list, zathura_image);
     }
   }
-  g_mutex_unlock(&mupdf_document->mutex);
+  mupdf_document_unlock(mupdf_document);
 
   return list;
 
@@ -100,7 +109,17 @@ cairo_surface_t* pdf_page_image_get_cairo(zathura_page_t* page, void* data, zath
   fz_pixmap* pixmap        = NULL;
   cairo_surface_t* surface = NULL;
 
-  g_mutex_lock(&mupdf_document->mutex);
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_INTERACTIVE);
+
+  /* images are shared between pages and kept alive by their cache entry, so
+   * the image itself identifies the decoded surface */
+  mupdf_image_entry_t* entry = mupdf_cache_lookup(mupdf_document->images, mupdf_image);
+  if (entry != NULL) {
+    surface = cairo_surface_reference(entry->surface);
+    mupdf_document_unlock(mupdf_document);
+    return surface;
+  }
+
   pixmap = fz_get_pixmap_from_image(mupdf_page->ctx, mupdf_image, NULL, NULL, 0, 0);
   if (pixmap == NULL) {
     goto error_free;
@@ -138,14 +157,22 @@ cairo_surface_t* pdf_page_image_get_cairo(zathura_page_t* page, void* data, zath
       s += n;
     }
   }
+  cairo_surface_mark_dirty(surface);
 
   fz_drop_pixmap(mupdf_page->ctx, pixmap);
-  g_mutex_unlock(&mupdf_document->mutex);
+
+  entry          = g_malloc(sizeof(mupdf_image_entry_t));
+  entry->ctx     = mupdf_document->ctx;
+  entry->image   = fz_keep_image(mupdf_document->ctx, mupdf_image);
+  entry->surface = cairo_surface_reference(surface);
+  mupdf_cache_insert(mupdf_document->images, mupdf_image, entry, (size_t)rowstride * height);
+
+  mupdf_document_unlock(mupdf_document);
 
   return surface;
 
 error_free:
-  g_mutex_unlock(&mupdf_document->mutex);
+  mupdf_document_unlock(mupdf_document);
 
   if (pixmap != NULL) {
     fz_drop_pixmap(mupdf_page->ctx, pixmap);
@@ -159,3 +186,15 @@ error_ret:
 
   return NULL;
 }
+
+static void image_entry_free(void* data) {
+  mupdf_image_entry_t* entry = data;
+
+  cairo_surface_destroy(entry->surface);
+  fz_drop_image(entry->ctx, entry->image);
+  g_free(entry);
+}
+
+mupdf_cache_t* mupdf_image_cache_new(void) {
+  return mupdf_cache_new(MUPDF_IMAGE_CACHE_BUDGET, g_direct_hash, g_direct_equal, NULL, image_entry_free);
+}
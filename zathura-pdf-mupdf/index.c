@@ -4,6 +4,7 @@
 
 #include "math.h"
 #include "plugin.h"
+#include "utils.h"
 
 static void build_index(fz_context* ctx, fz_document* document, fz_outline* outline, girara_tree_node_t* root);
 
@@ -16,12 +17,12 @@ girara_tree_node_t* pdf_document_index_generate(zathura_document_t* document, vo
   }
 
   mupdf_document_t* mupdf_document = data;
-  g_mutex_lock(&mupdf_document->mutex);
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_BACKGROUND);
 
   /* get outline */
   fz_outline* outline = fz_load_outline(mupdf_document->ctx, mupdf_document->document);
   if (outline == NULL) {
-    g_mutex_unlock(&mupdf_document->mutex);
+    mupdf_document_unlock(mupdf_document);
     if (error != NULL) {
       *error = ZATHURA_ERROR_UNKNOWN;
     }
@@ -35,7 +36,7 @@ girara_tree_node_t* pdf_document_index_generate(zathura_document_t* document, vo
   /* free outline */
   fz_drop_outline(mupdf_document->ctx, outline);
 
-  g_mutex_unlock(&mupdf_document->mutex);
+  mupdf_document_unlock(mupdf_document);
   return root;
 }
 
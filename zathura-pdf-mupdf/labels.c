@@ -0,0 +1,221 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include <glib.h>
+#include <mupdf/pdf.h>
+
+#include "utils.h"
+
+/* Maximal depth of the PageLabels number tree */
+#define MUPDF_LABELS_MAX_DEPTH 32
+/* Largest number written as roman numeral; larger numbers are written as
+ * decimals, since the numerals grow by one letter per thousand */
+#define MUPDF_LABELS_MAX_ROMAN 3999
+/* Maximal number of letters of a letter label; larger numbers are written as
+ * decimals */
+#define MUPDF_LABELS_MAX_LETTERS 32
+
+typedef struct mupdf_label_range_s {
+  unsigned int index; /**< Index of the first page of the range */
+  int start;          /**< Number of the first page of the range */
+  char style;         /**< Numbering style (D, R, r, A or a) or 0 if there are no numbers */
+  char* prefix;       /**< Label prefix or NULL */
+} mupdf_label_range_t;
+
+struct mupdf_page_labels_s {
+  mupdf_label_range_t* ranges; /**< Ranges sorted by index */
+  unsigned int n_ranges;       /**< Number of ranges */
+  unsigned int n_pages;        /**< Number of pages */
+};
+
+static void label_range_clear(void* data) {
+  mupdf_label_range_t* range = data;
+  g_free(range->prefix);
+}
+
+static gint label_range_compare(gconstpointer a, gconstpointer b) {
+  const mupdf_label_range_t* range_a = a;
+  const mupdf_label_range_t* range_b = b;
+
+  return range_a->index < range_b->index ? -1 : range_a->index > range_b->index;
+}
+
+static void read_number_tree(fz_context* ctx, pdf_obj* node, GArray* ranges, unsigned int depth) {
+  if (node == NULL || depth > MUPDF_LABELS_MAX_DEPTH) {
+    return;
+  }
+
+  pdf_obj* nums = pdf_dict_get(ctx, node, PDF_NAME(Nums));
+  for (int i = 0; i + 1 < pdf_array_len(ctx, nums); i += 2) {
+    const int index = pdf_array_get_int(ctx, nums, i);
+    pdf_obj* dict   = pdf_array_get(ctx, nums, i + 1);
+    if (index < 0 || pdf_is_dict(ctx, dict) == 0) {
+      continue;
+    }
+
+    mupdf_label_range_t range = {.index = index, .start = 1};
+
+    pdf_obj* style = pdf_dict_get(ctx, dict, PDF_NAME(S));
+    if (pdf_is_name(ctx, style) != 0) {
+      const char* name = pdf_to_name(ctx, style);
+      if (name[0] != '\0' && name[1] == '\0' && strchr("DRrAa", name[0]) != NULL) {
+        range.style = name[0];
+      }
+    }
+
+    pdf_obj* start = pdf_dict_get(ctx, dict, PDF_NAME(St));
+    if (pdf_is_int(ctx, start) != 0 && pdf_to_int(ctx, start) > 0) {
+      range.start = pdf_to_int(ctx, start);
+    }
+
+    pdf_obj* prefix = pdf_dict_get(ctx, dict, PDF_NAME(P));
+    if (prefix != NULL) {
+      range.prefix = g_strdup(pdf_to_text_string(ctx, prefix));
+    }
+
+    g_array_append_val(ranges, range);
+  }
+
+  pdf_obj* kids = pdf_dict_get(ctx, node, PDF_NAME(Kids));
+  for (int i = 0; i < pdf_array_len(ctx, kids); i++) {
+    read_number_tree(ctx, pdf_array_get(ctx, kids, i), ranges, depth + 1);
+  }
+}
+
+mupdf_page_labels_t* mupdf_page_labels_new(fz_context* ctx, fz_document* document, unsigned int n_pages) {
+  pdf_document* pdf_document = pdf_specifics(ctx, document);
+  if (pdf_document == NULL) {
+    return NULL;
+  }
+
+  GArray* ranges = g_array_new(FALSE, FALSE, sizeof(mupdf_label_range_t));
+  g_array_set_clear_func(ranges, label_range_clear);
+
+  fz_try(ctx) {
+    pdf_obj* root = pdf_dict_get(ctx, pdf_trailer(ctx, pdf_document), PDF_NAME(Root));
+    read_number_tree(ctx, pdf_dict_get(ctx, root, PDF_NAME(PageLabels)), ranges, 0);
+  }
+  fz_catch(ctx) {
+    g_array_free(ranges, TRUE);
+    return NULL;
+  }
+
+  g_array_sort(ranges, label_range_compare);
+
+  mupdf_page_labels_t* labels = g_malloc0(sizeof(mupdf_page_labels_t));
+  labels->n_pages             = n_pages;
+  labels->n_ranges            = ranges->len;
+  labels->ranges              = (mupdf_label_range_t*)(void*)g_array_free(ranges, FALSE);
+
+  return labels;
+}
+
+void mupdf_page_labels_free(mupdf_page_labels_t* labels) {
+  if (labels == NULL) {
+    return;
+  }
+
+  for (unsigned int i = 0; i < labels->n_ranges; i++) {
+    label_range_clear(&labels->ranges[i]);
+  }
+  g_free(labels->ranges);
+  g_free(labels);
+}
+
+static void append_roman(GString* string, int number, bool upper) {
+  if (number > MUPDF_LABELS_MAX_ROMAN) {
+    g_string_append_printf(string, "%d", number);
+    return;
+  }
+
+  static const struct {
+    int value;
+    const char* numeral;
+  } numerals[] = {
+      {1000, "m"}, {900, "cm"}, {500, "d"}, {400, "cd"}, {100, "c"}, {90, "xc"}, {50, "l"},
+      {40, "xl"},  {10, "x"},   {9, "ix"},  {5, "v"},    {4, "iv"},  {1, "i"},
+  };
+
+  for (unsigned int i = 0; i < G_N_ELEMENTS(numerals); i++) {
+    for (; number >= numerals[i].value; number -= numerals[i].value) {
+      for (const char* c = numerals[i].numeral; *c != '\0'; c++) {
+        g_string_append_c(string, upper == true ? g_ascii_toupper(*c) : *c);
+      }
+    }
+  }
+}
+
+static void append_letters(GString* string, int number, bool upper) {
+  if ((number - 1) / 26 >= MUPDF_LABELS_MAX_LETTERS) {
+    g_string_append_printf(string, "%d", number);
+    return;
+  }
+
+  /* A to Z, then AA to ZZ, then AAA to ZZZ, ... */
+  const char letter = (upper == true ? 'A' : 'a') + (number - 1) % 26;
+  for (int i = 0; i <= (number - 1) / 26; i++) {
+    g_string_append_c(string, letter);
+  }
+}
+
+static void append_number(GString* string, char style, int number) {
+  switch (style) {
+  case 'D':
+    g_string_append_printf(string, "%d", number);
+    break;
+  case 'R':
+  case 'r':
+    append_roman(string, number, style == 'R');
+    break;
+  case 'A':
+  case 'a':
+    append_letters(string, number, style == 'A');
+    break;
+  default:
+    break;
+  }
+}
+
+/* Returns the range containing the page, or NULL if the page is not covered
+ * by any range */
+static const mupdf_label_range_t* find_range(const mupdf_page_labels_t* labels, unsigned int index) {
+  const mupdf_label_range_t* range = NULL;
+
+  unsigned int low  = 0;
+  unsigned int high = labels->n_ranges;
+  while (low < high) {
+    const unsigned int mid = low + (high - low) / 2;
+    if (labels->ranges[mid].index <= index) {
+      range = &labels->ranges[mid];
+      low   = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  return range;
+}
+
+char* mupdf_page_labels_get(const mupdf_page_labels_t* labels, unsigned int index) {
+  if (labels == NULL || index >= labels->n_pages) {
+    return NULL;
+  }
+
+  const mupdf_label_range_t* range = find_range(labels, index);
+  if (range == NULL) {
+    /* no labels: pages are numbered starting with 1 */
+    return g_strdup_printf("%u", index + 1);
+  }
+
+  /* /St is only bounded by the range of integers */
+  const int64_t number = (int64_t)range->start + (index - range->index);
+
+  GString* label = g_string_new(range->prefix);
+  append_number(label, range->style, (int)MIN(number, G_MAXINT));
+
+  if (label->len == 0) {
+    g_string_free(label, TRUE);
+    return NULL;
+  }
+
+  return g_string_free(label, FALSE);
+}
@@ -3,8 +3,32 @@
 #include <glib.h>
 
 #include "plugin.h"
+#include "utils.h"
 #include "math.h"
 
+static void link_clear(void* data) {
+  mupdf_link_t* link = data;
+  g_free(link->uri);
+}
+
+/* Copies the links of a page, so they do not refer to the document anymore
+ * and can be kept with the page contents */
+static GArray* load_links(fz_context* ctx, fz_page* page) {
+  GArray* links = g_array_new(FALSE, FALSE, sizeof(mupdf_link_t));
+  g_array_set_clear_func(links, link_clear);
+
+  fz_link* link_head = fz_load_links(ctx, page);
+  for (fz_link* link = link_head; link != NULL; link = link->next) {
+    if (link->uri != NULL) {
+      mupdf_link_t copy = {.rect = link->rect, .uri = g_strdup(link->uri)};
+      g_array_append_val(links, copy);
+    }
+  }
+  fz_drop_link(ctx, link_head);
+
+  return links;
+}
+
 girara_list_t* pdf_page_links_get(zathura_page_t* page, void* data, zathura_error_t* error) {
   if (page == NULL) {
     if (error != NULL) {
@@ -15,7 +39,7 @@ girara_list_t* pdf_page_links_get(zathura_page_t* page, void* data, zathura_erro
 
   mupdf_page_t* mupdf_page     = data;
   zathura_document_t* document = zathura_page_get_document(page);
-  if (document == NULL || mupdf_page == NULL || mupdf_page->page == NULL) {
+  if (document == NULL || mupdf_page == NULL) {
     goto error_ret;
   }
 
@@ -29,10 +53,21 @@ girara_list_t* pdf_page_links_get(zathura_page_t* page, void* data, zathura_erro
     goto error_free;
   }
 
-  g_mutex_lock(&mupdf_document->mutex);
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_INTERACTIVE);
+
+  if (mupdf_page_load(mupdf_document, mupdf_page) == false) {
+    mupdf_document_unlock(mupdf_document);
+    return list;
+  }
+
+  mupdf_page_content_share(mupdf_document, mupdf_page);
+  if (mupdf_page->content->links == NULL) {
+    mupdf_page->content->links = load_links(mupdf_document->ctx, mupdf_page->page);
+  }
+
+  for (unsigned int i = 0; i < mupdf_page->content->links->len; i++) {
+    const mupdf_link_t* link = &g_array_index(mupdf_page->content->links, mupdf_link_t, i);
 
-  fz_link* link_head = fz_load_links(mupdf_document->ctx, mupdf_page->page);
-  for (fz_link* link = link_head; link != NULL; link = link->next) {
     /* extract position */
     zathura_rectangle_t position;
     position.x1 = link->rect.x0;
@@ -74,8 +109,7 @@ girara_list_t* pdf_page_links_get(zathura_page_t* page, void* data, zathura_erro
       girara_list_append(list, zathura_link);
     }
   }
-  fz_drop_link(mupdf_document->ctx, link_head);
-  g_mutex_unlock(&mupdf_document->mutex);
+  mupdf_document_unlock(mupdf_document);
 
   return list;
 
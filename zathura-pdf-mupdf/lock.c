@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include <glib.h>
+
+#include "utils.h"
+
+void mupdf_lock_init(mupdf_lock_t* lock) {
+  *lock = (mupdf_lock_t){0};
+  g_mutex_init(&lock->mutex);
+  g_cond_init(&lock->cond);
+  for (unsigned int i = 0; i < MUPDF_PRIORITY_COUNT; i++) {
+    g_queue_init(&lock->waiting[i]);
+  }
+}
+
+void mupdf_lock_clear(mupdf_lock_t* lock) {
+  g_cond_clear(&lock->cond);
+  g_mutex_clear(&lock->mutex);
+}
+
+static unsigned int lock_depth(mupdf_lock_t* lock) {
+  unsigned int depth = 0;
+  for (unsigned int i = 0; i < MUPDF_PRIORITY_COUNT; i++) {
+    depth += g_queue_get_length(&lock->waiting[i]);
+  }
+
+  return depth;
+}
+
+/* A request is served once the lock is free, no request of a higher class is
+ * waiting and all earlier requests of its own class have been served */
+static bool lock_is_next(mupdf_lock_t* lock, mupdf_priority_t priority, GList* link) {
+  if (lock->held == true) {
+    return false;
+  }
+
+  for (unsigned int i = 0; i < priority; i++) {
+    if (g_queue_is_empty(&lock->waiting[i]) == FALSE) {
+      return false;
+    }
+  }
+
+  return lock->waiting[priority].head == link;
+}
+
+bool mupdf_document_lock_request(mupdf_document_t* mupdf_document, mupdf_priority_t priority,
+                                 const gint* generation, gint request) {
+  mupdf_lock_t* lock = &mupdf_document->lock;
+  GList link         = {.data = NULL};
+
+  g_mutex_lock(&lock->mutex);
+  const gint64 start = g_get_monotonic_time();
+
+  g_queue_push_tail_link(&lock->waiting[priority], &link);
+  lock->max_depth = MAX(lock->max_depth, lock_depth(lock));
+  /* older requests that are superseded by this one stop waiting */
+  if (generation != NULL) {
+    g_cond_broadcast(&lock->cond);
+  }
+
+  bool granted = true;
+  while (lock_is_next(lock, priority, &link) == false) {
+    if (generation != NULL && g_atomic_int_get(generation) != request) {
+      granted = false;
+      break;
+    }
+    g_cond_wait(&lock->cond, &lock->mutex);
+  }
+
+  g_queue_unlink(&lock->waiting[priority], &link);
+
+  mupdf_lock_stats_t* stats = &lock->stats[priority];
+  if (granted == true) {
+    const gint64 wait = g_get_monotonic_time() - start;
+    lock->held        = true;
+    stats->requests++;
+    stats->wait_time += wait;
+    stats->max_wait = MAX(stats->max_wait, wait);
+  } else {
+    stats->dropped++;
+    /* the requests behind this one might be next now */
+    g_cond_broadcast(&lock->cond);
+  }
+
+  g_mutex_unlock(&lock->mutex);
+  return granted;
+}
+
+void mupdf_document_lock(mupdf_document_t* mupdf_document, mupdf_priority_t priority) {
+  mupdf_document_lock_request(mupdf_document, priority, NULL, 0);
+}
+
+void mupdf_document_unlock(mupdf_document_t* mupdf_document) {
+  mupdf_lock_t* lock = &mupdf_document->lock;
+
+  g_mutex_lock(&lock->mutex);
+  lock->held = false;
+  g_cond_broadcast(&lock->cond);
+  g_mutex_unlock(&lock->mutex);
+}
+
+void mupdf_document_lock_stats(mupdf_document_t* mupdf_document, mupdf_lock_stats_t stats[MUPDF_PRIORITY_COUNT],
+                               unsigned int* max_depth) {
+  mupdf_lock_t* lock = &mupdf_document->lock;
+
+  g_mutex_lock(&lock->mutex);
+  memcpy(stats, lock->stats, sizeof(lock->stats));
+  *max_depth = lock->max_depth;
+  g_mutex_unlock(&lock->mutex);
+}
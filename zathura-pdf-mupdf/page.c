@@ -1,6 +1,144 @@
 /* SPDX-License-Identifier: Zlib */
 
+#include <girara/utils.h>
+#include <mupdf/pdf.h>
+
 #include "plugin.h"
+#include "utils.h"
+
+/* Size of pages that are not yet available (US Letter) */
+#define MUPDF_DEFAULT_PAGE_WIDTH 612
+#define MUPDF_DEFAULT_PAGE_HEIGHT 792
+
+/* Computes the bounds of a PDF page from its dictionary, which is often
+ * available before the rest of the page, e.g. from the page tree at the
+ * start of a linearized file */
+static bool page_bounds_from_tree(mupdf_document_t* mupdf_document, unsigned int index, fz_rect* bbox) {
+  fz_context* ctx   = mupdf_document->ctx;
+  pdf_document* pdf = pdf_specifics(ctx, mupdf_document->document);
+  if (pdf == NULL) {
+    return false;
+  }
+
+  bool found = false;
+  fz_try(ctx) {
+    fz_rect box;
+    fz_matrix ctm;
+    pdf_page_obj_transform(ctx, pdf_lookup_page_obj(ctx, pdf, index), &box, &ctm);
+    *bbox = fz_transform_rect(box, ctm);
+    found = fz_is_empty_rect(*bbox) == 0;
+  }
+  fz_catch(ctx) {
+    found = false;
+  }
+
+  return found;
+}
+
+/* Gives the text of a page that has just been loaded the real size of the
+ * page. Zathura's page keeps the placeholder size, since it may only be
+ * changed from the main thread and zathura would not lay out the page again;
+ * the page is fit into it until the document is reloaded. */
+static void page_resize(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page) {
+  const fz_rect bbox = mupdf_page->bbox;
+  girara_debug("page %u is %gx%g", mupdf_page->index, bbox.x1 - bbox.x0, bbox.y1 - bbox.y0);
+
+  mupdf_page_content_t* content = mupdf_page->content;
+  if (content == NULL || content->extracted_text == true) {
+    return;
+  }
+
+  fz_try(mupdf_document->ctx) {
+    fz_stext_page* text = fz_new_stext_page(mupdf_document->ctx, bbox);
+    fz_drop_stext_page(mupdf_document->ctx, content->text);
+    content->text = text;
+  }
+  fz_catch(mupdf_document->ctx) {}
+}
+
+bool mupdf_page_load(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page) {
+  if (mupdf_document == NULL || mupdf_document->ctx == NULL || mupdf_page == NULL) {
+    return false;
+  }
+
+  if (mupdf_page->page != NULL) {
+    return true;
+  }
+
+  const fz_rect placeholder = mupdf_page->bbox;
+  fz_try(mupdf_document->ctx) {
+    mupdf_page->page = fz_load_page(mupdf_document->ctx, mupdf_document->document, mupdf_page->index);
+    mupdf_page->bbox = fz_bound_page(mupdf_document->ctx, mupdf_page->page);
+  }
+  fz_catch(mupdf_document->ctx) {
+    if (fz_caught(mupdf_document->ctx) == FZ_ERROR_TRYLATER) {
+      girara_debug("page %u is not yet available", mupdf_page->index);
+    }
+  }
+
+  /* pages that were not available when zathura asked for their size got a
+   * placeholder size */
+  if (mupdf_page->page != NULL &&
+      memcmp(&placeholder, &mupdf_page->bbox, sizeof(fz_rect)) != 0) {
+    page_resize(mupdf_document, mupdf_page);
+  }
+
+  return mupdf_page->page != NULL;
+}
+
+void mupdf_page_extract_text(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page) {
+  if (mupdf_document == NULL || mupdf_document->ctx == NULL || mupdf_page == NULL || mupdf_page->content == NULL) {
+    return;
+  }
+
+  if (mupdf_page->content->extracted_text == true || mupdf_page_load(mupdf_document, mupdf_page) == false) {
+    return;
+  }
+
+  /* identical pages share their text */
+  mupdf_page_content_share(mupdf_document, mupdf_page);
+  mupdf_page_content_t* content = mupdf_page->content;
+  if (content->extracted_text == true) {
+    return;
+  }
+
+  fz_device* volatile text_device = NULL;
+  fz_cookie cookie                = {0};
+
+  fz_try(mupdf_page->ctx) {
+    fz_stext_options stext_options;
+    stext_options.flags = FZ_STEXT_PRESERVE_IMAGES;
+    text_device         = fz_new_stext_device(mupdf_page->ctx, content->text, &stext_options);
+
+    /* replaying a recorded layer is cheaper than interpreting it again */
+    for (unsigned int i = 0; i < MUPDF_LAYER_COUNT; i++) {
+      if (content->lists[i] != NULL) {
+        fz_run_display_list(mupdf_page->ctx, content->lists[i], text_device, fz_identity, fz_infinite_rect, &cookie);
+      } else {
+        mupdf_run_page_layer(mupdf_page->ctx, mupdf_page->page, i, text_device, fz_identity, &cookie);
+      }
+    }
+  }
+  fz_always(mupdf_document->ctx) {
+    fz_close_device(mupdf_page->ctx, text_device);
+    fz_drop_device(mupdf_page->ctx, text_device);
+  }
+  fz_catch(mupdf_document->ctx) {}
+
+  /* Parts of the page are still missing: start over with an empty text page
+   * the next time the text is needed. */
+  if (cookie.incomplete != 0) {
+    fz_try(mupdf_page->ctx) {
+      fz_stext_page* text = fz_new_stext_page(mupdf_page->ctx, mupdf_page->bbox);
+      fz_drop_stext_page(mupdf_page->ctx, content->text);
+      content->text = text;
+    }
+    fz_catch(mupdf_page->ctx) {}
+    return;
+  }
+
+  content->extracted_text = true;
+}
 
 zathura_error_t pdf_page_init(zathura_page_t* page) {
   if (page == NULL) {
@@ -16,28 +154,26 @@ zathura_error_t pdf_page_init(zathura_page_t* page) {
     return ZATHURA_ERROR_OUT_OF_MEMORY;
   }
 
-  g_mutex_lock(&mupdf_document->mutex);
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_PREFETCH);
   mupdf_page->ctx = mupdf_document->ctx;
   if (mupdf_page->ctx == NULL) {
     goto error_free;
   }
 
-  /* load page */
-  fz_try(mupdf_page->ctx) {
-    mupdf_page->page = fz_load_page(mupdf_document->ctx, mupdf_document->document, index);
-    mupdf_page->bbox = fz_bound_page(mupdf_document->ctx, (fz_page*)mupdf_page->page);
-    mupdf_page->text = fz_new_stext_page(mupdf_page->ctx, mupdf_page->bbox);
-  }
-  fz_catch(mupdf_page->ctx) {
-    goto error_free;
+  /* load page; pages of progressively loaded documents might not be
+   * available yet and are loaded once they are needed. Until then their
+   * size is taken from the page tree if possible; the size of zathura's page
+   * is corrected when the page is loaded. */
+  mupdf_page->index = index;
+  if (mupdf_page_load(mupdf_document, mupdf_page) == false &&
+      page_bounds_from_tree(mupdf_document, index, &mupdf_page->bbox) == false) {
+    mupdf_page->bbox = (fz_rect){.x1 = MUPDF_DEFAULT_PAGE_WIDTH, .y1 = MUPDF_DEFAULT_PAGE_HEIGHT};
   }
 
-  mupdf_page->extracted_text = false;
-
-  if (mupdf_page->text == NULL) {
+  if (mupdf_page_content_attach(mupdf_document, mupdf_page) == false) {
     goto error_free;
   }
-  g_mutex_unlock(&mupdf_document->mutex);
+  mupdf_document_unlock(mupdf_document);
 
   zathura_page_set_data(page, mupdf_page);
 
@@ -48,7 +184,7 @@ zathura_error_t pdf_page_init(zathura_page_t* page) {
   return ZATHURA_ERROR_OK;
 
 error_free:
-  g_mutex_unlock(&mupdf_document->mutex);
+  mupdf_document_unlock(mupdf_document);
 
   pdf_page_clear(page, mupdf_page);
 
@@ -64,11 +200,9 @@ zathura_error_t pdf_page_clear(zathura_page_t* page, void* data) {
   zathura_document_t* document     = zathura_page_get_document(page);
   mupdf_document_t* mupdf_document = zathura_document_get_data(document);
 
-  g_mutex_lock(&mupdf_document->mutex);
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_INTERACTIVE);
   if (mupdf_page != NULL) {
-    if (mupdf_page->text != NULL) {
-      fz_drop_stext_page(mupdf_page->ctx, mupdf_page->text);
-    }
+    mupdf_page_content_detach(mupdf_document, mupdf_page);
 
     if (mupdf_page->page != NULL) {
       fz_drop_page(mupdf_document->ctx, mupdf_page->page);
@@ -76,7 +210,7 @@ zathura_error_t pdf_page_clear(zathura_page_t* page, void* data) {
 
     free(mupdf_page);
   }
-  g_mutex_unlock(&mupdf_document->mutex);
+  mupdf_document_unlock(mupdf_document);
 
   return ZATHURA_ERROR_OK;
 }
@@ -93,17 +227,29 @@ zathura_error_t pdf_page_get_label(zathura_page_t* page, void* data, char** labe
   }
   mupdf_document_t* mupdf_document = zathura_document_get_data(document);
 
-  char buf[16];
+  /* PDF documents: the label table is immutable and needs no lock */
+  if (mupdf_document->labels != NULL) {
+    *label = mupdf_page_labels_get(mupdf_document->labels, mupdf_page->index);
+    return ZATHURA_ERROR_OK;
+  }
+
+  char buf[256] = {0};
+
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_INTERACTIVE);
+  if (mupdf_page_load(mupdf_document, mupdf_page) == false) {
+    mupdf_document_unlock(mupdf_document);
+    *label = NULL;
+    return ZATHURA_ERROR_OK;
+  }
 
-  g_mutex_lock(&mupdf_document->mutex);
   fz_try(mupdf_page->ctx) {
     fz_page_label(mupdf_page->ctx, mupdf_page->page, buf, sizeof(buf));
   }
   fz_catch(mupdf_page->ctx) {
-    g_mutex_unlock(&mupdf_document->mutex);
+    mupdf_document_unlock(mupdf_document);
     return ZATHURA_ERROR_UNKNOWN;
   }
-  g_mutex_unlock(&mupdf_document->mutex);
+  mupdf_document_unlock(mupdf_document);
 
   // fz_page_label() may return an empty string if the label is undefined.
   if (buf[0] != '\0') {
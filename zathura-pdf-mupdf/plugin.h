@@ -10,18 +10,153 @@
 #include <mupdf/fitz.h>
 #include <cairo.h>
 
+#include "cache.h"
+
+/**
+ * Layers of a page, in the order they are drawn. Every layer is recorded into
+ * a display list of its own, so a change to one layer leaves the recordings
+ * of the others intact.
+ */
+typedef enum mupdf_layer_e {
+  MUPDF_LAYER_CONTENTS, /**< Content streams of the page */
+  MUPDF_LAYER_ANNOTS,   /**< Annotations other than form fields */
+  MUPDF_LAYER_WIDGETS,  /**< Form fields */
+  MUPDF_LAYER_COUNT
+} mupdf_layer_t;
+
+/* Length of the digests of page layers (SHA-256) */
+#define MUPDF_LAYER_FINGERPRINT_LENGTH 32
+/* Length of page fingerprints, the digests of all layers one after another */
+#define MUPDF_PAGE_FINGERPRINT_LENGTH (MUPDF_LAYER_COUNT * MUPDF_LAYER_FINGERPRINT_LENGTH)
+
+typedef struct mupdf_page_labels_s mupdf_page_labels_t;
+
+typedef struct mupdf_link_s {
+  fz_rect rect; /**< Position on the page */
+  char* uri;    /**< Target */
+} mupdf_link_t;
+
+/**
+ * Everything derived from a page that does not depend on the document it was
+ * loaded from, so that it can be reused when the document is reloaded and
+ * the page did not change
+ */
+typedef struct mupdf_page_content_s {
+  gint ref_count;                                    /**< Reference count */
+  guint id;                                          /**< Unique identifier, used to key caches */
+  unsigned int pages;                                /**< Number of pages showing the contents */
+  fz_stext_page* text;                               /**< Page text */
+  bool extracted_text;                               /**< If text has already been extracted */
+  bool tested_color;                                 /**< If has_color is set */
+  bool has_color;                                    /**< If the page contains colors other than gray */
+  bool tested_image;                                 /**< If image is set */
+  fz_image* image;                                   /**< The only thing in the page contents or NULL */
+  fz_matrix image_ctm;                               /**< Transformation of image */
+  fz_display_list* lists[MUPDF_LAYER_COUNT];         /**< Recorded layers, NULL until they are recorded */
+  bool portable[MUPDF_LAYER_COUNT];                  /**< If the recorded layer can outlive the document */
+  GList list_link;                                   /**< Link in the queue of recorded pages */
+  GArray* links;                                     /**< Links (mupdf_link_t) or NULL if not yet loaded */
+  bool has_fingerprint;                              /**< If fingerprint is set */
+  guint8 fingerprint[MUPDF_PAGE_FINGERPRINT_LENGTH]; /**< Digests of everything the layers are made of */
+} mupdf_page_content_t;
+
+/**
+ * Color transformation applied while rendering, like the recolor mode of
+ * zathura
+ */
+typedef struct mupdf_recolor_s {
+  bool enabled;    /**< If pages are recolored */
+  int dark_color;  /**< RGB color black is mapped to */
+  int light_color; /**< RGB color white is mapped to */
+} mupdf_recolor_t;
+
+/**
+ * Complexity of a page
+ */
+typedef struct mupdf_page_stats_s {
+  unsigned int paths;         /**< Number of filled, stroked and clipping paths */
+  uint64_t path_segments;     /**< Number of segments of all paths */
+  unsigned int images;        /**< Number of images and image masks */
+  uint64_t image_pixels;      /**< Number of pixels of all decoded images */
+  unsigned int text_runs;     /**< Number of text spans */
+  unsigned int type3_runs;    /**< Number of text spans in Type3 fonts */
+  uint64_t glyphs;            /**< Number of glyphs */
+  unsigned int shadings;      /**< Number of smooth shadings */
+  unsigned int groups;        /**< Number of transparency groups */
+  unsigned int masks;         /**< Number of soft masks */
+  unsigned int tiles;         /**< Number of tiling patterns */
+  gint64 interpretation_time; /**< Time to interpret the page in microseconds */
+  gint64 raster_time;         /**< Time to rasterize the page in microseconds */
+} mupdf_page_stats_t;
+
+/**
+ * Classes of requests for the document lock, most urgent first
+ */
+typedef enum mupdf_priority_e {
+  MUPDF_PRIORITY_VISIBLE,     /**< Rendering pages on screen */
+  MUPDF_PRIORITY_INTERACTIVE, /**< Text, links, images and labels requested by the user */
+  MUPDF_PRIORITY_PREFETCH,    /**< Loading pages and rendering them for printing */
+  MUPDF_PRIORITY_BACKGROUND,  /**< Search, outline, attachments, saving and information */
+  MUPDF_PRIORITY_COUNT
+} mupdf_priority_t;
+
+/**
+ * Statistics of one class of requests for the document lock
+ */
+typedef struct mupdf_lock_stats_s {
+  guint64 requests; /**< Number of granted requests */
+  guint64 dropped;  /**< Number of requests given up because newer ones superseded them */
+  gint64 wait_time; /**< Time spent waiting in microseconds */
+  gint64 max_wait;  /**< Longest wait in microseconds */
+} mupdf_lock_stats_t;
+
+/**
+ * Lock of a document that is granted to the most urgent request first and in
+ * order of arrival within a class
+ */
+typedef struct mupdf_lock_s {
+  GMutex mutex;                                  /**< Protects the fields of the lock */
+  GCond cond;                                    /**< Signalled whenever a waiting request might be next */
+  bool held;                                     /**< If the lock is held */
+  GQueue waiting[MUPDF_PRIORITY_COUNT];          /**< Waiting requests of every class */
+  mupdf_lock_stats_t stats[MUPDF_PRIORITY_COUNT]; /**< Statistics of every class */
+  unsigned int max_depth;                        /**< Largest number of waiting requests */
+} mupdf_lock_t;
+
+/**
+ * Pool of helper processes that render pages of a document
+ */
+typedef struct mupdf_workers_s mupdf_workers_t;
+
 typedef struct mupdf_document_s {
-  fz_context* ctx;       /**< Context */
-  fz_document* document; /**< mupdf document */
-  GMutex mutex;
+  fz_context* ctx;             /**< Context */
+  fz_document* document;       /**< mupdf document */
+  fz_stream* stream;           /**< Stream the document is read from */
+  char* fingerprint;           /**< Fingerprint of the file or NULL */
+  mupdf_recolor_t recolor;     /**< Recoloring of rendered pages */
+  mupdf_cache_t* images;       /**< Decoded image surfaces */
+  mupdf_page_labels_t* labels; /**< Page labels of PDF documents or NULL */
+  GHashTable* stream_digests;  /**< Digests of PDF streams by object number */
+  GHashTable* contents;        /**< Page contents by fingerprint, shared by identical pages */
+  mupdf_cache_t* renders;      /**< Compressed rendered pages */
+  mupdf_cache_t* levels;       /**< Decoded levels of the images of pages that consist of one image */
+  GPtrArray* previous;         /**< Page contents before the document was reloaded, by index, or NULL */
+  GPtrArray* retired;          /**< Page contents of cleared pages, by index, or NULL */
+  GQueue lists;                /**< Page contents with display lists, most recently used first */
+  GArray* page_stats;          /**< Complexity (mupdf_page_stats_t) of the pages analyzed so far */
+  mupdf_workers_t* workers;    /**< Processes rendering pages outside of the lock or NULL */
+  mupdf_lock_t lock;           /**< Lock of everything above, see mupdf_document_lock */
+  GThread* warmer;             /**< Thread loading the first pages in the background or NULL */
+  gint stop_warming;           /**< Set to stop the warmer */
 } mupdf_document_t;
 
 typedef struct mupdf_page_s {
-  fz_page* page;       /**< Reference to the mupdf page */
-  fz_context* ctx;     /**< Context */
-  fz_stext_page* text; /**< Page text */
-  fz_rect bbox;        /**< Bbox */
-  bool extracted_text; /**< If text has already been extracted */
+  fz_page* page;                 /**< Reference to the mupdf page or NULL if not yet available */
+  fz_context* ctx;               /**< Context */
+  mupdf_page_content_t* content; /**< Text, display lists and links */
+  fz_rect bbox;                  /**< Bbox */
+  unsigned int index;            /**< Page index */
+  gint renders;                  /**< Number of requests to render the page on screen */
 } mupdf_page_t;
 
 /**
@@ -0,0 +1,245 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include <math.h>
+#include <glib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "utils.h"
+
+/* Pages with more pixels are rasterized in tiles */
+#define MUPDF_RENDER_TILE_THRESHOLD (2048 * 2048)
+/* Width and height of tiles in pixels */
+#define MUPDF_RENDER_TILE_SIZE 512
+/* Tolerated difference of colors from gray on gray pages */
+#define MUPDF_RENDER_GRAY_THRESHOLD 0.02f
+/* The pixels of images are not tested for color if the images of a page have
+ * more pixels in total */
+#define MUPDF_RENDER_COLOR_TEST_MAX_PIXELS (4 * 1024 * 1024)
+/* Levels with more pixels are not decoded as a whole; the draw device only
+ * decodes the visible parts of such images */
+#define MUPDF_RENDER_LEVEL_MAX_PIXELS (64 * 1024 * 1024)
+/* Images are subsampled by at most 2^(n - 1) */
+#define MUPDF_RENDER_LEVELS 8
+
+/* Expands gray pixels into opaque BGRA pixels */
+static void expand_gray(unsigned char* target, const unsigned char* source, int n) {
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i opaque = _mm_set1_epi8((char)0xFF);
+  for (; i + 16 <= n; i += 16) {
+    const __m128i gray = _mm_loadu_si128((const __m128i*)(source + i));
+    /* gray-gray and gray-alpha byte pairs interleave into gray-gray-gray-alpha */
+    const __m128i gg_low  = _mm_unpacklo_epi8(gray, gray);
+    const __m128i gg_high = _mm_unpackhi_epi8(gray, gray);
+    const __m128i ga_low  = _mm_unpacklo_epi8(gray, opaque);
+    const __m128i ga_high = _mm_unpackhi_epi8(gray, opaque);
+
+    __m128i* pixels = (__m128i*)(target + (size_t)i * 4);
+    _mm_storeu_si128(pixels, _mm_unpacklo_epi16(gg_low, ga_low));
+    _mm_storeu_si128(pixels + 1, _mm_unpackhi_epi16(gg_low, ga_low));
+    _mm_storeu_si128(pixels + 2, _mm_unpacklo_epi16(gg_high, ga_high));
+    _mm_storeu_si128(pixels + 3, _mm_unpackhi_epi16(gg_high, ga_high));
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t opaque = vdupq_n_u8(0xFF);
+  for (; i + 16 <= n; i += 16) {
+    const uint8x16_t gray     = vld1q_u8(source + i);
+    const uint8x16x4_t pixels = {{gray, gray, gray, opaque}};
+    vst4q_u8(target + (size_t)i * 4, pixels);
+  }
+#endif
+  for (; i < n; i++) {
+    target[i * 4 + 0] = source[i];
+    target[i * 4 + 1] = source[i];
+    target[i * 4 + 2] = source[i];
+    target[i * 4 + 3] = 0xFF;
+  }
+}
+
+/* Expands gray pixels into BGRA pixels through a table of recolored pixels */
+static void expand_gray_recolored(unsigned char* target, const unsigned char* source, int n,
+                                  const unsigned char palette[256][4]) {
+  for (int i = 0; i < n; i++) {
+    memcpy(target + (size_t)i * 4, palette[source[i]], 4);
+  }
+}
+
+/* Computes the BGRA pixel every gray value is mapped to; black and white map
+ * to the dark and light color, values in between are interpolated */
+static void recolor_palette(const mupdf_recolor_t* recolor, unsigned char palette[256][4]) {
+  for (int value = 0; value < 256; value++) {
+    for (int channel = 0; channel < 3; channel++) {
+      const int dark          = (recolor->dark_color >> (8 * channel)) & 0xFF;
+      const int light         = (recolor->light_color >> (8 * channel)) & 0xFF;
+      palette[value][channel] = dark + ((light - dark) * value + (light >= dark ? 127 : -127)) / 255;
+    }
+    palette[value][3] = 0xFF;
+  }
+}
+
+/* Rasterizes an area of the scaled page into the corresponding pixels of image.
+ * The layers of the page are drawn one after another onto the same pixels.
+ * Gray pages are rasterized with one channel and expanded afterwards, which
+ * saves the rasterizer three quarters of its memory traffic. Recoloring is
+ * applied to every area right after it is rasterized, while its pixels are
+ * still cached, or as part of the expansion of gray pages. */
+static void render_area(fz_context* ctx, fz_display_list* const lists[MUPDF_LAYER_COUNT], unsigned char* image,
+                        int rowstride, fz_irect area, double scalex, double scaley, bool gray,
+                        const mupdf_recolor_t* recolor) {
+  fz_pixmap* volatile pixmap = NULL;
+  fz_device* volatile device = NULL;
+
+  const int width       = area.x1 - area.x0;
+  const int height      = area.y1 - area.y0;
+  unsigned char* target = image + (size_t)area.y0 * rowstride + (size_t)area.x0 * 4;
+
+  fz_try(ctx) {
+    if (gray == true) {
+      pixmap = fz_new_pixmap_with_bbox(ctx, fz_device_gray(ctx), area, NULL, 0);
+    } else {
+      pixmap = fz_new_pixmap_with_data(ctx, fz_device_bgr(ctx), width, height, NULL, 1, rowstride, target);
+      /* the pixmap is moved to the area instead of translating the page, so
+       * patterns and shadings line up across tiles */
+      pixmap->x = area.x0;
+      pixmap->y = area.y0;
+    }
+    fz_clear_pixmap_with_value(ctx, pixmap, 0xFF);
+
+    device = fz_new_draw_device(ctx, fz_identity, pixmap);
+    for (unsigned int i = 0; i < MUPDF_LAYER_COUNT; i++) {
+      if (fz_display_list_is_empty(ctx, lists[i]) == 0) {
+        fz_run_display_list(ctx, lists[i], device, fz_scale(scalex, scaley), fz_rect_from_irect(area), NULL);
+      }
+    }
+    fz_close_device(ctx, device);
+
+    if (gray == true && recolor != NULL) {
+      unsigned char palette[256][4];
+      recolor_palette(recolor, palette);
+      for (int y = 0; y < height; y++) {
+        expand_gray_recolored(target + (size_t)y * rowstride, pixmap->samples + (size_t)y * pixmap->stride, width,
+                              palette);
+      }
+    } else if (gray == true) {
+      for (int y = 0; y < height; y++) {
+        expand_gray(target + (size_t)y * rowstride, pixmap->samples + (size_t)y * pixmap->stride, width);
+      }
+    } else if (recolor != NULL) {
+      fz_tint_pixmap(ctx, pixmap, recolor->dark_color, recolor->light_color);
+    }
+  }
+  fz_always(ctx) {
+    fz_drop_device(ctx, device);
+    fz_drop_pixmap(ctx, pixmap);
+  }
+  fz_catch(ctx) {
+    fz_rethrow(ctx);
+  }
+}
+
+double mupdf_page_scale(fz_rect bounds, unsigned int width, unsigned int height) {
+  if (fz_is_empty_rect(bounds) != 0) {
+    return 0;
+  }
+
+  return MIN(width / (bounds.x1 - bounds.x0), height / (bounds.y1 - bounds.y0));
+}
+
+void mupdf_render_layers(fz_context* ctx, fz_display_list* const lists[MUPDF_LAYER_COUNT], unsigned char* image,
+                         int rowstride, unsigned int page_width, unsigned int page_height, fz_irect clip, double scalex,
+                         double scaley, bool gray, const mupdf_recolor_t* recolor) {
+  if ((uint64_t)page_width * page_height <= MUPDF_RENDER_TILE_THRESHOLD) {
+    render_area(ctx, lists, image, rowstride, clip, scalex, scaley, gray, recolor);
+    return;
+  }
+
+  for (int y = clip.y0 - clip.y0 % MUPDF_RENDER_TILE_SIZE; y < clip.y1; y += MUPDF_RENDER_TILE_SIZE) {
+    for (int x = clip.x0 - clip.x0 % MUPDF_RENDER_TILE_SIZE; x < clip.x1; x += MUPDF_RENDER_TILE_SIZE) {
+      const fz_irect tile = {x, y, x + MUPDF_RENDER_TILE_SIZE, y + MUPDF_RENDER_TILE_SIZE};
+      render_area(ctx, lists, image, rowstride, fz_intersect_irect(tile, clip), scalex, scaley, gray, recolor);
+    }
+  }
+}
+
+bool mupdf_layers_have_color(fz_context* ctx, fz_display_list* const lists[MUPDF_LAYER_COUNT], bool decoded) {
+  fz_device* volatile device = NULL;
+  int is_color               = 0;
+  bool failed                = false;
+
+  fz_try(ctx) {
+    mupdf_page_stats_t stats = {0};
+    if (decoded == false) {
+      for (unsigned int i = 0; i < MUPDF_LAYER_COUNT; i++) {
+        mupdf_display_list_count(ctx, lists[i], &stats);
+      }
+    }
+
+    const int options = stats.image_pixels <= MUPDF_RENDER_COLOR_TEST_MAX_PIXELS ? FZ_TEST_OPT_IMAGES : 0;
+    device = fz_new_test_device(ctx, &is_color, MUPDF_RENDER_GRAY_THRESHOLD, options | FZ_TEST_OPT_SHADINGS, NULL);
+    for (unsigned int i = 0; i < MUPDF_LAYER_COUNT; i++) {
+      fz_run_display_list(ctx, lists[i], device, fz_identity, fz_infinite_rect, NULL);
+    }
+    fz_close_device(ctx, device);
+  }
+  fz_always(ctx) {
+    fz_drop_device(ctx, device);
+  }
+  fz_catch(ctx) {
+    /* the device stops the page as soon as it finds color */
+    failed = true;
+  }
+
+  return failed == true || is_color != 0;
+}
+
+int mupdf_image_level(const fz_image* image, fz_matrix ctm, double scalex, double scaley) {
+  const double width  = hypot(ctm.a * scalex, ctm.b * scaley);
+  const double height = hypot(ctm.c * scalex, ctm.d * scaley);
+
+  int level = 0;
+  while (level + 1 < MUPDF_RENDER_LEVELS && (image->w >> (level + 1)) >= width &&
+         (image->h >> (level + 1)) >= height) {
+    level++;
+  }
+  if ((uint64_t)(image->w >> level) * (image->h >> level) > MUPDF_RENDER_LEVEL_MAX_PIXELS) {
+    return -1;
+  }
+
+  return level;
+}
+
+fz_display_list* mupdf_image_level_new(fz_context* ctx, fz_image* image, fz_matrix ctm, int level, size_t* size) {
+  fz_pixmap* volatile pixmap     = NULL;
+  fz_image* volatile level_image = NULL;
+  fz_device* volatile device     = NULL;
+  fz_display_list* volatile list = NULL;
+
+  fz_try(ctx) {
+    fz_matrix decode_ctm = fz_scale(image->w >> level, image->h >> level);
+    pixmap               = fz_get_pixmap_from_image(ctx, image, NULL, &decode_ctm, NULL, NULL);
+    *size                = (size_t)pixmap->stride * pixmap->h;
+
+    level_image              = fz_new_image_from_pixmap(ctx, pixmap, NULL);
+    level_image->interpolate = image->interpolate;
+
+    list   = fz_new_display_list(ctx, fz_transform_rect(fz_unit_rect, ctm));
+    device = fz_new_list_device(ctx, list);
+    fz_fill_image(ctx, device, level_image, ctm, 1.0f, fz_default_color_params);
+    fz_close_device(ctx, device);
+  }
+  fz_always(ctx) {
+    fz_drop_device(ctx, device);
+    fz_drop_image(ctx, level_image);
+    fz_drop_pixmap(ctx, pixmap);
+  }
+  fz_catch(ctx) {
+    fz_drop_display_list(ctx, list);
+    fz_rethrow(ctx);
+  }
+
+  return list;
+}
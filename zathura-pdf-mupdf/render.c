@@ -1,58 +1,351 @@
 /* SPDX-License-Identifier: Zlib */
 
 #include <glib.h>
+#include <mupdf/pdf.h>
+#include <girara/utils.h>
 
 #include "plugin.h"
+#include "utils.h"
+
+/* Budget of the cache of compressed rendered pages */
+#define MUPDF_RENDER_CACHE_BUDGET (64 * 1024 * 1024)
+/* Pages are only cached if they compress to at most 1/n of their size */
+#define MUPDF_RENDER_CACHE_MIN_RATIO 4
+/* Budget of the cache of decoded images of pages that consist of one image */
+#define MUPDF_RENDER_LEVEL_CACHE_BUDGET (128 * 1024 * 1024)
+
+typedef struct mupdf_render_key_s {
+  guint content;       /**< Identifier of the page contents */
+  unsigned int width;  /**< Width of the image in pixels */
+  unsigned int height; /**< Height of the image in pixels */
+} mupdf_render_key_t;
+
+typedef struct mupdf_render_s {
+  unsigned char* data; /**< Compressed pixels */
+  size_t length;       /**< Length of data */
+} mupdf_render_t;
+
+static guint render_key_hash(gconstpointer data) {
+  const mupdf_render_key_t* key = data;
+  return key->content ^ (key->width * 31 + key->height);
+}
+
+static gboolean render_key_equal(gconstpointer a, gconstpointer b) {
+  const mupdf_render_key_t* key_a = a;
+  const mupdf_render_key_t* key_b = b;
+  return key_a->content == key_b->content && key_a->width == key_b->width && key_a->height == key_b->height;
+}
+
+static void render_free(void* data) {
+  mupdf_render_t* render = data;
+  g_free(render->data);
+  g_free(render);
+}
+
+/* Keeps a compressed copy of a rendered page; pages that do not compress well,
+ * e.g. photos, would displace many that do and are not kept */
+static void render_cache_insert(mupdf_document_t* mupdf_document, const mupdf_render_key_t* key,
+                                const unsigned char* image, int rowstride) {
+  const size_t size = (size_t)key->width * key->height * 4;
+  size_t length     = 0;
+  unsigned char* data =
+      mupdf_rle_compress(image, key->width, key->height, rowstride, size / MUPDF_RENDER_CACHE_MIN_RATIO, &length);
+  if (data == NULL) {
+    return;
+  }
+
+  if (mupdf_document->renders == NULL) {
+    mupdf_document->renders =
+        mupdf_cache_new(MUPDF_RENDER_CACHE_BUDGET, render_key_hash, render_key_equal, g_free, render_free);
+  }
+
+  mupdf_render_t* render       = g_malloc(sizeof(mupdf_render_t));
+  render->data                 = data;
+  render->length               = length;
+  mupdf_render_key_t* key_copy = g_malloc(sizeof(mupdf_render_key_t));
+  *key_copy                    = *key;
+  mupdf_cache_insert(mupdf_document->renders, key_copy, render, length);
+}
+
+typedef struct mupdf_level_key_s {
+  guint content; /**< Identifier of the page contents */
+  int level;     /**< The image is subsampled by 2^level */
+} mupdf_level_key_t;
+
+typedef struct mupdf_level_s {
+  fz_context* ctx;       /**< Context the level is dropped with */
+  fz_display_list* list; /**< The page contents with the decoded level in place of their image */
+} mupdf_level_t;
+
+static guint level_key_hash(gconstpointer data) {
+  const mupdf_level_key_t* key = data;
+  return key->content * 31 + key->level;
+}
+
+static gboolean level_key_equal(gconstpointer a, gconstpointer b) {
+  const mupdf_level_key_t* key_a = a;
+  const mupdf_level_key_t* key_b = b;
+  return key_a->content == key_b->content && key_a->level == key_b->level;
+}
+
+static void level_free(void* data) {
+  mupdf_level_t* level = data;
+  fz_drop_display_list(level->ctx, level->list);
+  g_free(level);
+}
+
+/* Returns the page contents with their image replaced by a decoded level of
+ * the image (see mupdf_image_level), or NULL if the contents do not consist of
+ * a single image. Levels are decoded once and cached. */
+static fz_display_list* image_page_level(mupdf_document_t* mupdf_document, mupdf_page_content_t* content,
+                                         fz_context* ctx, fz_display_list* display_list, double scalex,
+                                         double scaley) {
+  if (content->tested_image == false) {
+    content->image        = mupdf_page_single_image(ctx, display_list, &content->image_ctm);
+    content->tested_image = true;
+  }
+
+  if (content->image == NULL) {
+    return NULL;
+  }
+
+  const int level = mupdf_image_level(content->image, content->image_ctm, scalex, scaley);
+  if (level < 0) {
+    return NULL;
+  }
+
+  const mupdf_level_key_t key = {.content = content->id, .level = level};
+  const mupdf_level_t* cached = mupdf_cache_lookup(mupdf_document->levels, &key);
+  if (cached != NULL) {
+    return fz_keep_display_list(ctx, cached->list);
+  }
+
+  size_t size           = 0;
+  fz_display_list* list = mupdf_image_level_new(ctx, content->image, content->image_ctm, level, &size);
+
+  if (mupdf_document->levels == NULL) {
+    mupdf_document->levels =
+        mupdf_cache_new(MUPDF_RENDER_LEVEL_CACHE_BUDGET, level_key_hash, level_key_equal, g_free, level_free);
+  }
+
+  mupdf_level_t* value        = g_malloc(sizeof(mupdf_level_t));
+  value->ctx                  = mupdf_document->ctx;
+  value->list                 = fz_keep_display_list(ctx, list);
+  mupdf_level_key_t* key_copy = g_malloc(sizeof(mupdf_level_key_t));
+  *key_copy                   = key;
+  mupdf_cache_insert(mupdf_document->levels, key_copy, value, size);
+
+  return list;
+}
 
 static zathura_error_t pdf_page_render_to_buffer(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page,
-                                                 unsigned char* image, int GIRARA_UNUSED(rowstride),
-                                                 int GIRARA_UNUSED(components), unsigned int page_width,
-                                                 unsigned int page_height, double scalex, double scaley) {
-  if (mupdf_document == NULL || mupdf_document->ctx == NULL || mupdf_page == NULL || mupdf_page->page == NULL ||
-      image == NULL) {
+                                                 unsigned char* image, int rowstride, int GIRARA_UNUSED(components),
+                                                 unsigned int page_width, unsigned int page_height, fz_irect clip,
+                                                 bool printing) {
+  if (mupdf_document == NULL || mupdf_document->ctx == NULL || mupdf_page == NULL || image == NULL) {
     return ZATHURA_ERROR_UNKNOWN;
   }
 
-  g_mutex_lock(&mupdf_document->mutex);
+#ifdef HAVE_DISK_CACHE
+  /* cached pages are read without the lock, so they do not wait for other
+   * requests and do not hold them up */
+  char cache_key[MUPDF_DISK_CACHE_KEY_LENGTH + 1];
+  const bool cacheable = mupdf_disk_cache_key(mupdf_document->fingerprint, mupdf_page->index, page_width,
+                                              page_height, &mupdf_document->recolor, cache_key);
+  if (cacheable == true && mupdf_disk_cache_load(cache_key, image, page_width, page_height, rowstride) == true) {
+    return ZATHURA_ERROR_OK;
+  }
+#endif
+
+  const bool whole_page = clip.x0 == 0 && clip.y0 == 0 && clip.x1 == (int)page_width && clip.y1 == (int)page_height;
 
-  fz_display_list* display_list = fz_new_display_list(mupdf_page->ctx, (fz_rect){.x1 = page_width, .y1 = page_height});
-  fz_device* device             = fz_new_list_device(mupdf_page->ctx, display_list);
+  /* a render of a page on screen that is still waiting when the page is
+   * requested again, e.g. at another zoom level, is given up */
+  const gint request = printing == false ? g_atomic_int_add(&mupdf_page->renders, 1) + 1 : 0;
 
-  fz_try(mupdf_document->ctx) {
-    fz_matrix m;
-    m = fz_scale(scalex, scaley);
-    fz_run_page(mupdf_document->ctx, mupdf_page->page, device, m, NULL);
+#ifdef HAVE_WORKERS
+  /* workers render pages in parallel and without the lock of the document.
+   * Pages they fail to render are rendered here instead, except for pages
+   * that crashed or hung a worker, which would do the same here. */
+  if (mupdf_document->workers != NULL && printing == false) {
+    const mupdf_workers_result_t result =
+        mupdf_workers_render(mupdf_document->workers, mupdf_page->index, image, rowstride, page_width, page_height,
+                             clip, &mupdf_document->recolor, &mupdf_page->renders, request);
+    if (result == MUPDF_WORKERS_LOST || result == MUPDF_WORKERS_SUPERSEDED) {
+      return ZATHURA_ERROR_UNKNOWN;
+    } else if (result == MUPDF_WORKERS_OK) {
+#ifdef HAVE_DISK_CACHE
+      if (cacheable == true && whole_page == true) {
+        mupdf_disk_cache_store(cache_key, image, page_width, page_height, rowstride);
+      }
+#endif
+      return ZATHURA_ERROR_OK;
+    }
   }
-  fz_always(mupdf_document->ctx) {
-    fz_close_device(mupdf_page->ctx, device);
-    fz_drop_device(mupdf_page->ctx, device);
+#endif
+
+  if (printing == true) {
+    mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_PREFETCH);
+  } else if (mupdf_document_lock_request(mupdf_document, MUPDF_PRIORITY_VISIBLE, &mupdf_page->renders, request) ==
+             false) {
+    return ZATHURA_ERROR_UNKNOWN;
   }
-  fz_catch(mupdf_document->ctx) {
-    fz_drop_display_list(mupdf_page->ctx, display_list);
-    g_mutex_unlock(&mupdf_document->mutex);
+
+  /* the page is not available yet; do not render anything, so the page is
+   * rendered again once it is requested the next time */
+  if (mupdf_page_load(mupdf_document, mupdf_page) == false) {
+    mupdf_document_unlock(mupdf_document);
     return ZATHURA_ERROR_UNKNOWN;
   }
 
-  fz_colorspace* colorspace = fz_device_bgr(mupdf_document->ctx);
-  /* TODO: What are separations used for? */
-  fz_pixmap* pixmap = fz_new_pixmap_with_bbox_and_data(mupdf_page->ctx, colorspace,
-                                                       (fz_irect){.x1 = page_width, .y1 = page_height}, NULL, 1, image);
-  fz_clear_pixmap_with_value(mupdf_page->ctx, pixmap, 0xFF);
+  /* a page that has just been loaded may differ in size from the placeholder
+   * the image was made for, so the page is fit to the image as workers do */
+  const double scale = mupdf_page_scale(mupdf_page->bbox, page_width, page_height);
+  if (scale == 0) {
+    mupdf_document_unlock(mupdf_document);
+    return ZATHURA_ERROR_UNKNOWN;
+  }
 
-  device = fz_new_draw_device(mupdf_page->ctx, fz_identity, pixmap);
-  fz_run_display_list(mupdf_page->ctx, display_list, device, fz_identity,
-                      (fz_rect){.x1 = page_width, .y1 = page_height}, NULL);
-  fz_close_device(mupdf_page->ctx, device);
-  fz_drop_device(mupdf_page->ctx, device);
+  /* recently rendered pages are restored from their compressed copy; identical
+   * pages share their contents and hence their copies */
+  mupdf_page_content_share(mupdf_document, mupdf_page);
+  const mupdf_render_key_t key = {.content = mupdf_page->content->id, .width = page_width, .height = page_height};
+  const mupdf_render_t* render = mupdf_cache_lookup(mupdf_document->renders, &key);
+  if (render != NULL && mupdf_rle_decompress(render->data, render->length, image, page_width, page_height,
+                                             rowstride) == true) {
+    mupdf_document_unlock(mupdf_document);
+    return ZATHURA_ERROR_OK;
+  }
 
-  fz_drop_pixmap(mupdf_page->ctx, pixmap);
-  fz_drop_display_list(mupdf_page->ctx, display_list);
+  /* the layers of the page are recorded once and replayed at every scale */
+  fz_cookie cookie                          = {0};
+  fz_display_list* lists[MUPDF_LAYER_COUNT] = {NULL};
+  if (mupdf_page_get_display_lists(mupdf_document, mupdf_page, lists, &cookie) == false) {
+    mupdf_document_unlock(mupdf_document);
+    return ZATHURA_ERROR_UNKNOWN;
+  }
+
+  if (cookie.incomplete != 0) {
+    girara_debug("page %u is not yet complete", mupdf_page->index);
+  }
+
+  fz_context* ctx               = mupdf_page->ctx;
+  mupdf_page_content_t* content = mupdf_page->content;
+
+  /* pages whose contents consist of a single image are drawn from a decoded
+   * level of the image instead of decoding it again; annotations and form
+   * fields are drawn on top as usual */
+  fz_display_list* volatile level = NULL;
+  bool rendered                   = true;
+  fz_try(ctx) {
+    if (cookie.incomplete == 0) {
+      level = image_page_level(mupdf_document, content, ctx, lists[MUPDF_LAYER_CONTENTS], scale, scale);
+    }
+
+    fz_display_list* layers[MUPDF_LAYER_COUNT];
+    memcpy(layers, lists, sizeof(layers));
+    if (level != NULL) {
+      layers[MUPDF_LAYER_CONTENTS] = level;
+    }
+
+    /* whether the page is gray is only tested once, on the decoded level if
+     * there is one */
+    if (content->tested_color == false && cookie.incomplete == 0) {
+      content->has_color    = mupdf_layers_have_color(ctx, layers, level != NULL);
+      content->tested_color = true;
+    }
+    const bool gray = content->tested_color == true && content->has_color == false;
+
+    mupdf_render_layers(ctx, layers, image, rowstride, page_width, page_height, clip, scale, scale, gray,
+                        mupdf_document->recolor.enabled == true ? &mupdf_document->recolor : NULL);
+  }
+  fz_always(ctx) {
+    fz_drop_display_list(ctx, level);
+    for (unsigned int i = 0; i < MUPDF_LAYER_COUNT; i++) {
+      fz_drop_display_list(ctx, lists[i]);
+    }
+  }
+  fz_catch(ctx) {
+    rendered = false;
+  }
+
+  if (rendered == false) {
+    mupdf_document_unlock(mupdf_document);
+    return ZATHURA_ERROR_UNKNOWN;
+  }
+
+  /* only pages rendered completely are cached */
+  const bool complete = cookie.incomplete == 0 && whole_page == true;
+
+  if (complete == true) {
+    render_cache_insert(mupdf_document, &key, image, rowstride);
+  }
+
+  mupdf_document_unlock(mupdf_document);
+
+#ifdef HAVE_DISK_CACHE
+  /* pages of documents that are still loading are rendered again later */
+  if (cacheable == true && complete == true) {
+    mupdf_disk_cache_store(cache_key, image, page_width, page_height, rowstride);
+  }
+#endif
 
-  g_mutex_unlock(&mupdf_document->mutex);
   return ZATHURA_ERROR_OK;
 }
 
-zathura_error_t pdf_page_render_cairo(zathura_page_t* page, void* data, cairo_t* cairo, bool GIRARA_UNUSED(printing)) {
+/* Renders the page with the cairo device, so vector surfaces (e.g. the print
+ * surfaces) receive paths, text and images instead of one large raster image */
+static zathura_error_t pdf_page_render_vector(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page,
+                                             cairo_t* cairo, bool printing) {
+  if (mupdf_document == NULL || mupdf_document->ctx == NULL || mupdf_page == NULL) {
+    return ZATHURA_ERROR_UNKNOWN;
+  }
+
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_PREFETCH);
+
+  if (mupdf_page_load(mupdf_document, mupdf_page) == false) {
+    mupdf_document_unlock(mupdf_document);
+    return ZATHURA_ERROR_UNKNOWN;
+  }
+
+  fz_context* ctx            = mupdf_page->ctx;
+  fz_device* volatile device = NULL;
+  fz_cookie cookie           = {0};
+  zathura_error_t error      = ZATHURA_ERROR_OK;
+
+  cairo_save(cairo);
+  cairo_translate(cairo, -mupdf_page->bbox.x0, -mupdf_page->bbox.y0);
+
+  fz_try(ctx) {
+    device = mupdf_new_cairo_device(ctx, cairo);
+
+    pdf_page* pdf_page = pdf_page_from_fz_page(ctx, mupdf_page->page);
+    if (printing == true && pdf_page != NULL) {
+      /* honour optional content that is only visible when printing */
+      pdf_run_page_with_usage(ctx, pdf_page, device, fz_identity, "Print", &cookie);
+    } else {
+      fz_run_page(ctx, mupdf_page->page, device, fz_identity, &cookie);
+    }
+    fz_close_device(ctx, device);
+  }
+  fz_always(ctx) {
+    fz_drop_device(ctx, device);
+  }
+  fz_catch(ctx) {
+    error = ZATHURA_ERROR_UNKNOWN;
+  }
+
+  cairo_restore(cairo);
+
+  if (cookie.incomplete != 0) {
+    girara_debug("page %u is not yet complete", mupdf_page->index);
+  }
+
+  mupdf_document_unlock(mupdf_document);
+  return error;
+}
+
+zathura_error_t pdf_page_render_cairo(zathura_page_t* page, void* data, cairo_t* cairo, bool printing) {
   mupdf_page_t* mupdf_page = data;
 
   if (page == NULL || mupdf_page == NULL) {
@@ -60,8 +353,7 @@ zathura_error_t pdf_page_render_cairo(zathura_page_t* page, void* data, cairo_t*
   }
 
   cairo_surface_t* surface = cairo_get_target(cairo);
-  if (surface == NULL || cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS ||
-      cairo_surface_get_type(surface) != CAIRO_SURFACE_TYPE_IMAGE) {
+  if (surface == NULL || cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
     return ZATHURA_ERROR_UNKNOWN;
   }
 
@@ -70,17 +362,32 @@ zathura_error_t pdf_page_render_cairo(zathura_page_t* page, void* data, cairo_t*
     return ZATHURA_ERROR_UNKNOWN;
   }
 
+  mupdf_document_t* mupdf_document = zathura_document_get_data(document);
+
+  if (cairo_surface_get_type(surface) != CAIRO_SURFACE_TYPE_IMAGE) {
+    return pdf_page_render_vector(mupdf_document, mupdf_page, cairo, printing);
+  }
+
   unsigned int page_width  = cairo_image_surface_get_width(surface);
   unsigned int page_height = cairo_image_surface_get_height(surface);
 
-  double scalex = ((double)page_width) / zathura_page_get_width(page);
-  double scaley = ((double)page_height) / zathura_page_get_height(page);
-
   int rowstride        = cairo_image_surface_get_stride(surface);
   unsigned char* image = cairo_image_surface_get_data(surface);
 
-  mupdf_document_t* mupdf_document = zathura_document_get_data(document);
+  /* only the pixels inside the clip of the context are rasterized */
+  double x0, y0, x1, y1, device_scalex, device_scaley;
+  cairo_save(cairo);
+  cairo_identity_matrix(cairo);
+  cairo_clip_extents(cairo, &x0, &y0, &x1, &y1);
+  cairo_restore(cairo);
+  cairo_surface_get_device_scale(surface, &device_scalex, &device_scaley);
+
+  const fz_rect extents = {x0 * device_scalex, y0 * device_scaley, x1 * device_scalex, y1 * device_scaley};
+  const fz_irect clip   = fz_intersect_irect(fz_round_rect(extents), (fz_irect){.x1 = page_width, .y1 = page_height});
+  if (fz_is_empty_irect(clip) != 0) {
+    return ZATHURA_ERROR_OK;
+  }
 
-  return pdf_page_render_to_buffer(mupdf_document, mupdf_page, image, rowstride, 4, page_width, page_height, scalex,
-                                   scaley);
+  return pdf_page_render_to_buffer(mupdf_document, mupdf_page, image, rowstride, 4, page_width, page_height, clip,
+                                   printing);
 }
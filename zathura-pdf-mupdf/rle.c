@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include <glib.h>
+
+#include "utils.h"
+
+/* Pixels are encoded as a sequence of 32-bit tokens: a token with the run flag
+ * is followed by one pixel that is repeated count times, any other token is
+ * followed by count literal pixels. Runs continue across rows. */
+#define MUPDF_RLE_RUN 0x80000000u
+#define MUPDF_RLE_MAX_COUNT 0x7fffffffu
+/* Shorter runs are stored as literals, since they would not save space */
+#define MUPDF_RLE_MIN_RUN 3
+
+typedef struct mupdf_rle_writer_s {
+  unsigned char* data; /**< Encoded data */
+  size_t length;       /**< Length of the encoded data */
+  size_t limit;        /**< Size of data */
+  size_t literal;      /**< Offset of the token of the current literal sequence */
+  uint32_t literals;   /**< Number of pixels in the current literal sequence, 0 if there is none */
+} mupdf_rle_writer_t;
+
+static uint32_t load_pixel(const unsigned char* data) {
+  uint32_t pixel;
+  memcpy(&pixel, data, sizeof(pixel));
+  return pixel;
+}
+
+static void store_pixel(unsigned char* data, uint32_t pixel) {
+  memcpy(data, &pixel, sizeof(pixel));
+}
+
+static bool write_word(mupdf_rle_writer_t* writer, uint32_t word) {
+  if (writer->limit - writer->length < sizeof(word)) {
+    return false;
+  }
+
+  store_pixel(writer->data + writer->length, word);
+  writer->length += sizeof(word);
+  return true;
+}
+
+static bool write_run(mupdf_rle_writer_t* writer, uint32_t pixel, uint32_t count) {
+  if (count >= MUPDF_RLE_MIN_RUN) {
+    writer->literals = 0;
+    return write_word(writer, MUPDF_RLE_RUN | count) && write_word(writer, pixel);
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (writer->literals == 0 || writer->literals == MUPDF_RLE_MAX_COUNT) {
+      writer->literal  = writer->length;
+      writer->literals = 0;
+      if (write_word(writer, 0) == false) {
+        return false;
+      }
+    }
+
+    if (write_word(writer, pixel) == false) {
+      return false;
+    }
+    store_pixel(writer->data + writer->literal, ++writer->literals);
+  }
+
+  return true;
+}
+
+unsigned char* mupdf_rle_compress(const unsigned char* image, unsigned int width, unsigned int height, int rowstride,
+                                  size_t limit, size_t* length) {
+  mupdf_rle_writer_t writer = {.data = g_malloc(limit), .limit = limit};
+
+  uint32_t pixel = 0;
+  uint32_t count = 0;
+  bool success   = true;
+
+  for (unsigned int y = 0; y < height && success == true; y++) {
+    const unsigned char* row = image + (size_t)y * rowstride;
+    for (unsigned int x = 0; x < width && success == true; x++) {
+      const uint32_t current = load_pixel(row + (size_t)x * 4);
+      if (count > 0 && current == pixel && count < MUPDF_RLE_MAX_COUNT) {
+        count++;
+        continue;
+      }
+
+      success = write_run(&writer, pixel, count);
+      pixel   = current;
+      count   = 1;
+    }
+  }
+
+  if (success == false || write_run(&writer, pixel, count) == false) {
+    g_free(writer.data);
+    return NULL;
+  }
+
+  *length = writer.length;
+  return g_realloc(writer.data, writer.length);
+}
+
+bool mupdf_rle_decompress(const unsigned char* data, size_t length, unsigned char* image, unsigned int width,
+                          unsigned int height, int rowstride) {
+  if (width == 0) {
+    return false;
+  }
+
+  unsigned int x = 0;
+  unsigned int y = 0;
+
+  for (size_t offset = 0; offset + 4 <= length;) {
+    const uint32_t token = load_pixel(data + offset);
+    offset += 4;
+
+    const bool run = (token & MUPDF_RLE_RUN) != 0;
+    uint32_t count = token & MUPDF_RLE_MAX_COUNT;
+    if (length - offset < (run == true ? 4 : (uint64_t)count * 4)) {
+      return false;
+    }
+
+    const unsigned char* source = data + offset;
+    offset += run == true ? 4 : (size_t)count * 4;
+
+    while (count > 0) {
+      if (y == height) {
+        return false;
+      }
+
+      const unsigned int n  = MIN(count, width - x);
+      unsigned char* target = image + (size_t)y * rowstride + (size_t)x * 4;
+      if (run == true) {
+        const uint32_t pixel = load_pixel(source);
+        for (unsigned int i = 0; i < n; i++) {
+          store_pixel(target + (size_t)i * 4, pixel);
+        }
+      } else {
+        memcpy(target, source, (size_t)n * 4);
+        source += (size_t)n * 4;
+      }
+
+      count -= n;
+      x += n;
+      if (x == width) {
+        x = 0;
+        y++;
+      }
+    }
+  }
+
+  return y == height && x == 0;
+}
@@ -1,12 +1,42 @@
 /* SPDX-License-Identifier: Zlib */
 
-#define N_SEARCH_RESULTS 512
-
 #include <glib.h>
+#include <girara/utils.h>
 
 #include "plugin.h"
 #include "utils.h"
 
+/* Every hit is added to the results as it is found, so their number is not
+ * limited */
+static int append_hit(fz_context* GIRARA_UNUSED(ctx), void* list, int num_quads, fz_quad* hit_bbox) {
+  mupdf_append_quads(list, hit_bbox, num_quads);
+  return 0;
+}
+
+/* Searches the text of a page, extracting it first if necessary, and appends
+ * the hits to the list. Returns the number of hits or -1 on error. The
+ * document has to be locked. */
+static int search_page(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page, const char* text,
+                       girara_list_t* list) {
+  if (mupdf_page->content->extracted_text == false) {
+    mupdf_page_extract_text(mupdf_document, mupdf_page);
+  }
+
+  if (mupdf_page->content->text == NULL) {
+    return -1;
+  }
+
+  int hits = -1;
+  fz_try(mupdf_page->ctx) {
+    hits = fz_search_stext_page_cb(mupdf_page->ctx, mupdf_page->content->text, text, append_hit, list);
+  }
+  fz_catch(mupdf_page->ctx) {
+    girara_debug("failed to search page %u: %s", mupdf_page->index, fz_caught_message(mupdf_page->ctx));
+  }
+
+  return hits;
+}
+
 girara_list_t* pdf_page_search_text(zathura_page_t* page, void* data, const char* text, zathura_error_t* error) {
   if (page == NULL || text == NULL) {
     if (error != NULL) {
@@ -17,7 +47,7 @@ girara_list_t* pdf_page_search_text(zathura_page_t* page, void* data, const char
 
   mupdf_page_t* mupdf_page     = data;
   zathura_document_t* document = zathura_page_get_document(page);
-  if (document == NULL || mupdf_page == NULL || mupdf_page->text == NULL) {
+  if (document == NULL || mupdf_page == NULL || mupdf_page->content == NULL) {
     goto error_ret;
   }
 
@@ -31,32 +61,14 @@ girara_list_t* pdf_page_search_text(zathura_page_t* page, void* data, const char
     goto error_free;
   }
 
-  g_mutex_lock(&mupdf_document->mutex);
-
-  /* extract text */
-  if (mupdf_page->extracted_text == false) {
-    mupdf_page_extract_text(mupdf_document, mupdf_page);
-  }
-
-  fz_quad* hit_bbox = fz_malloc_array(mupdf_page->ctx, N_SEARCH_RESULTS, fz_quad);
-  int num_results   = fz_search_stext_page(mupdf_page->ctx, mupdf_page->text, text, NULL, hit_bbox, N_SEARCH_RESULTS);
-
-  fz_rect r;
-  for (int i = 0; i < num_results; i++) {
-    zathura_rectangle_t* rectangle = g_malloc0(sizeof(zathura_rectangle_t));
-
-    r             = fz_rect_from_quad(hit_bbox[i]);
-    rectangle->x1 = r.x0;
-    rectangle->x2 = r.x1;
-    rectangle->y1 = r.y0;
-    rectangle->y2 = r.y1;
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_BACKGROUND);
+  const int hits = search_page(mupdf_document, mupdf_page, text, list);
+  mupdf_document_unlock(mupdf_document);
 
-    girara_list_append(list, rectangle);
+  if (hits < 0) {
+    goto error_free;
   }
 
-  fz_free(mupdf_page->ctx, hit_bbox);
-  g_mutex_unlock(&mupdf_document->mutex);
-
   return list;
 
 error_free:
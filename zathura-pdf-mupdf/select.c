@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: Zlib */
 
-#define MAX_QUADS 1000
+/* Initial number of quads of a selection; it grows as needed */
+#define MUPDF_SELECTION_QUADS 64
 
 #include "plugin.h"
 #include "utils.h"
@@ -8,7 +9,7 @@
 char* pdf_page_get_text(zathura_page_t* page, void* data, zathura_rectangle_t rectangle, zathura_error_t* error) {
   mupdf_page_t* mupdf_page = data;
 
-  if (page == NULL || mupdf_page == NULL || mupdf_page->text == NULL) {
+  if (page == NULL || mupdf_page == NULL || mupdf_page->content == NULL) {
     if (error != NULL) {
       *error = ZATHURA_ERROR_INVALID_ARGUMENTS;
     }
@@ -17,9 +18,9 @@ char* pdf_page_get_text(zathura_page_t* page, void* data, zathura_rectangle_t re
 
   zathura_document_t* document     = zathura_page_get_document(page);
   mupdf_document_t* mupdf_document = zathura_document_get_data(document);
-  g_mutex_lock(&mupdf_document->mutex);
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_INTERACTIVE);
 
-  if (mupdf_page->extracted_text == false) {
+  if (mupdf_page->content->extracted_text == false) {
     mupdf_page_extract_text(mupdf_document, mupdf_page);
   }
 
@@ -28,11 +29,11 @@ char* pdf_page_get_text(zathura_page_t* page, void* data, zathura_rectangle_t re
 
   char* ret = NULL;
 #ifdef _WIN32
-  ret = fz_copy_selection(mupdf_page->ctx, mupdf_page->text, a, b, 1);
+  ret = fz_copy_selection(mupdf_page->ctx, mupdf_page->content->text, a, b, 1);
 #else
-  ret = fz_copy_selection(mupdf_page->ctx, mupdf_page->text, a, b, 0);
+  ret = fz_copy_selection(mupdf_page->ctx, mupdf_page->content->text, a, b, 0);
 #endif
-  g_mutex_unlock(&mupdf_document->mutex);
+  mupdf_document_unlock(mupdf_document);
   return ret;
 
 error_ret:
@@ -49,7 +50,7 @@ girara_list_t* pdf_page_get_selection(zathura_page_t* page, void* data, zathura_
 
   mupdf_page_t* mupdf_page = data;
 
-  if (page == NULL || mupdf_page == NULL || mupdf_page->text == NULL) {
+  if (page == NULL || mupdf_page == NULL || mupdf_page->content == NULL) {
     if (error != NULL) {
       *error = ZATHURA_ERROR_INVALID_ARGUMENTS;
     }
@@ -58,9 +59,9 @@ girara_list_t* pdf_page_get_selection(zathura_page_t* page, void* data, zathura_
 
   zathura_document_t* document     = zathura_page_get_document(page);
   mupdf_document_t* mupdf_document = zathura_document_get_data(document);
-  g_mutex_lock(&mupdf_document->mutex);
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_INTERACTIVE);
 
-  if (mupdf_page->extracted_text == false) {
+  if (mupdf_page->content->extracted_text == false) {
     mupdf_page_extract_text(mupdf_document, mupdf_page);
   }
 
@@ -75,29 +76,26 @@ girara_list_t* pdf_page_get_selection(zathura_page_t* page, void* data, zathura_
     goto error_free;
   }
 
-  fz_quad* hits   = fz_malloc_array(mupdf_page->ctx, MAX_QUADS, fz_quad);
-  int num_results = fz_highlight_selection(mupdf_page->ctx, mupdf_page->text, a, b, hits, MAX_QUADS);
-
-  fz_rect r;
-  for (int i = 0; i < num_results; i++) {
-    zathura_rectangle_t* inner_rectangle = g_malloc0(sizeof(zathura_rectangle_t));
-
-    r                   = fz_rect_from_quad(hits[i]);
-    inner_rectangle->x1 = r.x0;
-    inner_rectangle->x2 = r.x1;
-    inner_rectangle->y1 = r.y0;
-    inner_rectangle->y2 = r.y1;
-
-    girara_list_append(list, inner_rectangle);
+  /* a full array may have cut the selection short, so it is highlighted
+   * again with twice the room */
+  int max_quads   = MUPDF_SELECTION_QUADS;
+  fz_quad* hits   = g_new(fz_quad, max_quads);
+  int num_results = fz_highlight_selection(mupdf_page->ctx, mupdf_page->content->text, a, b, hits, max_quads);
+  while (num_results == max_quads) {
+    max_quads *= 2;
+    hits        = g_renew(fz_quad, hits, max_quads);
+    num_results = fz_highlight_selection(mupdf_page->ctx, mupdf_page->content->text, a, b, hits, max_quads);
   }
 
-  fz_free(mupdf_page->ctx, hits);
-  g_mutex_unlock(&mupdf_document->mutex);
+  mupdf_append_quads(list, hits, num_results);
+
+  g_free(hits);
+  mupdf_document_unlock(mupdf_document);
 
   return list;
 
 error_free:
-  g_mutex_unlock(&mupdf_document->mutex);
+  mupdf_document_unlock(mupdf_document);
 
   if (list != NULL) {
     girara_list_free(list);
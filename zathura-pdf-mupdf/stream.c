@@ -0,0 +1,382 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "utils.h"
+
+/* Files smaller than this are read through a regular file stream. Mapping
+ * only pays off for large documents, and a mapped file that is truncated by
+ * another process (e.g. a LaTeX run rewriting its output) raises SIGBUS on
+ * the next access, which is far more likely for small, frequently rebuilt
+ * files. */
+#define MUPDF_MMAP_THRESHOLD (32 * 1024 * 1024)
+/* Time in seconds after which a file that is shorter than announced but has
+ * not been modified is considered to have stopped growing, e.g. because its
+ * download failed or it was truncated */
+#define MUPDF_PROGRESSIVE_STALL_TIMEOUT 30
+
+typedef struct mupdf_mapped_file_s {
+  unsigned char* data; /**< Start of the mapping */
+  size_t length;       /**< Length of the mapping */
+} mupdf_mapped_file_t;
+
+static int mapped_file_next(fz_context* GIRARA_UNUSED(ctx), fz_stream* GIRARA_UNUSED(stream),
+                            size_t GIRARA_UNUSED(max)) {
+  /* rp and wp always span the whole mapping, so there is never more data */
+  return EOF;
+}
+
+static void mapped_file_seek(fz_context* GIRARA_UNUSED(ctx), fz_stream* stream, int64_t offset, int whence) {
+  mupdf_mapped_file_t* mapped = stream->state;
+  int64_t length              = mapped->length;
+
+  if (whence == SEEK_CUR) {
+    offset += stream->rp - mapped->data;
+  } else if (whence == SEEK_END) {
+    offset += length;
+  }
+
+  if (offset < 0) {
+    offset = 0;
+  } else if (offset > length) {
+    offset = length;
+  }
+
+  stream->rp = mapped->data + offset;
+}
+
+static void mapped_file_drop(fz_context* ctx, void* state) {
+  mupdf_mapped_file_t* mapped = state;
+
+  munmap(mapped->data, mapped->length);
+  fz_free(ctx, mapped);
+}
+
+/* Returns whether the file has been modified recently enough to still be
+ * growing */
+static bool file_is_growing(const struct stat* st) {
+  return g_get_real_time() / G_USEC_PER_SEC - st->st_mtim.tv_sec < MUPDF_PROGRESSIVE_STALL_TIMEOUT;
+}
+
+typedef struct mupdf_progressive_file_s {
+  int fd;                      /**< File descriptor */
+  int64_t length;              /**< Final length of the file */
+  int64_t available;           /**< Number of bytes known to be on disk */
+  unsigned char buffer[65536]; /**< Read buffer */
+} mupdf_progressive_file_t;
+
+static int progressive_file_next(fz_context* ctx, fz_stream* stream, size_t GIRARA_UNUSED(max)) {
+  mupdf_progressive_file_t* progressive = stream->state;
+
+  if (stream->pos >= progressive->length) {
+    return EOF;
+  }
+
+  if (stream->pos >= progressive->available) {
+    struct stat st;
+    const bool known = fstat(progressive->fd, &st) == 0;
+    if (known == true) {
+      progressive->available = st.st_size < progressive->length ? st.st_size : progressive->length;
+    }
+    /* data that will not arrive anymore is missing like in a damaged file */
+    if (stream->pos >= progressive->available && known == true && file_is_growing(&st) == false) {
+      fz_throw(ctx, FZ_ERROR_FORMAT, "file stopped growing before offset %" PRId64, stream->pos);
+    }
+    if (stream->pos >= progressive->available) {
+      fz_throw(ctx, FZ_ERROR_TRYLATER, "data at offset %" PRId64 " not yet available", stream->pos);
+    }
+  }
+
+  size_t n = progressive->available - stream->pos;
+  if (n > sizeof(progressive->buffer)) {
+    n = sizeof(progressive->buffer);
+  }
+
+  ssize_t r = pread(progressive->fd, progressive->buffer, n, stream->pos);
+  if (r <= 0) {
+    fz_throw(ctx, FZ_ERROR_SYSTEM, "pread failed: %s", strerror(errno));
+  }
+
+  stream->rp = progressive->buffer;
+  stream->wp = progressive->buffer + r;
+  stream->pos += r;
+
+  return *stream->rp++;
+}
+
+static void progressive_file_seek(fz_context* GIRARA_UNUSED(ctx), fz_stream* stream, int64_t offset, int whence) {
+  mupdf_progressive_file_t* progressive = stream->state;
+
+  if (whence == SEEK_CUR) {
+    offset += stream->pos - (stream->wp - stream->rp);
+  } else if (whence == SEEK_END) {
+    offset += progressive->length;
+  }
+
+  if (offset < 0) {
+    offset = 0;
+  } else if (offset > progressive->length) {
+    offset = progressive->length;
+  }
+
+  stream->pos = offset;
+  stream->rp  = progressive->buffer;
+  stream->wp  = progressive->buffer;
+}
+
+static void progressive_file_drop(fz_context* ctx, void* state) {
+  mupdf_progressive_file_t* progressive = state;
+
+  close(progressive->fd);
+  fz_free(ctx, progressive);
+}
+
+/* Returns the file length announced in the linearization dictionary of a
+ * PDF, or -1 if the file does not start with one. */
+static int64_t mupdf_linearized_length(int fd) {
+  char header[1024];
+  ssize_t n = pread(fd, header, sizeof(header) - 1, 0);
+  if (n <= 0) {
+    return -1;
+  }
+  header[n] = '\0';
+
+  if (strncmp(header, "%PDF-", 5) != 0) {
+    return -1;
+  }
+
+  const char* linearized = strstr(header, "/Linearized");
+  if (linearized == NULL) {
+    return -1;
+  }
+
+  /* the dictionary ends before the first stream or endobj */
+  const char* end = strstr(linearized, "endobj");
+  for (const char* p = strstr(linearized, "/L"); p != NULL && (end == NULL || p < end); p = strstr(p + 2, "/L")) {
+    if (p[2] == ' ' || p[2] == '\t' || p[2] == '\r' || p[2] == '\n') {
+      return g_ascii_strtoll(p + 2, NULL, 10);
+    }
+  }
+
+  return -1;
+}
+
+static fz_stream* mupdf_open_progressive_file(fz_context* ctx, int fd, int64_t length, int64_t available) {
+  mupdf_progressive_file_t* progressive = NULL;
+  fz_stream* stream                     = NULL;
+
+  fz_try(ctx) {
+    progressive            = fz_malloc_struct(ctx, mupdf_progressive_file_t);
+    progressive->fd        = fd;
+    progressive->length    = length;
+    progressive->available = available;
+
+    stream              = fz_new_stream(ctx, progressive, progressive_file_next, progressive_file_drop);
+    stream->seek        = progressive_file_seek;
+    stream->progressive = 1;
+  }
+  fz_catch(ctx) {
+    /* fz_new_stream drops the state (and closes the file) itself if it fails */
+    if (progressive == NULL) {
+      close(fd);
+    }
+    return NULL;
+  }
+
+  return stream;
+}
+
+static fz_stream* mupdf_open_mapped_file(fz_context* ctx, int fd, size_t length) {
+  void* data = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+
+  mupdf_mapped_file_t* mapped = NULL;
+  fz_stream* stream           = NULL;
+
+  fz_try(ctx) {
+    mapped         = fz_malloc_struct(ctx, mupdf_mapped_file_t);
+    mapped->data   = data;
+    mapped->length = length;
+
+    stream       = fz_new_stream(ctx, mapped, mapped_file_next, mapped_file_drop);
+    stream->seek = mapped_file_seek;
+    stream->rp   = mapped->data;
+    stream->wp   = mapped->data + length;
+    stream->pos  = length;
+  }
+  fz_catch(ctx) {
+    /* fz_new_stream drops the state itself if it fails */
+    if (mapped == NULL) {
+      munmap(data, length);
+    }
+    return NULL;
+  }
+
+  return stream;
+}
+
+fz_stream* mupdf_open_file_stream(fz_context* ctx, const char* path, bool progressive) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return fz_open_file(ctx, path);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || S_ISREG(st.st_mode) == 0) {
+    close(fd);
+    return fz_open_file(ctx, path);
+  }
+
+  /* A linearized PDF that is shorter than announced and still growing is
+   * being written or downloaded. Open it progressively, so pages can be shown
+   * as soon as their objects have arrived. Files that stopped growing are
+   * opened like any other damaged file, so mupdf repairs them. */
+  const int64_t length = progressive == true ? mupdf_linearized_length(fd) : -1;
+  if (length > st.st_size && file_is_growing(&st) == true) {
+    fz_stream* stream = mupdf_open_progressive_file(ctx, fd, length, st.st_size);
+    if (stream != NULL) {
+      return stream;
+    }
+    return fz_open_file(ctx, path);
+  }
+
+  fz_stream* stream = NULL;
+  if (st.st_size >= MUPDF_MMAP_THRESHOLD && (uint64_t)st.st_size <= SIZE_MAX) {
+    stream = mupdf_open_mapped_file(ctx, fd, st.st_size);
+  }
+  close(fd);
+
+  if (stream == NULL) {
+    return fz_open_file(ctx, path);
+  }
+
+  return stream;
+}
+
+void mupdf_stream_advise(fz_stream* stream, bool sequential) {
+  if (stream == NULL || stream->next != mapped_file_next) {
+    return;
+  }
+
+  mupdf_mapped_file_t* mapped = stream->state;
+  madvise(mapped->data, mapped->length, sequential == true ? MADV_SEQUENTIAL : MADV_RANDOM);
+}
+
+void mupdf_file_prefetch(const char* path, const mupdf_file_range_t* ranges, unsigned int n_ranges) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || S_ISREG(st.st_mode) == 0) {
+    close(fd);
+    return;
+  }
+
+  /* the page cache belongs to the file, so the hints help every stream that
+   * reads it, memory-mapped or not */
+  for (unsigned int i = 0; i < n_ranges; i++) {
+    const int64_t offset = ranges[i].offset < 0 ? MAX(st.st_size + ranges[i].offset, 0) : ranges[i].offset;
+    if (offset < st.st_size) {
+      posix_fadvise(fd, offset, MIN(ranges[i].length, st.st_size - offset), POSIX_FADV_WILLNEED);
+    }
+  }
+
+  close(fd);
+}
+
+typedef struct mupdf_appended_stream_s {
+  fz_stream* base;     /**< Underlying stream */
+  int64_t base_length; /**< Length of the underlying stream */
+  fz_buffer* tail;     /**< Data following the underlying stream */
+} mupdf_appended_stream_t;
+
+static int appended_stream_next(fz_context* ctx, fz_stream* stream, size_t max) {
+  mupdf_appended_stream_t* appended = stream->state;
+
+  if (stream->pos < appended->base_length) {
+    /* pass the buffer of the underlying stream on without copying it */
+    if (fz_tell(ctx, appended->base) != stream->pos) {
+      fz_seek(ctx, appended->base, stream->pos, SEEK_SET);
+    }
+
+    size_t n = fz_available(ctx, appended->base, max);
+    if (n == 0) {
+      return EOF;
+    }
+    if ((int64_t)n > appended->base_length - stream->pos) {
+      n = appended->base_length - stream->pos;
+    }
+
+    stream->rp = appended->base->rp;
+    stream->wp = appended->base->rp + n;
+    appended->base->rp += n;
+  } else {
+    const int64_t offset = stream->pos - appended->base_length;
+    if (offset >= (int64_t)appended->tail->len) {
+      return EOF;
+    }
+
+    stream->rp = appended->tail->data + offset;
+    stream->wp = appended->tail->data + appended->tail->len;
+  }
+
+  stream->pos += stream->wp - stream->rp;
+
+  return *stream->rp++;
+}
+
+static void appended_stream_seek(fz_context* GIRARA_UNUSED(ctx), fz_stream* stream, int64_t offset, int whence) {
+  mupdf_appended_stream_t* appended = stream->state;
+  const int64_t length              = appended->base_length + appended->tail->len;
+
+  if (whence == SEEK_CUR) {
+    offset += stream->pos - (stream->wp - stream->rp);
+  } else if (whence == SEEK_END) {
+    offset += length;
+  }
+
+  if (offset < 0) {
+    offset = 0;
+  } else if (offset > length) {
+    offset = length;
+  }
+
+  stream->pos = offset;
+  stream->rp  = NULL;
+  stream->wp  = NULL;
+}
+
+static void appended_stream_drop(fz_context* ctx, void* state) {
+  mupdf_appended_stream_t* appended = state;
+
+  fz_drop_stream(ctx, appended->base);
+  fz_drop_buffer(ctx, appended->tail);
+  fz_free(ctx, appended);
+}
+
+fz_stream* mupdf_open_appended_stream(fz_context* ctx, fz_stream* base, fz_buffer* tail) {
+  fz_seek(ctx, base, 0, SEEK_END);
+  const int64_t base_length = fz_tell(ctx, base);
+  fz_seek(ctx, base, 0, SEEK_SET);
+
+  mupdf_appended_stream_t* appended = fz_malloc_struct(ctx, mupdf_appended_stream_t);
+  appended->base                    = fz_keep_stream(ctx, base);
+  appended->base_length             = base_length;
+  appended->tail                    = fz_keep_buffer(ctx, tail);
+
+  /* fz_new_stream drops the state itself if it fails */
+  fz_stream* stream = fz_new_stream(ctx, appended, appended_stream_next, appended_stream_drop);
+  stream->seek      = appended_stream_seek;
+
+  return stream;
+}
@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include <glib.h>
+#include <mupdf/pdf.h>
+#include <girara/utils.h>
+
+#include "utils.h"
+
+/* Tolerated difference between the aspect ratios of embedded thumbnails and
+ * their pages */
+#define MUPDF_THUMBNAIL_ASPECT_TOLERANCE 0.05f
+
+/* Loads the thumbnail image embedded in a PDF page. Thumbnails are only used
+ * for pages without rotation and if their aspect ratio matches the page. */
+static fz_image* load_embedded_thumbnail(fz_context* ctx, fz_page* page, fz_irect area) {
+  pdf_page* pdf_page = pdf_page_from_fz_page(ctx, page);
+  if (pdf_page == NULL) {
+    return NULL;
+  }
+
+  pdf_obj* thumb = pdf_dict_get(ctx, pdf_page->obj, PDF_NAME(Thumb));
+  if (pdf_is_stream(ctx, thumb) == 0 ||
+      pdf_to_int(ctx, pdf_dict_get_inheritable(ctx, pdf_page->obj, PDF_NAME(Rotate))) % 360 != 0) {
+    return NULL;
+  }
+
+  fz_image* image = pdf_load_image(ctx, pdf_page->doc, thumb);
+
+  const float page_aspect  = (float)(area.x1 - area.x0) / fz_maxi(area.y1 - area.y0, 1);
+  const float image_aspect = (float)image->w / fz_maxi(image->h, 1);
+  if (fz_abs(image_aspect - page_aspect) > page_aspect * MUPDF_THUMBNAIL_ASPECT_TOLERANCE) {
+    fz_drop_image(ctx, image);
+    return NULL;
+  }
+
+  return image;
+}
+
+/* Returns the embedded thumbnail scaled to area, or NULL if the page has no
+ * thumbnail that is at least as large as area */
+static fz_pixmap* embedded_thumbnail(fz_context* ctx, fz_page* page, fz_irect area) {
+  fz_image* volatile image   = NULL;
+  fz_pixmap* volatile pixmap = NULL;
+  fz_pixmap* volatile scaled = NULL;
+
+  const int width  = area.x1 - area.x0;
+  const int height = area.y1 - area.y0;
+
+  /* broken thumbnails are ignored, the page is rendered instead */
+  fz_try(ctx) {
+    image = load_embedded_thumbnail(ctx, page, area);
+    if (image != NULL && image->w >= width && image->h >= height) {
+      pixmap = fz_get_pixmap_from_image(ctx, image, NULL, NULL, NULL, NULL);
+      if (pixmap->alpha != 0 || fz_colorspace_is_rgb(ctx, pixmap->colorspace) == 0) {
+        scaled = fz_convert_pixmap(ctx, pixmap, fz_device_rgb(ctx), NULL, NULL, fz_default_color_params, 0);
+        fz_drop_pixmap(ctx, pixmap);
+        pixmap = scaled;
+        scaled = NULL;
+      }
+
+      if (pixmap->w != width || pixmap->h != height) {
+        scaled = fz_scale_pixmap(ctx, pixmap, area.x0, area.y0, width, height, NULL);
+        fz_drop_pixmap(ctx, pixmap);
+        pixmap = scaled;
+        scaled = NULL;
+      }
+    }
+  }
+  fz_always(ctx) {
+    fz_drop_image(ctx, image);
+  }
+  fz_catch(ctx) {
+    girara_debug("ignoring embedded thumbnail: %s", fz_caught_message(ctx));
+    fz_drop_pixmap(ctx, scaled);
+    fz_drop_pixmap(ctx, pixmap);
+    return NULL;
+  }
+
+  if (pixmap != NULL) {
+    fz_set_pixmap_resolution(ctx, pixmap, 72, 72);
+    pixmap->x = area.x0;
+    pixmap->y = area.y0;
+  }
+
+  return pixmap;
+}
+
+fz_pixmap* mupdf_page_thumbnail(fz_context* ctx, fz_page* page, int size) {
+  const fz_rect bounds = fz_bound_page(ctx, page);
+  const float scale    = size / fz_max(fz_max(bounds.x1 - bounds.x0, bounds.y1 - bounds.y0), 1);
+  const fz_matrix ctm  = fz_scale(scale, scale);
+  const fz_irect area  = fz_round_rect(fz_transform_rect(bounds, ctm));
+
+  fz_pixmap* pixmap = embedded_thumbnail(ctx, page, area);
+  if (pixmap != NULL) {
+    return pixmap;
+  }
+
+  /* without a thumbnail the page is drawn at the size of the thumbnail */
+  return fz_new_pixmap_from_page(ctx, page, ctm, fz_device_rgb(ctx), 0);
+}
@@ -1,26 +1,298 @@
 /* SPDX-License-Identifier: Zlib */
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <girara/utils.h>
+#include <mupdf/pdf.h>
+
 #include "utils.h"
 
-void mupdf_page_extract_text(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page) {
-  if (mupdf_document == NULL || mupdf_document->ctx == NULL || mupdf_page == NULL || mupdf_page->text == NULL) {
+#define LENGTH(x) (sizeof(x) / sizeof((x)[0]))
+
+/* Number of bytes at the start and the end of a file that are part of its
+ * fingerprint */
+#define MUPDF_FINGERPRINT_SAMPLE (64 * 1024)
+
+typedef struct mupdf_cache_file_s {
+  char* path;
+  off_t size;
+  struct timespec mtime;
+} mupdf_cache_file_t;
+
+static void fingerprint_sample(GChecksum* checksum, int fd, off_t offset, size_t length) {
+  unsigned char buffer[4096];
+
+  while (length > 0) {
+    const ssize_t n = pread(fd, buffer, MIN(length, sizeof(buffer)), offset);
+    if (n <= 0) {
+      break;
+    }
+
+    g_checksum_update(checksum, buffer, n);
+    offset += n;
+    length -= n;
+  }
+}
+
+char* mupdf_file_fingerprint(const char* path) {
+  if (path == NULL) {
+    return NULL;
+  }
+
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  GChecksum* checksum = g_checksum_new(G_CHECKSUM_SHA256);
+
+  const gint64 header[] = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+  g_checksum_update(checksum, (const guchar*)header, sizeof(header));
+
+  fingerprint_sample(checksum, fd, 0, MIN(st.st_size, MUPDF_FINGERPRINT_SAMPLE));
+  if (st.st_size > MUPDF_FINGERPRINT_SAMPLE) {
+    const off_t tail = MAX(st.st_size - MUPDF_FINGERPRINT_SAMPLE, MUPDF_FINGERPRINT_SAMPLE);
+    fingerprint_sample(checksum, fd, tail, st.st_size - tail);
+  }
+  close(fd);
+
+  char* fingerprint = g_strdup(g_checksum_get_string(checksum));
+  g_checksum_free(checksum);
+
+  return fingerprint;
+}
+
+char* mupdf_cache_dir(const char* subdir) {
+  if (subdir == NULL) {
+    return NULL;
+  }
+
+  char* cache_dir = girara_get_xdg_path(XDG_CACHE);
+  if (cache_dir == NULL) {
+    return NULL;
+  }
+
+  char* dir = g_build_filename(cache_dir, "zathura-pdf-mupdf", subdir, NULL);
+  g_free(cache_dir);
+
+  if (g_mkdir_with_parents(dir, 0700) != 0) {
+    girara_debug("failed to create cache directory %s", dir);
+    g_free(dir);
+    return NULL;
+  }
+
+  return dir;
+}
+
+char* mupdf_cache_path(const char* subdir, const char* name) {
+  if (name == NULL) {
+    return NULL;
+  }
+
+  char* dir = mupdf_cache_dir(subdir);
+  if (dir == NULL) {
+    return NULL;
+  }
+
+  char* path = g_build_filename(dir, name, NULL);
+  g_free(dir);
+
+  return path;
+}
+
+static gint cache_file_compare(gconstpointer a, gconstpointer b) {
+  const mupdf_cache_file_t* file_a = a;
+  const mupdf_cache_file_t* file_b = b;
+
+  if (file_a->mtime.tv_sec != file_b->mtime.tv_sec) {
+    return file_a->mtime.tv_sec < file_b->mtime.tv_sec ? -1 : 1;
+  }
+  return file_a->mtime.tv_nsec < file_b->mtime.tv_nsec ? -1 : file_a->mtime.tv_nsec > file_b->mtime.tv_nsec;
+}
+
+static void cache_file_clear(void* data) {
+  mupdf_cache_file_t* file = data;
+  g_free(file->path);
+}
+
+void mupdf_cache_trim(const char* subdir, uint64_t limit) {
+  char* dir = mupdf_cache_dir(subdir);
+  if (dir == NULL) {
     return;
   }
 
-  fz_device* volatile text_device = NULL;
+  GDir* handle = g_dir_open(dir, 0, NULL);
+  if (handle == NULL) {
+    g_free(dir);
+    return;
+  }
+
+  GArray* files = g_array_new(FALSE, FALSE, sizeof(mupdf_cache_file_t));
+  g_array_set_clear_func(files, cache_file_clear);
+
+  uint64_t size = 0;
+  for (const char* name = g_dir_read_name(handle); name != NULL; name = g_dir_read_name(handle)) {
+    mupdf_cache_file_t file = {.path = g_build_filename(dir, name, NULL)};
+
+    struct stat st;
+    if (g_stat(file.path, &st) != 0 || S_ISREG(st.st_mode) == 0) {
+      g_free(file.path);
+      continue;
+    }
+
+    file.size  = st.st_size;
+    file.mtime = st.st_mtim;
+    size += st.st_size;
+    g_array_append_val(files, file);
+  }
+  g_dir_close(handle);
+  g_free(dir);
+
+  if (size > limit) {
+    g_array_sort(files, cache_file_compare);
+
+    for (unsigned int i = 0; i < files->len && size > limit / 4 * 3; i++) {
+      const mupdf_cache_file_t* file = &g_array_index(files, mupdf_cache_file_t, i);
+      if (g_unlink(file->path) == 0) {
+        size -= file->size;
+      }
+    }
+  }
+
+  g_array_free(files, TRUE);
+}
+
+static bool parse_color(const char* text, int* color) {
+  if (text[0] == '#') {
+    text++;
+  }
+
+  if (strlen(text) != 6) {
+    return false;
+  }
+
+  int value = 0;
+  for (const char* c = text; *c != '\0'; c++) {
+    const int digit = g_ascii_xdigit_value(*c);
+    if (digit < 0) {
+      return false;
+    }
+    value = value * 16 + digit;
+  }
+
+  *color = value;
+  return true;
+}
+
+bool mupdf_recolor_parse(const char* spec, mupdf_recolor_t* recolor) {
+  if (spec == NULL) {
+    return false;
+  }
+
+  if (g_strcmp0(spec, "invert") == 0) {
+    *recolor = (mupdf_recolor_t){.enabled = true, .dark_color = 0xFFFFFF, .light_color = 0x000000};
+    return true;
+  }
+
+  char** colors          = g_strsplit(spec, ":", -1);
+  mupdf_recolor_t parsed = {.enabled = true};
+  bool valid             = false;
+  if (g_strv_length(colors) == 2) {
+    valid = parse_color(colors[0], &parsed.dark_color) == true && parse_color(colors[1], &parsed.light_color) == true;
+  }
+  g_strfreev(colors);
+
+  if (valid == true) {
+    *recolor = parsed;
+  }
+  return valid;
+}
+
+/* Tells whether b continues a on the same line: the rectangles overlap by at
+ * least half of the smaller height and b starts at most a quarter of the
+ * line height after a ends */
+static bool quads_continue_line(fz_rect a, fz_rect b) {
+  const float height  = fz_min(a.y1 - a.y0, b.y1 - b.y0);
+  const float overlap = fz_min(a.y1, b.y1) - fz_max(a.y0, b.y0);
+
+  return height > 0 && overlap >= height / 2 && b.x0 >= a.x0 && b.x0 <= a.x1 + height / 4;
+}
+
+static void append_rectangle(girara_list_t* list, fz_rect rect) {
+  zathura_rectangle_t* rectangle = g_malloc0(sizeof(zathura_rectangle_t));
+  rectangle->x1                  = rect.x0;
+  rectangle->x2                  = rect.x1;
+  rectangle->y1                  = rect.y0;
+  rectangle->y2                  = rect.y1;
+  girara_list_append(list, rectangle);
+}
 
-  fz_try(mupdf_page->ctx) {
-    fz_stext_options stext_options;
-    stext_options.flags = FZ_STEXT_PRESERVE_IMAGES;
-    text_device         = fz_new_stext_device(mupdf_page->ctx, mupdf_page->text, &stext_options);
+void mupdf_append_quads(girara_list_t* list, const fz_quad* quads, int n_quads) {
+  if (n_quads <= 0) {
+    return;
+  }
+
+  fz_rect line = fz_rect_from_quad(quads[0]);
+  for (int i = 1; i < n_quads; i++) {
+    const fz_rect rect = fz_rect_from_quad(quads[i]);
+    if (quads_continue_line(line, rect) == true) {
+      line = fz_union_rect(line, rect);
+    } else {
+      append_rectangle(list, line);
+      line = rect;
+    }
+  }
+  append_rectangle(list, line);
+}
 
-    fz_run_page(mupdf_page->ctx, mupdf_page->page, text_device, fz_identity, NULL);
+bool mupdf_document_information(fz_context* ctx, fz_document* document, mupdf_information_callback_t callback,
+                                void* data) {
+  pdf_document* pdf_document = pdf_specifics(ctx, document);
+  if (pdf_document == NULL) {
+    return false;
   }
-  fz_always(mupdf_document->ctx) {
-    fz_close_device(mupdf_page->ctx, text_device);
-    fz_drop_device(mupdf_page->ctx, text_device);
+
+  pdf_obj* trailer   = pdf_trailer(ctx, pdf_document);
+  pdf_obj* info_dict = pdf_dict_get(ctx, trailer, PDF_NAME(Info));
+
+  typedef struct info_value_s {
+    const char* property;
+    zathura_document_information_type_t type;
+  } info_value_t;
+
+  static const info_value_t values[] = {
+      {"Title", ZATHURA_DOCUMENT_INFORMATION_TITLE},
+      {"Author", ZATHURA_DOCUMENT_INFORMATION_AUTHOR},
+      {"Subject", ZATHURA_DOCUMENT_INFORMATION_SUBJECT},
+      {"Keywords", ZATHURA_DOCUMENT_INFORMATION_KEYWORDS},
+      {"Creator", ZATHURA_DOCUMENT_INFORMATION_CREATOR},
+      {"Producer", ZATHURA_DOCUMENT_INFORMATION_PRODUCER},
+      {"CreationDate", ZATHURA_DOCUMENT_INFORMATION_CREATION_DATE}, // FIXME: Convert to common format
+      {"ModDate", ZATHURA_DOCUMENT_INFORMATION_MODIFICATION_DATE},  // FIXME: Convert to common format
+  };
+
+  for (unsigned int i = 0; i < LENGTH(values); i++) {
+    pdf_obj* value = pdf_dict_gets(ctx, info_dict, values[i].property);
+    if (value == NULL) {
+      continue;
+    }
+
+    const char* str_value = pdf_to_text_string(ctx, value);
+    if (str_value == NULL || strlen(str_value) == 0) {
+      continue;
+    }
+
+    callback(values[i].type, str_value, data);
   }
-  fz_catch(mupdf_document->ctx) {}
 
-  mupdf_page->extracted_text = true;
+  return true;
 }
@@ -5,6 +5,815 @@
 
 #include "plugin.h"
 
+/**
+ * Creates a new mupdf context for a document
+ *
+ * The returned context is a clone of a process-wide base context. All clones
+ * share the resource store, glyph cache, fonts and the user css, which is read
+ * from zathura/epub.css when the base context is created. Each clone has its
+ * own exception stack and must only be used by one thread at a time.
+ *
+ * @return A new context (free with fz_drop_context) or NULL if an error
+ *   occurred
+ */
+fz_context* mupdf_context_new(void);
+
+/**
+ * Initializes a document lock
+ *
+ * @param lock The lock
+ */
+void mupdf_lock_init(mupdf_lock_t* lock);
+
+/**
+ * Frees the resources of a document lock
+ *
+ * @param lock The lock, which must not be held
+ */
+void mupdf_lock_clear(mupdf_lock_t* lock);
+
+/**
+ * Acquires the lock of a document
+ *
+ * Waiting requests are served by priority and in order of arrival within a
+ * priority class.
+ *
+ * @param mupdf_document The document
+ * @param priority Class of the request
+ */
+void mupdf_document_lock(mupdf_document_t* mupdf_document, mupdf_priority_t priority);
+
+/**
+ * Acquires the lock of a document unless the request is superseded
+ *
+ * The request is given up as soon as generation no longer equals request
+ * while it waits, i.e. once a newer request for the same work has been made.
+ *
+ * @param mupdf_document The document
+ * @param priority Class of the request
+ * @param generation Counter that is incremented by every request for the work
+ * @param request Value of generation when this request was made
+ * @return true if the lock has been acquired, false if the request has been
+ *   superseded
+ */
+bool mupdf_document_lock_request(mupdf_document_t* mupdf_document, mupdf_priority_t priority,
+                                 const gint* generation, gint request);
+
+/**
+ * Releases the lock of a document
+ *
+ * @param mupdf_document The document
+ */
+void mupdf_document_unlock(mupdf_document_t* mupdf_document);
+
+/**
+ * Returns the statistics of the lock of a document
+ *
+ * @param mupdf_document The document
+ * @param stats Statistics of every priority class
+ * @param max_depth Set to the largest number of requests that waited at once
+ */
+void mupdf_document_lock_stats(mupdf_document_t* mupdf_document, mupdf_lock_stats_t stats[MUPDF_PRIORITY_COUNT],
+                               unsigned int* max_depth);
+
+/**
+ * Opens a file as a stream
+ *
+ * Large regular files are memory-mapped, so objects and streams are read
+ * straight from the page cache without intermediate copies. Other files are
+ * opened as regular buffered file streams.
+ *
+ * Linearized PDFs that are still being written are opened as progressive
+ * streams if progressive is true. Reading data that has not arrived throws
+ * FZ_ERROR_TRYLATER, until the file has not grown for a while; then it
+ * throws FZ_ERROR_FORMAT like a damaged file.
+ *
+ * @param ctx The context
+ * @param path Path to the file
+ * @param progressive If the file may be opened progressively
+ * @return The stream; throws on error
+ */
+fz_stream* mupdf_open_file_stream(fz_context* ctx, const char* path, bool progressive);
+
+/**
+ * Tells the kernel about the expected access pattern of a stream
+ *
+ * Only has an effect on memory-mapped streams.
+ *
+ * @param stream The stream
+ * @param sequential true if the stream is about to be read sequentially,
+ *   false for random access
+ */
+void mupdf_stream_advise(fz_stream* stream, bool sequential);
+
+/**
+ * Range of a file
+ */
+typedef struct mupdf_file_range_s {
+  int64_t offset; /**< Start of the range; negative offsets count from the end of the file */
+  int64_t length; /**< Length of the range in bytes */
+} mupdf_file_range_t;
+
+/**
+ * Asks the kernel to read ranges of a file into the page cache in the
+ * background
+ *
+ * @param path Path to the file
+ * @param ranges The ranges
+ * @param n_ranges Number of ranges
+ */
+void mupdf_file_prefetch(const char* path, const mupdf_file_range_t* ranges, unsigned int n_ranges);
+
+/**
+ * Reads the parts of a file that are needed to open a document, i.e. the
+ * cross-reference table of PDFs, ahead
+ *
+ * @param path Path to the file
+ */
+void mupdf_document_prefetch_file(const char* path);
+
+/**
+ * Reads the object streams of a PDF ahead and starts a thread that loads the
+ * page tree and the resources of the first pages with background priority.
+ * The thread then analyzes all pages for the document information.
+ *
+ * @param mupdf_document The document, which is not locked yet
+ * @param path Path to the file
+ */
+void mupdf_document_warm_start(mupdf_document_t* mupdf_document, const char* path);
+
+/**
+ * Stops warming a document and waits for the thread
+ *
+ * @param mupdf_document The document, which must not be locked
+ */
+void mupdf_document_warm_stop(mupdf_document_t* mupdf_document);
+
+/**
+ * Opens a stream that reads the data of another stream followed by a buffer
+ *
+ * Used to append a cached cross-reference section to a damaged PDF without
+ * modifying the file.
+ *
+ * @param ctx The mupdf context
+ * @param base The underlying stream; it has to support seeking
+ * @param tail The data following the underlying stream
+ * @return The stream; throws on error
+ */
+fz_stream* mupdf_open_appended_stream(fz_context* ctx, fz_stream* base, fz_buffer* tail);
+
+/**
+ * Computes a fingerprint of a file
+ *
+ * The fingerprint is a SHA-256 digest over the size and modification time of
+ * the file and its first and last 64 KiB. It is cheap to compute even for
+ * very large files and is used to key on-disk caches.
+ *
+ * @param path Path to the file
+ * @return The fingerprint as hex string (free with g_free) or NULL if the
+ *   file could not be read
+ */
+char* mupdf_file_fingerprint(const char* path);
+
+/**
+ * Returns a directory in the plugin's cache directory
+ *
+ * The directory is $XDG_CACHE_HOME/zathura-pdf-mupdf/subdir, which is created
+ * if necessary.
+ *
+ * @param subdir Name of the cache
+ * @return The path (free with g_free) or NULL if the directory is not
+ *   available
+ */
+char* mupdf_cache_dir(const char* subdir);
+
+/**
+ * Returns the path of an entry in the plugin's cache directory
+ *
+ * The entry is located in $XDG_CACHE_HOME/zathura-pdf-mupdf/subdir, which is
+ * created if necessary.
+ *
+ * @param subdir Name of the cache
+ * @param name Name of the entry
+ * @return The path (free with g_free) or NULL if the cache directory is not
+ *   available
+ */
+char* mupdf_cache_path(const char* subdir, const char* name);
+
+/**
+ * Limits the size of a cache directory
+ *
+ * If the entries of the directory are larger than the limit, the least
+ * recently modified ones are removed until they are smaller than three
+ * quarters of it. Users of a cache update the modification time of entries
+ * they read.
+ *
+ * @param subdir Name of the cache
+ * @param limit Maximal size of the entries in bytes
+ */
+void mupdf_cache_trim(const char* subdir, uint64_t limit);
+
+/**
+ * Loads the cached cross-reference section of a damaged PDF
+ *
+ * The section is meant to be appended to the file with
+ * mupdf_open_appended_stream, so mupdf finds a valid cross-reference table
+ * instead of reconstructing it.
+ *
+ * @param ctx The mupdf context
+ * @param fingerprint Fingerprint of the document file
+ * @return The section or NULL if there is none
+ */
+fz_buffer* mupdf_xref_cache_load(fz_context* ctx, const char* fingerprint);
+
+/**
+ * Updates the cached cross-reference section of a PDF after it was opened
+ *
+ * If mupdf had to reconstruct the cross-reference table, the result is saved;
+ * if it had to do so despite a cached section, the section is removed.
+ *
+ * @param ctx The mupdf context
+ * @param document The document
+ * @param fingerprint Fingerprint of the document file
+ * @param loaded true if the document was opened with a cached section
+ */
+void mupdf_xref_cache_update(fz_context* ctx, fz_document* document, const char* fingerprint, bool loaded);
+
+/**
+ * Parses a recoloring specification
+ *
+ * The specification is either "invert" or two RGB colors in hexadecimal
+ * notation separated by a colon, e.g. "#e0e0e0:#202020": the first one
+ * replaces black and the second one white. Colors in between are
+ * interpolated.
+ *
+ * @param spec The specification
+ * @param recolor The parsed recoloring
+ * @return false if spec is not a valid specification
+ */
+bool mupdf_recolor_parse(const char* spec, mupdf_recolor_t* recolor);
+
+/**
+ * Loads the mupdf page if it has not been loaded yet
+ *
+ * Pages of progressively loaded documents may not be available when they are
+ * initialized. This function has to be called with the document lock held.
+ *
+ * @param mupdf_document The document
+ * @param mupdf_page The page
+ * @return true if the page is available, otherwise false
+ */
+bool mupdf_page_load(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page);
+
+/**
+ * Creates the contents of a page
+ *
+ * @param ctx The mupdf context
+ * @param bbox Bounds of the page
+ * @return The contents with a reference count of 1 or NULL on error
+ */
+mupdf_page_content_t* mupdf_page_content_new(fz_context* ctx, fz_rect bbox);
+
+/**
+ * Increases the reference count of page contents
+ *
+ * @param content The contents
+ * @return The contents
+ */
+mupdf_page_content_t* mupdf_page_content_ref(mupdf_page_content_t* content);
+
+/**
+ * Decreases the reference count of page contents and frees them once it drops
+ * to zero
+ *
+ * @param ctx The mupdf context
+ * @param content The contents or NULL
+ */
+void mupdf_page_content_unref(fz_context* ctx, mupdf_page_content_t* content);
+
+/**
+ * Unreferences all page contents of an array and frees it
+ *
+ * @param ctx The mupdf context
+ * @param contents Array of page contents (entries may be NULL) or NULL
+ */
+void mupdf_page_contents_free(fz_context* ctx, GPtrArray* contents);
+
+/**
+ * Sets the contents of a page that is being initialized
+ *
+ * The page gets new contents; whether its contents from before a reload can
+ * be reused is decided by mupdf_page_content_share. This function has to be
+ * called with the document lock held.
+ *
+ * @param mupdf_document The document
+ * @param mupdf_page The page
+ * @return false on error
+ */
+bool mupdf_page_content_attach(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page);
+
+/**
+ * Lets a page share its contents with identical pages
+ *
+ * Computes the fingerprint of the page if necessary. Has to be called before
+ * the contents of the page are used. If the document has been reloaded and
+ * the page is made of the same objects as before, the page switches to its
+ * previous contents. If another page with the same fingerprint has been
+ * interpreted before, the page switches to its contents; otherwise its
+ * contents are offered to identical pages. This function has to be called
+ * with the document lock held.
+ *
+ * @param mupdf_document The document
+ * @param mupdf_page The page
+ */
+void mupdf_page_content_share(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page);
+
+/**
+ * Unreferences all page contents of a table and frees it
+ *
+ * @param ctx The mupdf context
+ * @param contents Table of page contents by fingerprint or NULL
+ */
+void mupdf_page_contents_table_free(fz_context* ctx, GHashTable* contents);
+
+/**
+ * Removes the contents of a page that is being cleared
+ *
+ * Contents worth keeping are moved to the retired contents of the document.
+ * This function has to be called with the document lock held.
+ *
+ * @param mupdf_document The document
+ * @param mupdf_page The page
+ */
+void mupdf_page_content_detach(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page);
+
+/**
+ * Runs one layer of a page through a device
+ *
+ * Throws on error.
+ *
+ * @param ctx The context
+ * @param page The page
+ * @param layer The layer
+ * @param device The device
+ * @param ctm Transformation of the page
+ * @param cookie Cookie or NULL
+ */
+void mupdf_run_page_layer(fz_context* ctx, fz_page* page, mupdf_layer_t layer, fz_device* device, fz_matrix ctm,
+                          fz_cookie* cookie);
+
+/**
+ * Records one layer of a page into a display list
+ *
+ * @param ctx The context
+ * @param page The page
+ * @param bounds Bounds of the page
+ * @param layer The layer
+ * @param cookie Cookie or NULL
+ * @return The list (drop with fz_drop_display_list) or NULL on error
+ */
+fz_display_list* mupdf_record_page_layer(fz_context* ctx, fz_page* page, fz_rect bounds, mupdf_layer_t layer,
+                                         fz_cookie* cookie);
+
+/**
+ * Returns the display lists of the layers of a page, recording the layers
+ * that are not recorded yet
+ *
+ * Every layer is recorded and kept on its own, so a layer that changed when
+ * the document is reloaded is recorded again while the recordings of the
+ * other layers are reused. Only the lists of a limited number of recently
+ * used pages are kept. The page has to be loaded and the document lock held.
+ *
+ * @param mupdf_document The document
+ * @param mupdf_page The page
+ * @param lists Set to new references to the lists, in drawing order
+ * @param cookie Cookie to detect incomplete pages
+ * @return false on error
+ */
+bool mupdf_page_get_display_lists(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page,
+                                  fz_display_list* lists[MUPDF_LAYER_COUNT], fz_cookie* cookie);
+
+/**
+ * Keeps the page contents of a closed document for the next time it is
+ * opened
+ *
+ * Everything but the display lists of layers drawing Type3 glyphs is kept,
+ * for at most a limited number of pages. Contents stashed before are freed,
+ * and the stash is dropped if the document is not opened again within a few
+ * seconds.
+ *
+ * @param ctx The mupdf context
+ * @param path Path of the document
+ * @param contents Page contents by index or NULL; the stash takes ownership
+ */
+void mupdf_page_contents_stash(fz_context* ctx, const char* path, GPtrArray* contents);
+
+/**
+ * Takes the page contents stashed for a document
+ *
+ * Contents stashed for other documents are freed.
+ *
+ * @param ctx The mupdf context
+ * @param path Path of the document
+ * @return Page contents by index (free with mupdf_page_contents_free) or NULL
+ */
+GPtrArray* mupdf_page_contents_unstash(fz_context* ctx, const char* path);
+
+/**
+ * Creates a device that draws on a cairo context
+ *
+ * Paths, text and images are forwarded to cairo as vector operations, so
+ * surfaces like PDF or PostScript print surfaces keep them resolution
+ * independent. Constructs without a cairo equivalent (smooth shadings,
+ * luminosity masks and glyphs without outlines) are rasterized locally.
+ *
+ * @param ctx The context
+ * @param cairo The cairo context; a reference is taken
+ * @return The device; throws on error
+ */
+fz_device* mupdf_new_cairo_device(fz_context* ctx, cairo_t* cairo);
+
+/**
+ * Compresses 32-bit pixels with run-length encoding
+ *
+ * Runs of equal pixels, e.g. the background of pages, are stored once.
+ * Encoding stops if the result would exceed limit.
+ *
+ * @param image The pixels
+ * @param width Width of the image in pixels
+ * @param height Height of the image in pixels
+ * @param rowstride Distance between rows of image in bytes
+ * @param limit Maximal length of the result
+ * @param length Set to the length of the result
+ * @return The compressed pixels (free with g_free) or NULL if they do not fit
+ *   into limit
+ */
+unsigned char* mupdf_rle_compress(const unsigned char* image, unsigned int width, unsigned int height, int rowstride,
+                                  size_t limit, size_t* length);
+
+/**
+ * Decompresses pixels compressed with mupdf_rle_compress
+ *
+ * @param data The compressed pixels
+ * @param length Length of data
+ * @param image Buffer for the pixels
+ * @param width Width of the image in pixels
+ * @param height Height of the image in pixels
+ * @param rowstride Distance between rows of image in bytes
+ * @return false if data does not describe an image of that size
+ */
+bool mupdf_rle_decompress(const unsigned char* data, size_t length, unsigned char* image, unsigned int width,
+                          unsigned int height, int rowstride);
+
+/**
+ * Measures the complexity of a page
+ *
+ * The page is interpreted into a display list, which is replayed through a
+ * device counting paths, images, text and transparency, and rasterized at
+ * 96 dpi. Both steps are timed. Throws on error or if the page is not yet
+ * complete.
+ *
+ * @param ctx The context
+ * @param page The page
+ * @param stats The result
+ */
+void mupdf_page_analyze(fz_context* ctx, fz_page* page, mupdf_page_stats_t* stats);
+
+/**
+ * Describes the complexity of a page
+ *
+ * @param stats The complexity
+ * @return The description (free with g_free)
+ */
+char* mupdf_page_stats_format(const mupdf_page_stats_t* stats);
+
+/**
+ * Counts the contents of a recorded page
+ *
+ * The counts are added to the ones in stats; the times are left alone.
+ *
+ * @param ctx The context
+ * @param list The recorded page
+ * @param stats The counters
+ */
+void mupdf_display_list_count(fz_context* ctx, fz_display_list* list, mupdf_page_stats_t* stats);
+
+/**
+ * Checks whether a page consists of nothing but a single image
+ *
+ * This is the case for scanned pages and image documents. Invisible text and
+ * clips that do not cut the image are allowed; images with masks or
+ * transparency are not.
+ *
+ * @param ctx The context
+ * @param list The recorded page
+ * @param ctm Set to the transformation of the image
+ * @return The image (drop with fz_drop_image) or NULL; throws on error
+ */
+fz_image* mupdf_page_single_image(fz_context* ctx, fz_display_list* list, fz_matrix* ctm);
+
+/**
+ * Computes the scale at which a page fits into an image
+ *
+ * Both directions use the same scale, so a page whose size differs from the
+ * one the image was made for is not distorted.
+ *
+ * @param bounds The bounds of the page
+ * @param width Width of the image in pixels
+ * @param height Height of the image in pixels
+ * @return The scale or 0 if the bounds are empty
+ */
+double mupdf_page_scale(fz_rect bounds, unsigned int width, unsigned int height);
+
+/**
+ * Rasterizes the part of a scaled page inside a clip
+ *
+ * The layers of the page are drawn one after another onto the same pixels.
+ * Large pages are split into tiles, so the display lists only replay the
+ * objects of one tile at a time and the buffers of transparency groups and
+ * masks are bounded by the tile size. Gray pages are rasterized with one
+ * channel and expanded afterwards. Throws on error.
+ *
+ * @param ctx The context
+ * @param lists The layers of the page, in drawing order
+ * @param image Target of the BGRA pixels of the page
+ * @param rowstride Distance between rows of image in bytes
+ * @param page_width Width of the page in pixels
+ * @param page_height Height of the page in pixels
+ * @param clip Pixels that are rasterized
+ * @param scalex Horizontal scale of the page
+ * @param scaley Vertical scale of the page
+ * @param gray If the page has been found to be gray
+ * @param recolor Recoloring or NULL
+ */
+void mupdf_render_layers(fz_context* ctx, fz_display_list* const lists[MUPDF_LAYER_COUNT], unsigned char* image,
+                         int rowstride, unsigned int page_width, unsigned int page_height, fz_irect clip, double scalex,
+                         double scaley, bool gray, const mupdf_recolor_t* recolor);
+
+/**
+ * Tests whether a page contains colors other than gray
+ *
+ * Shadings are tested pixel by pixel. The pixels of images are only tested if
+ * the contents have been decoded into a level anyway or if the images are
+ * small; larger images count as colored unless their color space is gray, as
+ * decoding them in full for the test would take longer than rendering the
+ * page.
+ *
+ * @param ctx The context
+ * @param lists The layers of the page
+ * @param decoded If the image of the contents has been replaced by a level
+ * @return true if the page has color or the test failed
+ */
+bool mupdf_layers_have_color(fz_context* ctx, fz_display_list* const lists[MUPDF_LAYER_COUNT], bool decoded);
+
+/**
+ * Chooses the level an image is decoded at
+ *
+ * Level n is the image subsampled by 2^n. The smallest level that is at least
+ * as large as the image on screen is chosen.
+ *
+ * @param image The image
+ * @param ctm Transformation of the image on the page
+ * @param scalex Horizontal scale of the page
+ * @param scaley Vertical scale of the page
+ * @return The level or -1 if the level is too large to be decoded as a whole;
+ *   the draw device only decodes the visible parts of such images
+ */
+int mupdf_image_level(const fz_image* image, fz_matrix ctm, double scalex, double scaley);
+
+/**
+ * Records a page consisting of an image with the image replaced by a level
+ *
+ * The level is decoded using the subsampling built into the decoders where
+ * possible and is only scaled afterwards.
+ *
+ * @param ctx The context
+ * @param image The image
+ * @param ctm Transformation of the image on the page
+ * @param level The level (see mupdf_image_level)
+ * @param size Set to the size of the decoded level in bytes
+ * @return The list (drop with fz_drop_display_list); throws on error
+ */
+fz_display_list* mupdf_image_level_new(fz_context* ctx, fz_image* image, fz_matrix ctm, int level, size_t* size);
+
+/**
+ * Creates a thumbnail of a page
+ *
+ * The thumbnail embedded in PDF pages is used if it is at least as large as
+ * the requested thumbnail, so no content streams are interpreted. Otherwise
+ * the page is drawn at the size of the thumbnail.
+ *
+ * @param ctx The context
+ * @param page The page
+ * @param size Size of the longer side of the thumbnail in pixels
+ * @return The RGB thumbnail (drop with fz_drop_pixmap); throws on error
+ */
+fz_pixmap* mupdf_page_thumbnail(fz_context* ctx, fz_page* page, int size);
+
+/**
+ * Callback for mupdf_document_information
+ *
+ * @param type Type of the information
+ * @param value Value of the information
+ * @param data Custom data
+ */
+typedef void (*mupdf_information_callback_t)(zathura_document_information_type_t type, const char* value,
+                                             void* data);
+
+/**
+ * Reads the metadata of a PDF document
+ *
+ * Calls callback for every non-empty entry of the document information
+ * dictionary.
+ *
+ * @param ctx The context
+ * @param document The document
+ * @param callback Function called for every entry
+ * @param data Custom data passed to callback
+ * @return false if the document is not a PDF document; throws on error
+ */
+bool mupdf_document_information(fz_context* ctx, fz_document* document, mupdf_information_callback_t callback,
+                                void* data);
+
+/**
+ * Creates the cache of decoded image surfaces of a document
+ *
+ * Entries keep their image alive and have to be dropped with the document
+ * context, so the cache has to be freed before the context.
+ *
+ * @return The cache
+ */
+mupdf_cache_t* mupdf_image_cache_new(void);
+
+/**
+ * Reads the page labels of a PDF document
+ *
+ * The PageLabels number tree is read into a table of label ranges once. The
+ * table is immutable, so lookups do not need the document lock.
+ *
+ * @param ctx The context
+ * @param document The document
+ * @param n_pages Number of pages of the document
+ * @return The page labels (free with mupdf_page_labels_free) or NULL if the
+ *   document is not a PDF document or the labels could not be read
+ */
+mupdf_page_labels_t* mupdf_page_labels_new(fz_context* ctx, fz_document* document, unsigned int n_pages);
+
+/**
+ * Frees page labels
+ *
+ * @param labels The page labels
+ */
+void mupdf_page_labels_free(mupdf_page_labels_t* labels);
+
+/**
+ * Returns the label of a page
+ *
+ * Pages of documents without page labels are numbered starting with 1.
+ *
+ * @param labels The page labels
+ * @param index Index of the page
+ * @return The label (free with g_free) or NULL if the page has no label
+ */
+char* mupdf_page_labels_get(const mupdf_page_labels_t* labels, unsigned int index);
+
+#ifdef HAVE_WORKERS
+/**
+ * Starts a pool of render workers for a document
+ *
+ * Every worker is a helper process that opens the document with its own
+ * context. Workers are started on demand, except for the first one, and
+ * started again after they crashed or hung.
+ *
+ * @param path Path to the document
+ * @param password Password of the document or NULL
+ * @param count Number of workers
+ * @param memory Limit of the address space of every worker in MiB or 0
+ * @param timeout Time in milliseconds after which a worker that has not
+ *   replied is considered hanging; renders get more time per pixel
+ * @return The pool (free with mupdf_workers_free) or NULL if the first worker
+ *   could not open the document
+ */
+mupdf_workers_t* mupdf_workers_new(const char* path, const char* password, unsigned int count, unsigned int memory,
+                                   unsigned int timeout);
+
+/**
+ * Stops the workers and frees the pool
+ *
+ * @param workers The pool or NULL
+ */
+void mupdf_workers_free(mupdf_workers_t* workers);
+
+typedef enum mupdf_workers_result_e {
+  MUPDF_WORKERS_OK,         /**< The page has been rendered */
+  MUPDF_WORKERS_FAILED,     /**< The page could not be rendered, e.g. because of an error in the document */
+  MUPDF_WORKERS_LOST,       /**< The worker crashed or hung while rendering the page */
+  MUPDF_WORKERS_SUPERSEDED, /**< A newer request was made while waiting for an idle worker */
+} mupdf_workers_result_t;
+
+/**
+ * Renders the clip of a page with an idle worker
+ *
+ * Complete pages that compress well are kept, so rendering them again at the
+ * same size only restores them.
+
+ * The wait for an idle worker is given up once a newer request for the page
+ * has been made, as with mupdf_document_lock_request.
+ *
+ * @param workers The pool
+ * @param index Index of the page
+ * @param image Target of the BGRA pixels of the page
+ * @param rowstride Distance between rows of image in bytes
+ * @param width Width of the page in pixels
+ * @param height Height of the page in pixels
+ * @param clip Pixels that are rendered
+ * @param recolor Recoloring or NULL
+ * @param generation Counter that is incremented by every request for the page
+ * @param current Value of generation when this request was made
+ * @return The result
+ */
+mupdf_workers_result_t mupdf_workers_render(mupdf_workers_t* workers, unsigned int index, unsigned char* image,
+                                            int rowstride, unsigned int width, unsigned int height, fz_irect clip,
+                                            const mupdf_recolor_t* recolor, const gint* generation, gint current);
+#endif
+
+#ifdef HAVE_DISK_CACHE
+/* Length of disk cache keys */
+#define MUPDF_DISK_CACHE_KEY_LENGTH 64
+
+/**
+ * Computes the key of a rendered page in the disk cache
+ *
+ * @param fingerprint Fingerprint of the document file
+ * @param index Index of the page
+ * @param width Width of the rendered page in pixels
+ * @param height Height of the rendered page in pixels
+ * @param recolor Recoloring of the rendered page
+ * @param key Buffer for the key
+ * @return false if there is no fingerprint, so the page cannot be cached
+ */
+bool mupdf_disk_cache_key(const char* fingerprint, unsigned int index, unsigned int width, unsigned int height,
+                          const mupdf_recolor_t* recolor, char key[MUPDF_DISK_CACHE_KEY_LENGTH + 1]);
+
+/**
+ * Loads a rendered page from the disk cache
+ *
+ * The entry is read and decompressed with a context of its own, so the
+ * document lock is not needed.
+ *
+ * @param key The key
+ * @param image Buffer for the BGRA pixels
+ * @param width Width of the image in pixels
+ * @param height Height of the image in pixels
+ * @param rowstride Distance between rows of image in bytes
+ * @return true if the page has been found, otherwise false
+ */
+bool mupdf_disk_cache_load(const char* key, unsigned char* image, unsigned int width, unsigned int height,
+                           int rowstride);
+
+/**
+ * Stores a rendered page in the disk cache
+ *
+ * The pixels are copied and handed to a background thread, which compresses
+ * and writes them and removes the least recently used entries once the cache
+ * grows beyond its limit. Pages are not stored while the thread is behind.
+ *
+ * @param key The key
+ * @param image The BGRA pixels
+ * @param width Width of the image in pixels
+ * @param height Height of the image in pixels
+ * @param rowstride Distance between rows of image in bytes
+ */
+void mupdf_disk_cache_store(const char* key, const unsigned char* image, unsigned int width, unsigned int height,
+                            int rowstride);
+#endif
+
+#ifdef HAVE_FONTCONFIG
+/**
+ * Installs functions that load fonts, which are not embedded in a document,
+ * from the system with fontconfig
+ *
+ * Resolved fonts are remembered in a lookup table in the cache directory, so
+ * fontconfig is only asked about new fonts. Font files are memory-mapped and
+ * shared by all fonts loaded from them.
+ *
+ * @param ctx The base context; contexts cloned from it use the same functions
+ */
+void mupdf_install_system_fonts(fz_context* ctx);
+#endif
+
 void mupdf_page_extract_text(mupdf_document_t* mupdf_document, mupdf_page_t* mupdf_page);
 
+/**
+ * Appends the bounding boxes of quads to a list of rectangles
+ *
+ * Consecutive quads on the same line, e.g. the characters of a hit or the
+ * spans of a selected line, are merged into one rectangle.
+ *
+ * @param list List of zathura_rectangle_t
+ * @param quads The quads
+ * @param n_quads Number of quads
+ */
+void mupdf_append_quads(girara_list_t* list, const fz_quad* quads, int n_quads);
+
 #endif // UTILS_H
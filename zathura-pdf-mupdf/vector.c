@@ -0,0 +1,997 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include <math.h>
+#include <float.h>
+
+#include "utils.h"
+
+/* Resolution (in dpi) used for the few constructs that cairo cannot express
+ * as vectors: smooth shadings, luminosity masks and glyphs without outlines */
+#define MUPDF_CAIRO_RASTER_DPI 150.0
+/* Maximum number of pixels of such a rasterized area */
+#define MUPDF_CAIRO_RASTER_MAX_PIXELS (4096 * 4096)
+/* Resolution (in dpi) images are decoded for */
+#define MUPDF_CAIRO_IMAGE_DPI 300.0
+
+typedef enum mupdf_cairo_entry_type_e {
+  MUPDF_CAIRO_CLIP,       /**< Clip set with cairo_save/cairo_clip */
+  MUPDF_CAIRO_MASK,       /**< Soft mask being defined */
+  MUPDF_CAIRO_CLIP_MASK,  /**< Content drawn through a mask */
+  MUPDF_CAIRO_GROUP,      /**< Transparency group */
+  MUPDF_CAIRO_TILE,       /**< Tiling pattern cell */
+} mupdf_cairo_entry_type_t;
+
+typedef struct mupdf_cairo_entry_s {
+  mupdf_cairo_entry_type_t type;
+  cairo_t* outer;          /**< Context to restore when drawing happens on a temporary context */
+  cairo_pattern_t* mask;   /**< Mask for MUPDF_CAIRO_CLIP_MASK */
+  cairo_matrix_t matrix;   /**< User to surface matrix of the temporary context */
+  fz_function* transfer;   /**< Transfer function of a luminosity mask */
+  fz_rect area;            /**< Area of a tile */
+  float alpha;             /**< Group alpha */
+  int blendmode;           /**< Group blend mode */
+  bool luminosity;         /**< Mask uses the luminosity of its content */
+} mupdf_cairo_entry_t;
+
+typedef struct mupdf_cairo_device_s {
+  fz_device super;
+  cairo_t* cairo;               /**< Context everything is currently drawn on */
+  mupdf_cairo_entry_t* stack;   /**< Clip, mask, group and tile stack */
+  int len;                      /**< Number of entries on the stack */
+  int cap;                      /**< Capacity of the stack */
+} mupdf_cairo_device_t;
+
+typedef void (*mupdf_cairo_raster_fn)(fz_context* ctx, fz_device* draw_device, void* data);
+
+static mupdf_cairo_entry_t* cairo_device_push(fz_context* ctx, mupdf_cairo_device_t* device,
+                                              mupdf_cairo_entry_type_t type) {
+  if (device->len == device->cap) {
+    int cap       = device->cap == 0 ? 16 : device->cap * 2;
+    device->stack = fz_realloc_array(ctx, device->stack, cap, mupdf_cairo_entry_t);
+    device->cap   = cap;
+  }
+
+  mupdf_cairo_entry_t* entry = &device->stack[device->len++];
+  memset(entry, 0, sizeof(*entry));
+  entry->type = type;
+
+  return entry;
+}
+
+static cairo_matrix_t cairo_matrix_from_fz(fz_matrix m) {
+  cairo_matrix_t matrix;
+  cairo_matrix_init(&matrix, m.a, m.b, m.c, m.d, m.e, m.f);
+  return matrix;
+}
+
+/* Applies ctm to the current transformation; fails for singular matrices,
+ * which would put the cairo context into an error state. */
+static bool cairo_device_transform(cairo_t* cairo, fz_matrix ctm) {
+  if (fabsf(ctm.a * ctm.d - ctm.b * ctm.c) < FLT_EPSILON) {
+    return false;
+  }
+
+  cairo_matrix_t matrix = cairo_matrix_from_fz(ctm);
+  cairo_transform(cairo, &matrix);
+
+  return true;
+}
+
+static void cairo_device_set_color(fz_context* ctx, cairo_t* cairo, fz_colorspace* colorspace, const float* color,
+                                   float alpha, fz_color_params color_params) {
+  float rgb[3] = {0, 0, 0};
+  if (colorspace != NULL && color != NULL) {
+    fz_convert_color(ctx, colorspace, color, fz_device_rgb(ctx), rgb, NULL, color_params);
+  }
+
+  cairo_set_source_rgba(cairo, rgb[0], rgb[1], rgb[2], alpha);
+}
+
+static void path_moveto(fz_context* GIRARA_UNUSED(ctx), void* arg, float x, float y) {
+  cairo_move_to(arg, x, y);
+}
+
+static void path_lineto(fz_context* GIRARA_UNUSED(ctx), void* arg, float x, float y) {
+  cairo_line_to(arg, x, y);
+}
+
+static void path_curveto(fz_context* GIRARA_UNUSED(ctx), void* arg, float x1, float y1, float x2, float y2, float x3,
+                         float y3) {
+  cairo_curve_to(arg, x1, y1, x2, y2, x3, y3);
+}
+
+static void path_closepath(fz_context* GIRARA_UNUSED(ctx), void* arg) {
+  cairo_close_path(arg);
+}
+
+static void path_rectto(fz_context* GIRARA_UNUSED(ctx), void* arg, float x1, float y1, float x2, float y2) {
+  cairo_rectangle(arg, x1, y1, x2 - x1, y2 - y1);
+}
+
+static const fz_path_walker cairo_path_walker = {
+    .moveto    = path_moveto,
+    .lineto    = path_lineto,
+    .curveto   = path_curveto,
+    .closepath = path_closepath,
+    .rectto    = path_rectto,
+};
+
+/* Appends the path transformed by ctm to the current cairo path. Cairo keeps
+ * paths in device space, so the transformation can be reset afterwards. */
+static bool cairo_device_append_path(fz_context* ctx, cairo_t* cairo, const fz_path* path, fz_matrix ctm) {
+  cairo_matrix_t saved;
+  cairo_get_matrix(cairo, &saved);
+
+  if (cairo_device_transform(cairo, ctm) == false) {
+    return false;
+  }
+
+  fz_walk_path(ctx, path, &cairo_path_walker, cairo);
+  cairo_set_matrix(cairo, &saved);
+
+  return true;
+}
+
+/* Appends the outlines of all glyphs of text to the current cairo path.
+ * Returns false if a glyph has no outline (e.g. Type 3 or bitmap fonts). */
+static bool cairo_device_append_text(fz_context* ctx, cairo_t* cairo, const fz_text* text, fz_matrix ctm) {
+  for (fz_text_span* span = text->head; span != NULL; span = span->next) {
+    for (int i = 0; i < span->len; i++) {
+      const fz_text_item* item = &span->items[i];
+      if (item->gid < 0) {
+        continue;
+      }
+
+      fz_matrix trm = span->trm;
+      trm.e         = item->x;
+      trm.f         = item->y;
+
+      fz_path* path = fz_outline_glyph(ctx, span->font, item->gid, trm);
+      if (path == NULL) {
+        return false;
+      }
+
+      fz_try(ctx) {
+        cairo_device_append_path(ctx, cairo, path, ctm);
+      }
+      fz_always(ctx) {
+        fz_drop_path(ctx, path);
+      }
+      fz_catch(ctx) {
+        fz_rethrow(ctx);
+      }
+    }
+  }
+
+  return true;
+}
+
+static cairo_line_cap_t cairo_line_cap_from_fz(fz_linecap cap) {
+  switch (cap) {
+  case FZ_LINECAP_ROUND:
+  case FZ_LINECAP_TRIANGLE:
+    return CAIRO_LINE_CAP_ROUND;
+  case FZ_LINECAP_SQUARE:
+    return CAIRO_LINE_CAP_SQUARE;
+  default:
+    return CAIRO_LINE_CAP_BUTT;
+  }
+}
+
+static cairo_line_join_t cairo_line_join_from_fz(fz_linejoin join) {
+  switch (join) {
+  case FZ_LINEJOIN_ROUND:
+    return CAIRO_LINE_JOIN_ROUND;
+  case FZ_LINEJOIN_BEVEL:
+    return CAIRO_LINE_JOIN_BEVEL;
+  default:
+    return CAIRO_LINE_JOIN_MITER;
+  }
+}
+
+/* Sets the stroke parameters; expects the current transformation to be the
+ * one the stroke state is defined in. */
+static void cairo_device_set_stroke(fz_context* ctx, cairo_t* cairo, const fz_stroke_state* stroke, fz_matrix ctm) {
+  float linewidth = stroke->linewidth;
+  if (linewidth <= 0) {
+    /* zero width lines are drawn as thin as possible */
+    const float expansion = fz_matrix_expansion(ctm);
+    linewidth             = expansion > FLT_EPSILON ? 0.25f / expansion : 0.25f;
+  }
+
+  cairo_set_line_width(cairo, linewidth);
+  cairo_set_line_cap(cairo, cairo_line_cap_from_fz(stroke->start_cap));
+  cairo_set_line_join(cairo, cairo_line_join_from_fz(stroke->linejoin));
+  cairo_set_miter_limit(cairo, stroke->miterlimit);
+
+  if (stroke->dash_len > 0) {
+    double* dashes = fz_malloc_array(ctx, stroke->dash_len, double);
+    for (int i = 0; i < stroke->dash_len; i++) {
+      dashes[i] = stroke->dash_list[i];
+    }
+    cairo_set_dash(cairo, dashes, stroke->dash_len, stroke->dash_phase);
+    fz_free(ctx, dashes);
+  } else {
+    cairo_set_dash(cairo, NULL, 0, 0);
+  }
+}
+
+/* Converts a pixmap into a cairo image surface. Pixmaps without colorspace
+ * (image masks) become alpha-only surfaces; all others, gray ones included,
+ * are converted to BGR. */
+static cairo_surface_t* cairo_surface_from_pixmap(fz_context* ctx, fz_pixmap* pixmap) {
+  const int width  = fz_pixmap_width(ctx, pixmap);
+  const int height = fz_pixmap_height(ctx, pixmap);
+
+  fz_colorspace* colorspace = fz_pixmap_colorspace(ctx, pixmap);
+  const bool mask           = colorspace == NULL;
+
+  fz_pixmap* converted = NULL;
+  if (mask == false && colorspace != fz_device_bgr(ctx)) {
+    converted = fz_convert_pixmap(ctx, pixmap, fz_device_bgr(ctx), NULL, NULL, fz_default_color_params, 1);
+    pixmap    = converted;
+  }
+
+  const int n      = fz_pixmap_components(ctx, pixmap);
+  const bool alpha = fz_pixmap_alpha(ctx, pixmap) != 0;
+
+  cairo_format_t format = CAIRO_FORMAT_RGB24;
+  if (mask == true) {
+    format = CAIRO_FORMAT_A8;
+  } else if (alpha == true) {
+    format = CAIRO_FORMAT_ARGB32;
+  }
+
+  cairo_surface_t* surface = cairo_image_surface_create(format, width, height);
+  if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+    fz_drop_pixmap(ctx, converted);
+    cairo_surface_destroy(surface);
+    return NULL;
+  }
+
+  unsigned char* data       = cairo_image_surface_get_data(surface);
+  const int stride          = cairo_image_surface_get_stride(surface);
+  const unsigned char* rows = fz_pixmap_samples(ctx, pixmap);
+  const int pixmap_stride   = fz_pixmap_stride(ctx, pixmap);
+
+  for (int y = 0; y < height; y++) {
+    const unsigned char* s = rows + y * pixmap_stride;
+    unsigned char* d       = data + y * stride;
+
+    if (mask == true) {
+      /* the last component is the coverage */
+      for (int x = 0; x < width; x++) {
+        d[x] = s[x * n + n - 1];
+      }
+    } else if (alpha == true) {
+      /* premultiplied BGRA is what cairo expects on little endian hosts */
+      memcpy(d, s, width * 4);
+    } else {
+      for (int x = 0; x < width; x++, s += 3, d += 4) {
+        d[0] = s[0];
+        d[1] = s[1];
+        d[2] = s[2];
+        d[3] = 0xFF;
+      }
+    }
+  }
+
+  cairo_surface_mark_dirty(surface);
+  fz_drop_pixmap(ctx, converted);
+
+  return surface;
+}
+
+static fz_rect cairo_device_clip_extents(cairo_t* cairo) {
+  double x0, y0, x1, y1;
+  cairo_clip_extents(cairo, &x0, &y0, &x1, &y1);
+
+  return (fz_rect){.x0 = x0, .y0 = y0, .x1 = x1, .y1 = y1};
+}
+
+/* Returns the scale factor from user space to pixels used when rasterizing
+ * an area, reduced if necessary to stay below the pixel limit. */
+static float cairo_device_raster_scale(fz_rect area) {
+  float scale        = MUPDF_CAIRO_RASTER_DPI / 72.0f;
+  const double width = (area.x1 - area.x0) * scale;
+  const double height = (area.y1 - area.y0) * scale;
+
+  if (width * height > MUPDF_CAIRO_RASTER_MAX_PIXELS) {
+    scale *= sqrt(MUPDF_CAIRO_RASTER_MAX_PIXELS / (width * height));
+  }
+
+  return scale;
+}
+
+/* Rasterizes whatever callback draws within area with mupdf's draw device and
+ * paints the result; used for constructs without a cairo equivalent. */
+static void cairo_device_rasterize(fz_context* ctx, mupdf_cairo_device_t* device, fz_rect area,
+                                   mupdf_cairo_raster_fn callback, void* data) {
+  area = fz_intersect_rect(area, cairo_device_clip_extents(device->cairo));
+  if (fz_is_empty_rect(area) != 0) {
+    return;
+  }
+
+  const float scale        = cairo_device_raster_scale(area);
+  const fz_matrix ctm      = fz_concat(fz_translate(-area.x0, -area.y0), fz_scale(scale, scale));
+  const fz_irect bbox      = fz_round_rect(fz_transform_rect(area, ctm));
+  fz_pixmap* pixmap        = NULL;
+  fz_device* draw_device   = NULL;
+  cairo_surface_t* surface = NULL;
+
+  fz_var(pixmap);
+  fz_var(draw_device);
+
+  fz_try(ctx) {
+    pixmap = fz_new_pixmap_with_bbox(ctx, fz_device_bgr(ctx), bbox, NULL, 1);
+    fz_clear_pixmap(ctx, pixmap);
+
+    draw_device = fz_new_draw_device(ctx, ctm, pixmap);
+    callback(ctx, draw_device, data);
+    fz_close_device(ctx, draw_device);
+
+    surface = cairo_surface_from_pixmap(ctx, pixmap);
+  }
+  fz_always(ctx) {
+    fz_drop_device(ctx, draw_device);
+    fz_drop_pixmap(ctx, pixmap);
+  }
+  fz_catch(ctx) {
+    fz_rethrow(ctx);
+  }
+
+  if (surface == NULL) {
+    return;
+  }
+
+  cairo_save(device->cairo);
+  cairo_translate(device->cairo, area.x0, area.y0);
+  cairo_scale(device->cairo, 1.0 / scale, 1.0 / scale);
+  cairo_set_source_surface(device->cairo, surface, bbox.x0, bbox.y0);
+  cairo_paint(device->cairo);
+  cairo_restore(device->cairo);
+
+  cairo_surface_destroy(surface);
+}
+
+static void cairo_device_fill_path(fz_context* ctx, fz_device* dev, const fz_path* path, int even_odd, fz_matrix ctm,
+                                   fz_colorspace* colorspace, const float* color, float alpha,
+                                   fz_color_params color_params) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  cairo_t* cairo               = device->cairo;
+
+  cairo_new_path(cairo);
+  if (cairo_device_append_path(ctx, cairo, path, ctm) == false) {
+    return;
+  }
+
+  cairo_device_set_color(ctx, cairo, colorspace, color, alpha, color_params);
+  cairo_set_fill_rule(cairo, even_odd != 0 ? CAIRO_FILL_RULE_EVEN_ODD : CAIRO_FILL_RULE_WINDING);
+  cairo_fill(cairo);
+}
+
+static void cairo_device_stroke_path(fz_context* ctx, fz_device* dev, const fz_path* path,
+                                     const fz_stroke_state* stroke, fz_matrix ctm, fz_colorspace* colorspace,
+                                     const float* color, float alpha, fz_color_params color_params) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  cairo_t* cairo               = device->cairo;
+
+  cairo_save(cairo);
+  cairo_new_path(cairo);
+  if (cairo_device_transform(cairo, ctm) == true) {
+    fz_walk_path(ctx, path, &cairo_path_walker, cairo);
+    cairo_device_set_stroke(ctx, cairo, stroke, ctm);
+    cairo_device_set_color(ctx, cairo, colorspace, color, alpha, color_params);
+    cairo_stroke(cairo);
+  }
+  cairo_restore(cairo);
+}
+
+static void cairo_device_clip_path(fz_context* ctx, fz_device* dev, const fz_path* path, int even_odd, fz_matrix ctm,
+                                   fz_rect GIRARA_UNUSED(scissor)) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  cairo_t* cairo               = device->cairo;
+
+  cairo_device_push(ctx, device, MUPDF_CAIRO_CLIP);
+  cairo_save(cairo);
+  cairo_new_path(cairo);
+  cairo_device_append_path(ctx, cairo, path, ctm);
+  cairo_set_fill_rule(cairo, even_odd != 0 ? CAIRO_FILL_RULE_EVEN_ODD : CAIRO_FILL_RULE_WINDING);
+  cairo_clip(cairo);
+}
+
+/* Starts drawing through a mask: everything up to the matching pop_clip is
+ * drawn into a group that is painted through the mask. */
+static void cairo_device_begin_masked(fz_context* ctx, mupdf_cairo_device_t* device, cairo_pattern_t* mask) {
+  mupdf_cairo_entry_t* entry = cairo_device_push(ctx, device, MUPDF_CAIRO_CLIP_MASK);
+  entry->mask                = mask;
+
+  cairo_save(device->cairo);
+  cairo_push_group(device->cairo);
+}
+
+static void cairo_device_clip_stroke_path(fz_context* ctx, fz_device* dev, const fz_path* path,
+                                          const fz_stroke_state* stroke, fz_matrix ctm,
+                                          fz_rect GIRARA_UNUSED(scissor)) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  cairo_t* cairo               = device->cairo;
+
+  cairo_push_group_with_content(cairo, CAIRO_CONTENT_ALPHA);
+  cairo_save(cairo);
+  cairo_new_path(cairo);
+  if (cairo_device_transform(cairo, ctm) == true) {
+    fz_walk_path(ctx, path, &cairo_path_walker, cairo);
+    cairo_device_set_stroke(ctx, cairo, stroke, ctm);
+    cairo_set_source_rgba(cairo, 0, 0, 0, 1);
+    cairo_stroke(cairo);
+  }
+  cairo_restore(cairo);
+
+  cairo_device_begin_masked(ctx, device, cairo_pop_group(cairo));
+}
+
+typedef struct mupdf_cairo_text_s {
+  const fz_text* text;
+  const fz_stroke_state* stroke;
+  fz_matrix ctm;
+  fz_colorspace* colorspace;
+  const float* color;
+  float alpha;
+  fz_color_params color_params;
+} mupdf_cairo_text_t;
+
+static void cairo_device_raster_text(fz_context* ctx, fz_device* draw_device, void* data) {
+  const mupdf_cairo_text_t* text = data;
+
+  if (text->stroke != NULL) {
+    fz_stroke_text(ctx, draw_device, text->text, text->stroke, text->ctm, text->colorspace, text->color, text->alpha,
+                   text->color_params);
+  } else {
+    fz_fill_text(ctx, draw_device, text->text, text->ctm, text->colorspace, text->color, text->alpha,
+                 text->color_params);
+  }
+}
+
+static void cairo_device_raster_text_mask(fz_context* ctx, fz_device* draw_device, void* data) {
+  const mupdf_cairo_text_t* text = data;
+  const float black[1]           = {0};
+
+  fz_fill_text(ctx, draw_device, text->text, text->ctm, fz_device_gray(ctx), black, 1, fz_default_color_params);
+}
+
+static void cairo_device_fill_text(fz_context* ctx, fz_device* dev, const fz_text* text, fz_matrix ctm,
+                                   fz_colorspace* colorspace, const float* color, float alpha,
+                                   fz_color_params color_params) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  cairo_t* cairo               = device->cairo;
+
+  cairo_new_path(cairo);
+  if (cairo_device_append_text(ctx, cairo, text, ctm) == false) {
+    cairo_new_path(cairo);
+
+    mupdf_cairo_text_t data = {text, NULL, ctm, colorspace, color, alpha, color_params};
+    cairo_device_rasterize(ctx, device, fz_bound_text(ctx, text, NULL, ctm), cairo_device_raster_text, &data);
+    return;
+  }
+
+  cairo_device_set_color(ctx, cairo, colorspace, color, alpha, color_params);
+  cairo_set_fill_rule(cairo, CAIRO_FILL_RULE_WINDING);
+  cairo_fill(cairo);
+}
+
+static void cairo_device_stroke_text(fz_context* ctx, fz_device* dev, const fz_text* text,
+                                     const fz_stroke_state* stroke, fz_matrix ctm, fz_colorspace* colorspace,
+                                     const float* color, float alpha, fz_color_params color_params) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  cairo_t* cairo               = device->cairo;
+
+  cairo_save(cairo);
+  cairo_new_path(cairo);
+
+  bool outlined = false;
+  if (cairo_device_transform(cairo, ctm) == true) {
+    outlined = cairo_device_append_text(ctx, cairo, text, fz_identity);
+    if (outlined == true) {
+      cairo_device_set_stroke(ctx, cairo, stroke, ctm);
+      cairo_device_set_color(ctx, cairo, colorspace, color, alpha, color_params);
+      cairo_stroke(cairo);
+    }
+  }
+
+  cairo_new_path(cairo);
+  cairo_restore(cairo);
+
+  if (outlined == false) {
+    mupdf_cairo_text_t data = {text, stroke, ctm, colorspace, color, alpha, color_params};
+    cairo_device_rasterize(ctx, device, fz_bound_text(ctx, text, stroke, ctm), cairo_device_raster_text, &data);
+  }
+}
+
+static void cairo_device_clip_text(fz_context* ctx, fz_device* dev, const fz_text* text, fz_matrix ctm,
+                                   fz_rect GIRARA_UNUSED(scissor)) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  cairo_t* cairo               = device->cairo;
+
+  cairo_new_path(cairo);
+  if (cairo_device_append_text(ctx, cairo, text, ctm) == true) {
+    cairo_device_push(ctx, device, MUPDF_CAIRO_CLIP);
+    cairo_save(cairo);
+    cairo_set_fill_rule(cairo, CAIRO_FILL_RULE_WINDING);
+    cairo_clip(cairo);
+    return;
+  }
+
+  /* glyphs without outlines: clip through a rasterized mask of the text */
+  cairo_new_path(cairo);
+  cairo_push_group_with_content(cairo, CAIRO_CONTENT_ALPHA);
+  mupdf_cairo_text_t data = {text, NULL, ctm, NULL, NULL, 1, fz_default_color_params};
+  cairo_device_rasterize(ctx, device, fz_bound_text(ctx, text, NULL, ctm), cairo_device_raster_text_mask, &data);
+  cairo_device_begin_masked(ctx, device, cairo_pop_group(cairo));
+}
+
+static void cairo_device_clip_stroke_text(fz_context* ctx, fz_device* dev, const fz_text* text,
+                                          const fz_stroke_state* stroke, fz_matrix ctm,
+                                          fz_rect GIRARA_UNUSED(scissor)) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  cairo_t* cairo               = device->cairo;
+
+  cairo_push_group_with_content(cairo, CAIRO_CONTENT_ALPHA);
+  cairo_save(cairo);
+  cairo_new_path(cairo);
+  if (cairo_device_transform(cairo, ctm) == true &&
+      cairo_device_append_text(ctx, cairo, text, fz_identity) == true) {
+    cairo_device_set_stroke(ctx, cairo, stroke, ctm);
+    cairo_set_source_rgba(cairo, 0, 0, 0, 1);
+    cairo_stroke(cairo);
+  }
+  cairo_new_path(cairo);
+  cairo_restore(cairo);
+
+  cairo_device_begin_masked(ctx, device, cairo_pop_group(cairo));
+}
+
+typedef struct mupdf_cairo_shade_s {
+  fz_shade* shade;
+  fz_matrix ctm;
+  float alpha;
+  fz_color_params color_params;
+} mupdf_cairo_shade_t;
+
+static void cairo_device_raster_shade(fz_context* ctx, fz_device* draw_device, void* data) {
+  const mupdf_cairo_shade_t* shade = data;
+
+  fz_fill_shade(ctx, draw_device, shade->shade, shade->ctm, shade->alpha, shade->color_params);
+}
+
+static void cairo_device_fill_shade(fz_context* ctx, fz_device* dev, fz_shade* shade, fz_matrix ctm, float alpha,
+                                    fz_color_params color_params) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+
+  mupdf_cairo_shade_t data = {shade, ctm, alpha, color_params};
+  cairo_device_rasterize(ctx, device, fz_bound_shade(ctx, shade, ctm), cairo_device_raster_shade, &data);
+}
+
+/* Decodes an image at print resolution into a pattern covering the
+ * rectangle (0, 0, width, height) */
+static cairo_pattern_t* cairo_device_image_pattern(fz_context* ctx, fz_image* image, fz_matrix ctm, int* width,
+                                                   int* height) {
+  fz_matrix image_ctm = fz_concat(ctm, fz_scale(MUPDF_CAIRO_IMAGE_DPI / 72.0f, MUPDF_CAIRO_IMAGE_DPI / 72.0f));
+  fz_pixmap* pixmap   = fz_get_pixmap_from_image(ctx, image, NULL, &image_ctm, NULL, NULL);
+
+  cairo_surface_t* surface = NULL;
+  fz_try(ctx) {
+    surface = cairo_surface_from_pixmap(ctx, pixmap);
+    *width  = fz_pixmap_width(ctx, pixmap);
+    *height = fz_pixmap_height(ctx, pixmap);
+  }
+  fz_always(ctx) {
+    fz_drop_pixmap(ctx, pixmap);
+  }
+  fz_catch(ctx) {
+    fz_rethrow(ctx);
+  }
+
+  if (surface == NULL) {
+    return NULL;
+  }
+
+  cairo_pattern_t* pattern = cairo_pattern_create_for_surface(surface);
+  cairo_surface_destroy(surface);
+
+  cairo_pattern_set_extend(pattern, CAIRO_EXTEND_PAD);
+  if (image->interpolate == 0 && (image->w < 64 || image->h < 64)) {
+    cairo_pattern_set_filter(pattern, CAIRO_FILTER_NEAREST);
+  } else {
+    cairo_pattern_set_filter(pattern, CAIRO_FILTER_GOOD);
+  }
+
+  return pattern;
+}
+
+/* Sets up the transformation and clip for drawing an image pattern */
+static bool cairo_device_begin_image(cairo_t* cairo, fz_matrix ctm, int width, int height) {
+  cairo_save(cairo);
+  if (cairo_device_transform(cairo, ctm) == false) {
+    cairo_restore(cairo);
+    return false;
+  }
+
+  cairo_scale(cairo, 1.0 / width, 1.0 / height);
+  cairo_new_path(cairo);
+  cairo_rectangle(cairo, 0, 0, width, height);
+  cairo_clip(cairo);
+
+  return true;
+}
+
+static void cairo_device_fill_image(fz_context* ctx, fz_device* dev, fz_image* image, fz_matrix ctm, float alpha,
+                                    fz_color_params GIRARA_UNUSED(color_params)) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  cairo_t* cairo               = device->cairo;
+
+  int width = 0, height = 0;
+  cairo_pattern_t* pattern = cairo_device_image_pattern(ctx, image, ctm, &width, &height);
+  if (pattern == NULL) {
+    return;
+  }
+
+  if (cairo_device_begin_image(cairo, ctm, width, height) == true) {
+    cairo_set_source(cairo, pattern);
+    cairo_paint_with_alpha(cairo, alpha);
+    cairo_restore(cairo);
+  }
+
+  cairo_pattern_destroy(pattern);
+}
+
+static void cairo_device_fill_image_mask(fz_context* ctx, fz_device* dev, fz_image* image, fz_matrix ctm,
+                                         fz_colorspace* colorspace, const float* color, float alpha,
+                                         fz_color_params color_params) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  cairo_t* cairo               = device->cairo;
+
+  int width = 0, height = 0;
+  cairo_pattern_t* pattern = cairo_device_image_pattern(ctx, image, ctm, &width, &height);
+  if (pattern == NULL) {
+    return;
+  }
+
+  if (cairo_device_begin_image(cairo, ctm, width, height) == true) {
+    cairo_device_set_color(ctx, cairo, colorspace, color, alpha, color_params);
+    cairo_mask(cairo, pattern);
+    cairo_restore(cairo);
+  }
+
+  cairo_pattern_destroy(pattern);
+}
+
+static void cairo_device_clip_image_mask(fz_context* ctx, fz_device* dev, fz_image* image, fz_matrix ctm,
+                                         fz_rect GIRARA_UNUSED(scissor)) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  cairo_t* cairo               = device->cairo;
+
+  int width = 0, height = 0;
+  cairo_pattern_t* pattern = cairo_device_image_pattern(ctx, image, ctm, &width, &height);
+
+  cairo_push_group_with_content(cairo, CAIRO_CONTENT_ALPHA);
+  if (pattern != NULL) {
+    if (cairo_device_begin_image(cairo, ctm, width, height) == true) {
+      cairo_set_source_rgba(cairo, 0, 0, 0, 1);
+      cairo_mask(cairo, pattern);
+      cairo_restore(cairo);
+    }
+    cairo_pattern_destroy(pattern);
+  }
+
+  cairo_device_begin_masked(ctx, device, cairo_pop_group(cairo));
+}
+
+static void cairo_device_pop_clip(fz_context* GIRARA_UNUSED(ctx), fz_device* dev) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  if (device->len == 0) {
+    return;
+  }
+
+  mupdf_cairo_entry_t* entry = &device->stack[device->len - 1];
+  if (entry->type != MUPDF_CAIRO_CLIP && entry->type != MUPDF_CAIRO_CLIP_MASK) {
+    return;
+  }
+  device->len--;
+
+  cairo_t* cairo = device->cairo;
+  if (entry->type == MUPDF_CAIRO_CLIP_MASK) {
+    cairo_pop_group_to_source(cairo);
+    if (entry->mask != NULL) {
+      cairo_mask(cairo, entry->mask);
+      cairo_pattern_destroy(entry->mask);
+    }
+  }
+  cairo_restore(cairo);
+}
+
+static void cairo_device_begin_mask(fz_context* ctx, fz_device* dev, fz_rect area, int luminosity,
+                                    fz_colorspace* colorspace, const float* backdrop, fz_color_params color_params) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  mupdf_cairo_entry_t* entry   = cairo_device_push(ctx, device, MUPDF_CAIRO_MASK);
+
+  if (luminosity == 0) {
+    /* alpha masks map directly onto cairo groups */
+    cairo_save(device->cairo);
+    cairo_push_group_with_content(device->cairo, CAIRO_CONTENT_ALPHA);
+    return;
+  }
+
+  /* luminosity masks are drawn on an image surface and converted to alpha */
+  area                 = fz_intersect_rect(area, cairo_device_clip_extents(device->cairo));
+  const float scale    = cairo_device_raster_scale(area);
+  const int width      = fz_is_empty_rect(area) != 0 ? 1 : fz_maxi(1, ceilf((area.x1 - area.x0) * scale));
+  const int height     = fz_is_empty_rect(area) != 0 ? 1 : fz_maxi(1, ceilf((area.y1 - area.y0) * scale));
+  const float x0       = fz_is_empty_rect(area) != 0 ? 0 : area.x0;
+  const float y0       = fz_is_empty_rect(area) != 0 ? 0 : area.y0;
+
+  cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+  cairo_t* cairo           = cairo_create(surface);
+  cairo_surface_destroy(surface);
+
+  cairo_matrix_init_scale(&entry->matrix, scale, scale);
+  cairo_matrix_translate(&entry->matrix, -x0, -y0);
+  cairo_set_matrix(cairo, &entry->matrix);
+
+  cairo_device_set_color(ctx, cairo, colorspace, backdrop, 1, color_params);
+  cairo_paint(cairo);
+
+  entry->luminosity = true;
+  entry->outer      = device->cairo;
+  device->cairo     = cairo;
+}
+
+static void cairo_device_end_mask(fz_context* ctx, fz_device* dev, fz_function* transfer) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  if (device->len == 0 || device->stack[device->len - 1].type != MUPDF_CAIRO_MASK) {
+    return;
+  }
+
+  mupdf_cairo_entry_t entry = device->stack[--device->len];
+
+  if (entry.luminosity == false) {
+    cairo_pattern_t* mask = cairo_pop_group(device->cairo);
+    cairo_restore(device->cairo);
+    cairo_device_begin_masked(ctx, device, mask);
+    return;
+  }
+
+  cairo_surface_t* surface = cairo_surface_reference(cairo_get_target(device->cairo));
+  cairo_destroy(device->cairo);
+  device->cairo = entry.outer;
+  cairo_surface_flush(surface);
+
+  unsigned char lut[256];
+  for (int i = 0; i < 256; i++) {
+    float in  = i / 255.0f;
+    float out = in;
+    if (transfer != NULL) {
+      fz_eval_function(ctx, transfer, &in, 1, &out, 1);
+    }
+    lut[i] = fz_clamp(out, 0, 1) * 255 + 0.5f;
+  }
+
+  const int width  = cairo_image_surface_get_width(surface);
+  const int height = cairo_image_surface_get_height(surface);
+
+  cairo_surface_t* mask_surface = cairo_image_surface_create(CAIRO_FORMAT_A8, width, height);
+  unsigned char* s              = cairo_image_surface_get_data(surface);
+  unsigned char* d              = cairo_image_surface_get_data(mask_surface);
+  const int s_stride            = cairo_image_surface_get_stride(surface);
+  const int d_stride            = cairo_image_surface_get_stride(mask_surface);
+
+  if (s != NULL && d != NULL) {
+    for (int y = 0; y < height; y++) {
+      const uint32_t* src = (const uint32_t*)(s + y * s_stride);
+      for (int x = 0; x < width; x++) {
+        const uint32_t p = src[x];
+        const int r      = (p >> 16) & 0xFF;
+        const int g      = (p >> 8) & 0xFF;
+        const int b      = p & 0xFF;
+        d[y * d_stride + x] = lut[(r * 77 + g * 151 + b * 28) >> 8];
+      }
+    }
+    cairo_surface_mark_dirty(mask_surface);
+  }
+  cairo_surface_destroy(surface);
+
+  cairo_pattern_t* mask = cairo_pattern_create_for_surface(mask_surface);
+  cairo_surface_destroy(mask_surface);
+  cairo_pattern_set_matrix(mask, &entry.matrix);
+
+  cairo_device_begin_masked(ctx, device, mask);
+}
+
+static cairo_operator_t cairo_operator_from_blendmode(int blendmode) {
+  switch (blendmode & FZ_BLEND_MODEMASK) {
+  case FZ_BLEND_MULTIPLY:
+    return CAIRO_OPERATOR_MULTIPLY;
+  case FZ_BLEND_SCREEN:
+    return CAIRO_OPERATOR_SCREEN;
+  case FZ_BLEND_OVERLAY:
+    return CAIRO_OPERATOR_OVERLAY;
+  case FZ_BLEND_DARKEN:
+    return CAIRO_OPERATOR_DARKEN;
+  case FZ_BLEND_LIGHTEN:
+    return CAIRO_OPERATOR_LIGHTEN;
+  case FZ_BLEND_COLOR_DODGE:
+    return CAIRO_OPERATOR_COLOR_DODGE;
+  case FZ_BLEND_COLOR_BURN:
+    return CAIRO_OPERATOR_COLOR_BURN;
+  case FZ_BLEND_HARD_LIGHT:
+    return CAIRO_OPERATOR_HARD_LIGHT;
+  case FZ_BLEND_SOFT_LIGHT:
+    return CAIRO_OPERATOR_SOFT_LIGHT;
+  case FZ_BLEND_DIFFERENCE:
+    return CAIRO_OPERATOR_DIFFERENCE;
+  case FZ_BLEND_EXCLUSION:
+    return CAIRO_OPERATOR_EXCLUSION;
+  case FZ_BLEND_HUE:
+    return CAIRO_OPERATOR_HSL_HUE;
+  case FZ_BLEND_SATURATION:
+    return CAIRO_OPERATOR_HSL_SATURATION;
+  case FZ_BLEND_COLOR:
+    return CAIRO_OPERATOR_HSL_COLOR;
+  case FZ_BLEND_LUMINOSITY:
+    return CAIRO_OPERATOR_HSL_LUMINOSITY;
+  default:
+    return CAIRO_OPERATOR_OVER;
+  }
+}
+
+static void cairo_device_begin_group(fz_context* ctx, fz_device* dev, fz_rect GIRARA_UNUSED(area),
+                                     fz_colorspace* GIRARA_UNUSED(colorspace), int GIRARA_UNUSED(isolated),
+                                     int GIRARA_UNUSED(knockout), int blendmode, float alpha) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  mupdf_cairo_entry_t* entry   = cairo_device_push(ctx, device, MUPDF_CAIRO_GROUP);
+  entry->alpha                 = alpha;
+  entry->blendmode             = blendmode;
+
+  cairo_save(device->cairo);
+  cairo_push_group(device->cairo);
+}
+
+static void cairo_device_end_group(fz_context* GIRARA_UNUSED(ctx), fz_device* dev) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  if (device->len == 0 || device->stack[device->len - 1].type != MUPDF_CAIRO_GROUP) {
+    return;
+  }
+
+  mupdf_cairo_entry_t* entry = &device->stack[--device->len];
+  cairo_t* cairo             = device->cairo;
+
+  cairo_pop_group_to_source(cairo);
+  cairo_set_operator(cairo, cairo_operator_from_blendmode(entry->blendmode));
+  cairo_paint_with_alpha(cairo, entry->alpha);
+  cairo_restore(cairo);
+}
+
+static int cairo_device_begin_tile(fz_context* ctx, fz_device* dev, fz_rect area, fz_rect view, float xstep,
+                                   float ystep, fz_matrix ctm, int GIRARA_UNUSED(id), int GIRARA_UNUSED(doc_id)) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  mupdf_cairo_entry_t* entry   = cairo_device_push(ctx, device, MUPDF_CAIRO_TILE);
+  entry->area                  = area;
+  entry->outer                 = device->cairo;
+
+  /* The cell is recorded in pattern space, with its origin at the corner of
+   * the view; the content arrives in device space. */
+  const cairo_rectangle_t extents = {0, 0, fabsf(xstep), fabsf(ystep)};
+  cairo_surface_t* surface        = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+  cairo_t* cairo                  = cairo_create(surface);
+  cairo_surface_destroy(surface);
+
+  cairo_matrix_t translate;
+  cairo_matrix_init_translate(&translate, -view.x0, -view.y0);
+  cairo_matrix_t inverse = cairo_matrix_from_fz(ctm);
+  if (cairo_matrix_invert(&inverse) != CAIRO_STATUS_SUCCESS) {
+    cairo_matrix_init_identity(&inverse);
+  }
+  cairo_matrix_multiply(&entry->matrix, &inverse, &translate);
+  cairo_set_matrix(cairo, &entry->matrix);
+
+  device->cairo = cairo;
+
+  return 0;
+}
+
+static void cairo_device_end_tile(fz_context* GIRARA_UNUSED(ctx), fz_device* dev) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+  if (device->len == 0 || device->stack[device->len - 1].type != MUPDF_CAIRO_TILE) {
+    return;
+  }
+
+  mupdf_cairo_entry_t* entry = &device->stack[--device->len];
+
+  cairo_pattern_t* pattern = cairo_pattern_create_for_surface(cairo_get_target(device->cairo));
+  cairo_destroy(device->cairo);
+  device->cairo = entry->outer;
+
+  cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
+  cairo_pattern_set_matrix(pattern, &entry->matrix);
+
+  cairo_t* cairo = device->cairo;
+  cairo_save(cairo);
+  cairo_new_path(cairo);
+  cairo_rectangle(cairo, entry->area.x0, entry->area.y0, entry->area.x1 - entry->area.x0,
+                  entry->area.y1 - entry->area.y0);
+  cairo_set_source(cairo, pattern);
+  cairo_fill(cairo);
+  cairo_restore(cairo);
+
+  cairo_pattern_destroy(pattern);
+}
+
+/* Unwinds everything that is still on the stack, e.g. after an error */
+static void cairo_device_unwind(fz_context* ctx, mupdf_cairo_device_t* device) {
+  while (device->len > 0) {
+    mupdf_cairo_entry_t* entry = &device->stack[device->len - 1];
+
+    switch (entry->type) {
+    case MUPDF_CAIRO_CLIP:
+    case MUPDF_CAIRO_CLIP_MASK:
+      cairo_device_pop_clip(ctx, &device->super);
+      break;
+    case MUPDF_CAIRO_MASK:
+      cairo_device_end_mask(ctx, &device->super, NULL);
+      break;
+    case MUPDF_CAIRO_GROUP:
+      cairo_device_end_group(ctx, &device->super);
+      break;
+    case MUPDF_CAIRO_TILE:
+      cairo_device_end_tile(ctx, &device->super);
+      break;
+    }
+  }
+}
+
+static void cairo_device_close(fz_context* ctx, fz_device* dev) {
+  cairo_device_unwind(ctx, (mupdf_cairo_device_t*)dev);
+}
+
+static void cairo_device_drop(fz_context* ctx, fz_device* dev) {
+  mupdf_cairo_device_t* device = (mupdf_cairo_device_t*)dev;
+
+  cairo_device_unwind(ctx, device);
+  cairo_destroy(device->cairo);
+  fz_free(ctx, device->stack);
+}
+
+fz_device* mupdf_new_cairo_device(fz_context* ctx, cairo_t* cairo) {
+  mupdf_cairo_device_t* device = fz_new_derived_device(ctx, mupdf_cairo_device_t);
+
+  device->super.close_device = cairo_device_close;
+  device->super.drop_device  = cairo_device_drop;
+
+  device->super.fill_path        = cairo_device_fill_path;
+  device->super.stroke_path      = cairo_device_stroke_path;
+  device->super.clip_path        = cairo_device_clip_path;
+  device->super.clip_stroke_path = cairo_device_clip_stroke_path;
+
+  device->super.fill_text        = cairo_device_fill_text;
+  device->super.stroke_text      = cairo_device_stroke_text;
+  device->super.clip_text        = cairo_device_clip_text;
+  device->super.clip_stroke_text = cairo_device_clip_stroke_text;
+
+  device->super.fill_shade      = cairo_device_fill_shade;
+  device->super.fill_image      = cairo_device_fill_image;
+  device->super.fill_image_mask = cairo_device_fill_image_mask;
+  device->super.clip_image_mask = cairo_device_clip_image_mask;
+
+  device->super.pop_clip = cairo_device_pop_clip;
+
+  device->super.begin_mask  = cairo_device_begin_mask;
+  device->super.end_mask    = cairo_device_end_mask;
+  device->super.begin_group = cairo_device_begin_group;
+  device->super.end_group   = cairo_device_end_group;
+
+  device->super.begin_tile = cairo_device_begin_tile;
+  device->super.end_tile   = cairo_device_end_tile;
+
+  device->cairo = cairo_reference(cairo);
+
+  return &device->super;
+}
@@ -0,0 +1,225 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include <glib.h>
+#include <girara/utils.h>
+#include <mupdf/pdf.h>
+
+#include "utils.h"
+
+/* Size of the head and of the tail of a file that are read ahead before the
+ * document is opened. They hold the trailer and the cross-reference table,
+ * or the first page of linearized files. */
+#define MUPDF_WARM_FILE_ENDS (1024 * 1024)
+/* Maximal number of bytes of object streams that are read ahead */
+#define MUPDF_WARM_OBJECT_STREAMS_LIMIT (16 * 1024 * 1024)
+/* Number of pages at the start of a document that are warmed */
+#define MUPDF_WARM_PAGES 8
+
+void mupdf_document_prefetch_file(const char* path) {
+  const mupdf_file_range_t ranges[] = {
+      {.offset = 0, .length = MUPDF_WARM_FILE_ENDS},
+      {.offset = -MUPDF_WARM_FILE_ENDS, .length = MUPDF_WARM_FILE_ENDS},
+  };
+
+  mupdf_file_prefetch(path, ranges, G_N_ELEMENTS(ranges));
+}
+
+static gint compare_offsets(gconstpointer a, gconstpointer b) {
+  const int64_t offset_a = *(const int64_t*)a;
+  const int64_t offset_b = *(const int64_t*)b;
+  return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+/* Returns the ranges of the object streams of a PDF. Object streams hold the
+ * page tree, the resource dictionaries and most other small objects of
+ * compressed documents, so they are read by the first page turns in any
+ * case. Every object stream extends to the next object in the file. */
+static GArray* object_stream_ranges(fz_context* ctx, pdf_document* pdf) {
+  const int length       = pdf_xref_len(ctx, pdf);
+  GArray* ranges         = g_array_new(FALSE, FALSE, sizeof(mupdf_file_range_t));
+  GArray* offsets        = g_array_new(FALSE, FALSE, sizeof(int64_t));
+  GHashTable* containers = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  for (int i = 0; i < length; i++) {
+    const pdf_xref_entry* entry = pdf_get_xref_entry_no_change(ctx, pdf, i);
+    if (entry == NULL) {
+      continue;
+    } else if (entry->type == 'n' && entry->ofs > 0) {
+      g_array_append_val(offsets, entry->ofs);
+    } else if (entry->type == 'o') {
+      g_hash_table_add(containers, GINT_TO_POINTER((int)entry->ofs));
+    }
+  }
+  g_array_sort(offsets, compare_offsets);
+
+  int64_t total = 0;
+  GHashTableIter iter;
+  gpointer key;
+  g_hash_table_iter_init(&iter, containers);
+  while (g_hash_table_iter_next(&iter, &key, NULL) == TRUE && total < MUPDF_WARM_OBJECT_STREAMS_LIMIT) {
+    const int number = GPOINTER_TO_INT(key);
+    if (number <= 0 || number >= length) {
+      continue;
+    }
+
+    const pdf_xref_entry* entry = pdf_get_xref_entry_no_change(ctx, pdf, number);
+    if (entry == NULL || entry->type != 'n' || entry->ofs <= 0) {
+      continue;
+    }
+
+    /* the next object in the file ends the stream */
+    unsigned int low  = 0;
+    unsigned int high = offsets->len;
+    while (low < high) {
+      const unsigned int middle = low + (high - low) / 2;
+      if (g_array_index(offsets, int64_t, middle) <= entry->ofs) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+
+    const int64_t end             = low < offsets->len ? g_array_index(offsets, int64_t, low) : G_MAXINT64;
+    const mupdf_file_range_t range = {
+        .offset = entry->ofs,
+        .length = MIN(end - entry->ofs, MUPDF_WARM_OBJECT_STREAMS_LIMIT - total),
+    };
+    total += range.length;
+    g_array_append_val(ranges, range);
+  }
+
+  g_hash_table_unref(containers);
+  g_array_free(offsets, TRUE);
+
+  return ranges;
+}
+
+/* Measures the complexity of every page for the document information. The
+ * lock is taken for one page at a time, so the analysis of long documents
+ * never holds up other requests for longer than one page takes. */
+static void analyze_pages(mupdf_document_t* mupdf_document, int n_pages) {
+  fz_context* ctx = mupdf_document->ctx;
+
+  for (int i = 0; i < n_pages && g_atomic_int_get(&mupdf_document->stop_warming) == 0; i++) {
+    mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_BACKGROUND);
+    if (g_atomic_int_get(&mupdf_document->stop_warming) != 0) {
+      mupdf_document_unlock(mupdf_document);
+      break;
+    }
+
+    fz_page* volatile page   = NULL;
+    mupdf_page_stats_t stats = {0};
+    bool available           = true;
+
+    fz_try(ctx) {
+      page = fz_load_page(ctx, mupdf_document->document, i);
+      mupdf_page_analyze(ctx, page, &stats);
+    }
+    fz_always(ctx) {
+      fz_drop_page(ctx, page);
+    }
+    fz_catch(ctx) {
+      /* broken pages are listed without contents */
+      available = fz_caught(ctx) != FZ_ERROR_TRYLATER;
+      girara_debug("failed to analyze page %d: %s", i + 1, fz_caught_message(ctx));
+    }
+
+    if (available == true) {
+      g_array_append_val(mupdf_document->page_stats, stats);
+    }
+    mupdf_document_unlock(mupdf_document);
+
+    if (available == false) {
+      break;
+    }
+  }
+}
+
+/* Loads the page tree and runs the first pages through a device that does
+ * nothing but measure them. This reads their content streams and loads their
+ * fonts and images into the resource store, which the renders of these pages
+ * share. The lock is taken for one page at a time with background priority,
+ * so every other request goes first. Afterwards all pages are analyzed. */
+static gpointer warm_document(gpointer data) {
+  mupdf_document_t* mupdf_document = data;
+  fz_context* ctx                  = mupdf_document->ctx;
+  int n_pages                      = 0;
+
+  mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_BACKGROUND);
+  fz_try(ctx) {
+    n_pages = fz_count_pages(ctx, mupdf_document->document);
+
+    /* page tree maps are built on the first lookup */
+    pdf_document* pdf = pdf_specifics(ctx, mupdf_document->document);
+    if (pdf != NULL && n_pages > 0) {
+      pdf_lookup_page_obj(ctx, pdf, n_pages - 1);
+    }
+  }
+  fz_catch(ctx) {
+    girara_debug("failed to warm page tree: %s", fz_caught_message(ctx));
+  }
+  mupdf_document_unlock(mupdf_document);
+
+  for (int i = 0; i < MIN(n_pages, MUPDF_WARM_PAGES) && g_atomic_int_get(&mupdf_document->stop_warming) == 0; i++) {
+    mupdf_document_lock(mupdf_document, MUPDF_PRIORITY_BACKGROUND);
+    if (g_atomic_int_get(&mupdf_document->stop_warming) != 0) {
+      mupdf_document_unlock(mupdf_document);
+      break;
+    }
+
+    fz_page* volatile page     = NULL;
+    fz_device* volatile device = NULL;
+    fz_rect bounds             = fz_empty_rect;
+
+    fz_try(ctx) {
+      page   = fz_load_page(ctx, mupdf_document->document, i);
+      device = fz_new_bbox_device(ctx, &bounds);
+      fz_run_page(ctx, page, device, fz_identity, NULL);
+      fz_close_device(ctx, device);
+    }
+    fz_always(ctx) {
+      fz_drop_device(ctx, device);
+      fz_drop_page(ctx, page);
+    }
+    fz_catch(ctx) {
+      girara_debug("failed to warm page %d: %s", i + 1, fz_caught_message(ctx));
+    }
+
+    mupdf_document_unlock(mupdf_document);
+  }
+
+  analyze_pages(mupdf_document, n_pages);
+
+  return NULL;
+}
+
+void mupdf_document_warm_start(mupdf_document_t* mupdf_document, const char* path) {
+  fz_context* ctx   = mupdf_document->ctx;
+  pdf_document* pdf = pdf_specifics(ctx, mupdf_document->document);
+
+  mupdf_document->page_stats = g_array_new(FALSE, FALSE, sizeof(mupdf_page_stats_t));
+
+  /* documents that are still loading are read as their data arrives */
+  if (mupdf_document->stream != NULL && mupdf_document->stream->progressive != 0) {
+    return;
+  }
+
+  if (pdf != NULL) {
+    GArray* ranges = object_stream_ranges(ctx, pdf);
+    mupdf_file_prefetch(path, (const mupdf_file_range_t*)ranges->data, ranges->len);
+    g_array_free(ranges, TRUE);
+  }
+
+  g_atomic_int_set(&mupdf_document->stop_warming, 0);
+  mupdf_document->warmer = g_thread_try_new("mupdf-warm", warm_document, mupdf_document, NULL);
+}
+
+void mupdf_document_warm_stop(mupdf_document_t* mupdf_document) {
+  if (mupdf_document->warmer == NULL) {
+    return;
+  }
+
+  g_atomic_int_set(&mupdf_document->stop_warming, 1);
+  g_thread_join(mupdf_document->warmer);
+  mupdf_document->warmer = NULL;
+}
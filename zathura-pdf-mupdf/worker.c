@@ -0,0 +1,340 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "utils.h"
+#include "worker.h"
+
+/* The socket to the plugin is passed as standard input */
+#define WORKER_SOCKET 0
+/* Number of recorded pages that are kept */
+#define WORKER_PAGES 4
+/* Budget of the decoded levels of the images of pages */
+#define WORKER_LEVEL_BUDGET (128 * 1024 * 1024)
+
+typedef struct worker_page_s {
+  uint32_t index;                            /**< Page index */
+  uint64_t used;                             /**< Number of the request that used the page last */
+  fz_display_list* lists[MUPDF_LAYER_COUNT]; /**< Recorded layers or NULL if the slot is free */
+  fz_rect bounds;                            /**< Bounds of the page */
+  fz_image* image;                           /**< The only image of the contents or NULL */
+  fz_matrix image_ctm;                       /**< Transformation of image */
+  bool tested_color;                         /**< If has_color is known */
+  bool has_color;                            /**< If the page has colors other than gray */
+  int level;                                 /**< Level image is decoded at or -1 */
+  fz_display_list* level_list;               /**< The contents with image replaced by the level or NULL */
+  size_t level_size;                         /**< Size of the decoded level in bytes */
+} worker_page_t;
+
+/* Recently rendered pages, so pages rendered again, e.g. tile by tile or
+ * after zooming, are not interpreted again */
+static worker_page_t recorded[WORKER_PAGES];
+
+typedef struct worker_packet_s {
+  mupdf_worker_request_t request;
+  char payload[MUPDF_WORKER_PAYLOAD_MAX + 1];
+} worker_packet_t;
+
+/* Receives a request and the file descriptor of the shared buffer, if one is
+ * attached. Returns false once the plugin closed the socket. */
+static bool receive_request(worker_packet_t* packet, int* fd) {
+  char control[CMSG_SPACE(sizeof(int))] = {0};
+  struct iovec iov                      = {.iov_base = packet, .iov_len = sizeof(*packet) - 1};
+  struct msghdr message                 = {0};
+  message.msg_iov                       = &iov;
+  message.msg_iovlen                    = 1;
+  message.msg_control                   = control;
+  message.msg_controllen                = sizeof(control);
+
+  ssize_t length;
+  do {
+    length = recvmsg(WORKER_SOCKET, &message, MSG_CMSG_CLOEXEC);
+  } while (length < 0 && errno == EINTR);
+
+  if (length < (ssize_t)sizeof(packet->request) || packet->request.length > MUPDF_WORKER_PAYLOAD_MAX ||
+      (size_t)length != sizeof(packet->request) + packet->request.length) {
+    return false;
+  }
+  packet->payload[packet->request.length] = '\0';
+
+  *fd                  = -1;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+
+  return true;
+}
+
+static bool send_reply(mupdf_worker_status_t status, uint64_t length) {
+  const mupdf_worker_reply_t reply = {.status = status, .length = length};
+
+  ssize_t written;
+  do {
+    written = send(WORKER_SOCKET, &reply, sizeof(reply), MSG_NOSIGNAL);
+  } while (written < 0 && errno == EINTR);
+
+  return written == sizeof(reply);
+}
+
+static mupdf_worker_status_t open_document(fz_context* ctx, const char* path, const char* password,
+                                           fz_document** document) {
+  fz_stream* volatile stream   = NULL;
+  mupdf_worker_status_t status = MUPDF_WORKER_OK;
+
+  fz_try(ctx) {
+    stream    = mupdf_open_file_stream(ctx, path, false);
+    *document = fz_open_document_with_stream(ctx, path, stream);
+    if (fz_needs_password(ctx, *document) != 0 && fz_authenticate_password(ctx, *document, password) == 0) {
+      status = MUPDF_WORKER_INVALID_PASSWORD;
+    }
+  }
+  fz_always(ctx) {
+    fz_drop_stream(ctx, stream);
+  }
+  fz_catch(ctx) {
+    fprintf(stderr, "failed to open %s: %s\n", path, fz_caught_message(ctx));
+    status = MUPDF_WORKER_ERROR;
+  }
+
+  return status;
+}
+
+/* Frees the decoded level of the image of a page */
+static void drop_level(fz_context* ctx, worker_page_t* page) {
+  fz_drop_display_list(ctx, page->level_list);
+  page->level_list = NULL;
+  page->level      = -1;
+  page->level_size = 0;
+}
+
+static void drop_page(fz_context* ctx, worker_page_t* page) {
+  drop_level(ctx, page);
+  for (unsigned int i = 0; i < MUPDF_LAYER_COUNT; i++) {
+    fz_drop_display_list(ctx, page->lists[i]);
+  }
+  fz_drop_image(ctx, page->image);
+  *page = (worker_page_t){.level = -1};
+}
+
+/* Drops the levels of other pages, least recently used first, until all
+ * levels fit into the budget */
+static void trim_levels(fz_context* ctx, const worker_page_t* keep) {
+  while (true) {
+    size_t total          = 0;
+    worker_page_t* oldest = NULL;
+    for (unsigned int i = 0; i < WORKER_PAGES; i++) {
+      total += recorded[i].level_size;
+      worker_page_t* page = &recorded[i];
+      if (page != keep && page->level_list != NULL && (oldest == NULL || page->used < oldest->used)) {
+        oldest = page;
+      }
+    }
+
+    if (total <= WORKER_LEVEL_BUDGET || oldest == NULL) {
+      return;
+    }
+    drop_level(ctx, oldest);
+  }
+}
+
+/* Returns the recorded page, recording it in place of the least recently used
+ * one if necessary */
+static worker_page_t* get_page(fz_context* ctx, fz_document* document, uint32_t index) {
+  static uint64_t requests = 0;
+  requests++;
+
+  worker_page_t* slot = &recorded[0];
+  for (unsigned int i = 0; i < WORKER_PAGES; i++) {
+    if (recorded[i].lists[MUPDF_LAYER_CONTENTS] != NULL && recorded[i].index == index) {
+      recorded[i].used = requests;
+      return &recorded[i];
+    }
+    if (recorded[i].used < slot->used) {
+      slot = &recorded[i];
+    }
+  }
+  drop_page(ctx, slot);
+
+  fz_page* volatile page = NULL;
+
+  fz_try(ctx) {
+    page                 = fz_load_page(ctx, document, index);
+    slot->bounds = fz_bound_page(ctx, page);
+    for (unsigned int i = 0; i < MUPDF_LAYER_COUNT; i++) {
+      slot->lists[i] = mupdf_record_page_layer(ctx, page, slot->bounds, i, NULL);
+      if (slot->lists[i] == NULL) {
+        fz_throw(ctx, FZ_ERROR_GENERIC, "failed to record page");
+      }
+    }
+    slot->image = mupdf_page_single_image(ctx, slot->lists[MUPDF_LAYER_CONTENTS], &slot->image_ctm);
+  }
+  fz_always(ctx) {
+    fz_drop_page(ctx, page);
+  }
+  fz_catch(ctx) {
+    drop_page(ctx, slot);
+    fz_rethrow(ctx);
+  }
+
+  slot->index = index;
+  slot->used  = requests;
+  return slot;
+}
+
+/* Renders the clip of the page into the buffer, like the plugin does: pages
+ * consisting of one image are drawn from a decoded level of the image and gray
+ * pages are rasterized with one channel */
+static void render_page(fz_context* ctx, fz_document* document, const mupdf_worker_request_t* request,
+                        unsigned char* buffer) {
+  worker_page_t* page = get_page(ctx, document, request->index);
+
+  /* the page is fit to the buffer as the plugin fits it */
+  const double scale = mupdf_page_scale(page->bounds, request->width, request->height);
+  if (scale == 0) {
+    fz_throw(ctx, FZ_ERROR_GENERIC, "page %u is empty", request->index);
+  }
+
+  fz_display_list* layers[MUPDF_LAYER_COUNT];
+  memcpy(layers, page->lists, sizeof(layers));
+
+  if (page->image != NULL) {
+    const int level = mupdf_image_level(page->image, page->image_ctm, scale, scale);
+    if (level >= 0 && level != page->level) {
+      size_t size           = 0;
+      fz_display_list* list = mupdf_image_level_new(ctx, page->image, page->image_ctm, level, &size);
+      drop_level(ctx, page);
+      page->level_list = list;
+      page->level      = level;
+      page->level_size = size;
+      trim_levels(ctx, page);
+    }
+    if (level >= 0) {
+      layers[MUPDF_LAYER_CONTENTS] = page->level_list;
+    }
+  }
+
+  if (page->tested_color == false) {
+    page->has_color    = mupdf_layers_have_color(ctx, layers, layers[MUPDF_LAYER_CONTENTS] == page->level_list);
+    page->tested_color = true;
+  }
+
+  const mupdf_recolor_t recolor = {
+      .enabled     = true,
+      .dark_color  = request->dark_color,
+      .light_color = request->light_color,
+  };
+  mupdf_render_layers(ctx, layers, buffer, request->rowstride, request->width, request->height, request->clip,
+                      scale, scale, page->has_color == false,
+                      request->recolor != 0 ? &recolor : NULL);
+}
+
+static bool request_fits(const mupdf_worker_request_t* request, int pages) {
+  if (request->index >= (uint32_t)pages || request->type != MUPDF_WORKER_RENDER) {
+    return false;
+  }
+
+  const fz_irect clip = request->clip;
+  return clip.x0 >= 0 && clip.y0 >= 0 && clip.x0 < clip.x1 && clip.y0 < clip.y1 &&
+         (uint32_t)clip.x1 <= request->width && (uint32_t)clip.y1 <= request->height &&
+         request->rowstride >= (int64_t)request->width * 4 &&
+         (uint64_t)request->rowstride * request->height <= request->size;
+}
+
+static mupdf_worker_status_t serve(fz_context* ctx, fz_document* document, int pages,
+                                   const mupdf_worker_request_t* request, int fd) {
+  if (fd < 0 || request->size == 0 || request_fits(request, pages) == false) {
+    return MUPDF_WORKER_ERROR;
+  }
+
+  unsigned char* buffer = mmap(NULL, request->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (buffer == MAP_FAILED) {
+    return MUPDF_WORKER_ERROR;
+  }
+
+  mupdf_worker_status_t status = MUPDF_WORKER_OK;
+
+  fz_try(ctx) {
+    render_page(ctx, document, request, buffer);
+  }
+  fz_catch(ctx) {
+    fprintf(stderr, "failed to serve page %u: %s\n", request->index, fz_caught_message(ctx));
+    status = MUPDF_WORKER_ERROR;
+  }
+
+  munmap(buffer, request->size);
+  return status;
+}
+
+static void limit_memory(const char* megabytes) {
+  const guint64 limit = g_ascii_strtoull(megabytes, NULL, 10);
+  if (limit == 0) {
+    return;
+  }
+
+  const struct rlimit rlimit = {.rlim_cur = limit * 1024 * 1024, .rlim_max = limit * 1024 * 1024};
+  if (setrlimit(RLIMIT_AS, &rlimit) != 0) {
+    fprintf(stderr, "failed to limit memory: %s\n", g_strerror(errno));
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s MEMORY-LIMIT-MB DOCUMENT\n", argv[0]);
+    return 1;
+  }
+
+  limit_memory(argv[1]);
+
+  fz_context* ctx = mupdf_context_new();
+  if (ctx == NULL) {
+    return 1;
+  }
+
+  static worker_packet_t packet;
+  int fd = -1;
+
+  /* the first request opens the document */
+  if (receive_request(&packet, &fd) == false || packet.request.type != MUPDF_WORKER_OPEN) {
+    fz_drop_context(ctx);
+    return 1;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  fz_document* document              = NULL;
+  const mupdf_worker_status_t status = open_document(ctx, argv[2], packet.payload, &document);
+  int pages                          = 0;
+  if (status == MUPDF_WORKER_OK) {
+    fz_try(ctx) {
+      pages = fz_count_pages(ctx, document);
+    }
+    fz_catch(ctx) {
+      pages = 0;
+    }
+  }
+
+  bool running = send_reply(status, pages) == true && status == MUPDF_WORKER_OK;
+  while (running == true && receive_request(&packet, &fd) == true) {
+    const mupdf_worker_status_t result = serve(ctx, document, pages, &packet.request, fd);
+    if (fd >= 0) {
+      close(fd);
+    }
+    running = send_reply(result, 0);
+  }
+
+  for (unsigned int i = 0; i < WORKER_PAGES; i++) {
+    drop_page(ctx, &recorded[i]);
+  }
+  fz_drop_document(ctx, document);
+  fz_drop_context(ctx);
+
+  return 0;
+}
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: Zlib */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <mupdf/fitz.h>
+
+/*
+ * Render workers are helper processes that open the document on their own and
+ * render pages on request. Requests and replies are exchanged as packets over
+ * a socket; pixels are written to a shared memory buffer whose file descriptor
+ * accompanies every request. A worker that crashes or exceeds its memory limit
+ * only fails the request it was serving.
+ */
+
+/* Maximal length of the payload following a request */
+#define MUPDF_WORKER_PAYLOAD_MAX 4096
+
+typedef enum mupdf_worker_request_type_e {
+  MUPDF_WORKER_OPEN,   /**< Open the document; the payload is the password */
+  MUPDF_WORKER_RENDER, /**< Render a page into the buffer */
+} mupdf_worker_request_type_t;
+
+typedef enum mupdf_worker_status_e {
+  MUPDF_WORKER_OK,               /**< The request has been served */
+  MUPDF_WORKER_ERROR,            /**< The request failed */
+  MUPDF_WORKER_INVALID_PASSWORD, /**< The document could not be opened with the password */
+} mupdf_worker_status_t;
+
+typedef struct mupdf_worker_request_s {
+  uint32_t type;        /**< mupdf_worker_request_type_t */
+  uint32_t index;       /**< Page index */
+  uint64_t size;        /**< Size of the shared buffer in bytes */
+  uint32_t width;       /**< Width of the rendered page in pixels */
+  uint32_t height;      /**< Height of the rendered page in pixels */
+  int32_t rowstride;    /**< Distance between rows in the buffer in bytes */
+  fz_irect clip;        /**< Rendered pixels, relative to the page */
+  uint32_t recolor;     /**< If the page is recolored */
+  uint32_t dark_color;  /**< Color black is mapped to, as 0xRRGGBB */
+  uint32_t light_color; /**< Color white is mapped to, as 0xRRGGBB */
+  uint32_t length;      /**< Length of the payload following the request */
+} mupdf_worker_request_t;
+
+typedef struct mupdf_worker_reply_s {
+  uint32_t status; /**< mupdf_worker_status_t */
+  uint64_t length; /**< Number of pages of the document that has been opened */
+} mupdf_worker_reply_t;
+
+#endif // WORKER_H
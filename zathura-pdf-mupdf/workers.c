@@ -0,0 +1,422 @@
+/* SPDX-License-Identifier: Zlib */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <glib.h>
+#include <girara/utils.h>
+
+#include "utils.h"
+#include "worker.h"
+
+/* Time in milliseconds a render may take longer per megapixel than the
+ * timeout of the pool */
+#define MUPDF_WORKERS_TIMEOUT_PER_MEGAPIXEL 1000
+/* Budget of the cache of compressed pages rendered by workers */
+#define MUPDF_WORKERS_CACHE_BUDGET (64 * 1024 * 1024)
+/* Pages are only cached if they compress to at most 1/n of their size */
+#define MUPDF_WORKERS_CACHE_MIN_RATIO 4
+
+typedef struct mupdf_worker_s {
+  GPid pid;              /**< Process of the worker or 0 if it is not running */
+  int socket;            /**< Socket to the worker */
+  int memfd;             /**< Shared buffer */
+  unsigned char* shared; /**< Mapping of the shared buffer */
+  size_t size;           /**< Size of the shared buffer */
+  bool busy;             /**< If the worker serves a request */
+} mupdf_worker_t;
+
+struct mupdf_workers_s {
+  GMutex mutex;            /**< Protects busy and renders */
+  GCond cond;              /**< Signalled when a worker becomes idle */
+  char* path;              /**< Document */
+  char* password;          /**< Password of the document or NULL */
+  unsigned int memory;     /**< Memory limit of every worker in MiB */
+  unsigned int timeout;    /**< Time in milliseconds after which a worker is considered hanging */
+  mupdf_worker_t* workers; /**< The workers */
+  unsigned int count;      /**< Number of workers */
+  mupdf_cache_t* renders;  /**< Compressed complete pages by page and size */
+};
+
+typedef struct mupdf_workers_key_s {
+  unsigned int index;  /**< Index of the page */
+  unsigned int width;  /**< Width of the image in pixels */
+  unsigned int height; /**< Height of the image in pixels */
+} mupdf_workers_key_t;
+
+typedef struct mupdf_workers_render_s {
+  unsigned char* data; /**< Compressed pixels */
+  size_t length;       /**< Length of data */
+} mupdf_workers_render_t;
+
+static guint workers_key_hash(gconstpointer data) {
+  const mupdf_workers_key_t* key = data;
+  return key->index ^ (key->width * 31 + key->height);
+}
+
+static gboolean workers_key_equal(gconstpointer a, gconstpointer b) {
+  const mupdf_workers_key_t* key_a = a;
+  const mupdf_workers_key_t* key_b = b;
+  return key_a->index == key_b->index && key_a->width == key_b->width && key_a->height == key_b->height;
+}
+
+static void workers_render_free(void* data) {
+  mupdf_workers_render_t* render = data;
+  g_free(render->data);
+  g_free(render);
+}
+
+static void worker_stop(mupdf_worker_t* worker) {
+  if (worker->pid != 0) {
+    kill(worker->pid, SIGKILL);
+    waitpid(worker->pid, NULL, 0);
+    g_spawn_close_pid(worker->pid);
+    worker->pid = 0;
+  }
+  if (worker->socket >= 0) {
+    close(worker->socket);
+    worker->socket = -1;
+  }
+}
+
+static void worker_free(mupdf_worker_t* worker) {
+  worker_stop(worker);
+  if (worker->shared != NULL) {
+    munmap(worker->shared, worker->size);
+  }
+  if (worker->memfd >= 0) {
+    close(worker->memfd);
+  }
+}
+
+static bool worker_send(mupdf_worker_t* worker, const mupdf_worker_request_t* request, const char* payload,
+                        bool attach) {
+  struct iovec iov[2] = {
+      {.iov_base = (void*)request, .iov_len = sizeof(*request)},
+      {.iov_base = (void*)payload, .iov_len = request->length},
+  };
+  char control[CMSG_SPACE(sizeof(int))] = {0};
+  struct msghdr message                 = {0};
+  message.msg_iov                       = iov;
+  message.msg_iovlen                    = request->length > 0 ? 2 : 1;
+
+  /* the shared buffer accompanies the request */
+  if (attach == true) {
+    message.msg_control    = control;
+    message.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level     = SOL_SOCKET;
+    cmsg->cmsg_type      = SCM_RIGHTS;
+    cmsg->cmsg_len       = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &worker->memfd, sizeof(int));
+  }
+
+  ssize_t written;
+  do {
+    written = sendmsg(worker->socket, &message, MSG_NOSIGNAL);
+  } while (written < 0 && errno == EINTR);
+
+  return written == (ssize_t)(sizeof(*request) + request->length);
+}
+
+/* Waits at most timeout milliseconds for the reply of a worker */
+static bool worker_receive(mupdf_worker_t* worker, mupdf_worker_reply_t* reply, unsigned int timeout) {
+  struct pollfd pollfd = {.fd = worker->socket, .events = POLLIN};
+
+  int ready;
+  do {
+    ready = poll(&pollfd, 1, MIN(timeout, G_MAXINT));
+  } while (ready < 0 && errno == EINTR);
+
+  if (ready <= 0) {
+    return false;
+  }
+
+  ssize_t length;
+  do {
+    length = recv(worker->socket, reply, sizeof(*reply), 0);
+  } while (length < 0 && errno == EINTR);
+
+  return length == sizeof(*reply);
+}
+
+/* Starts the worker process and lets it open the document */
+static bool worker_start(mupdf_workers_t* workers, mupdf_worker_t* worker, mupdf_worker_status_t* status) {
+  int sockets[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != 0) {
+    return false;
+  }
+
+  char* memory  = g_strdup_printf("%u", workers->memory);
+  char* argv[]  = {MUPDF_WORKER_PATH, memory, workers->path, NULL};
+  GError* error = NULL;
+
+  /* the socket becomes the standard input of the worker */
+  const gboolean spawned = g_spawn_async_with_fds(NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL,
+                                                  &worker->pid, sockets[1], -1, -1, &error);
+  close(sockets[1]);
+  g_free(memory);
+
+  if (spawned == FALSE) {
+    girara_warning("failed to start %s: %s", MUPDF_WORKER_PATH, error->message);
+    g_error_free(error);
+    close(sockets[0]);
+    worker->pid = 0;
+    return false;
+  }
+  worker->socket = sockets[0];
+
+  const char* password                 = workers->password != NULL ? workers->password : "";
+  const mupdf_worker_request_t request = {.type = MUPDF_WORKER_OPEN, .length = strlen(password)};
+  mupdf_worker_reply_t reply           = {.status = MUPDF_WORKER_ERROR};
+
+  if (worker_send(worker, &request, password, false) == false ||
+      worker_receive(worker, &reply, workers->timeout) == false || reply.status != MUPDF_WORKER_OK) {
+    *status = reply.status;
+    worker_stop(worker);
+    return false;
+  }
+
+  return true;
+}
+
+/* Grows the shared buffer of a worker to at least size bytes */
+static bool worker_reserve(mupdf_worker_t* worker, size_t size) {
+  if (worker->size >= size) {
+    return true;
+  }
+
+  if (worker->memfd < 0) {
+    worker->memfd = memfd_create("zathura-pdf-mupdf", MFD_CLOEXEC);
+    if (worker->memfd < 0) {
+      return false;
+    }
+  }
+
+  if (worker->shared != NULL) {
+    munmap(worker->shared, worker->size);
+    worker->shared = NULL;
+    worker->size   = 0;
+  }
+
+  if (ftruncate(worker->memfd, size) != 0) {
+    return false;
+  }
+
+  unsigned char* shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, worker->memfd, 0);
+  if (shared == MAP_FAILED) {
+    return false;
+  }
+
+  worker->shared = shared;
+  worker->size   = size;
+  return true;
+}
+
+/* Waits for an idle worker, like mupdf_document_lock_request waits for the
+ * lock: the wait is given up and NULL is returned once generation no longer
+ * equals current */
+static mupdf_worker_t* workers_acquire(mupdf_workers_t* workers, const gint* generation, gint current) {
+  g_mutex_lock(&workers->mutex);
+
+  /* older requests that are superseded by this one stop waiting */
+  g_cond_broadcast(&workers->cond);
+
+  mupdf_worker_t* worker = NULL;
+  while (worker == NULL && g_atomic_int_get(generation) == current) {
+    for (unsigned int i = 0; i < workers->count && worker == NULL; i++) {
+      if (workers->workers[i].busy == false) {
+        worker = &workers->workers[i];
+      }
+    }
+    if (worker == NULL) {
+      g_cond_wait(&workers->cond, &workers->mutex);
+    }
+  }
+  if (worker != NULL) {
+    worker->busy = true;
+  }
+
+  g_mutex_unlock(&workers->mutex);
+  return worker;
+}
+
+static void workers_release(mupdf_workers_t* workers, mupdf_worker_t* worker) {
+  g_mutex_lock(&workers->mutex);
+  worker->busy = false;
+  /* superseded requests wake up as well, so all waiting ones are woken */
+  g_cond_broadcast(&workers->cond);
+  g_mutex_unlock(&workers->mutex);
+}
+
+/* Sends a request to an idle worker, which is started if necessary, and
+ * waits for the reply. A worker that crashes, hangs or breaks the protocol
+ * is stopped and started again by the next request. */
+static mupdf_workers_result_t workers_request(mupdf_workers_t* workers, mupdf_worker_request_t* request, size_t size,
+                                              unsigned int timeout, const gint* generation, gint current,
+                                              mupdf_worker_reply_t* reply, mupdf_worker_t** served) {
+  mupdf_worker_t* worker = workers_acquire(workers, generation, current);
+  if (worker == NULL) {
+    return MUPDF_WORKERS_SUPERSEDED;
+  }
+
+  mupdf_worker_status_t status = MUPDF_WORKER_ERROR;
+  if (worker_reserve(worker, size) == false ||
+      (worker->pid == 0 && worker_start(workers, worker, &status) == false)) {
+    workers_release(workers, worker);
+    return MUPDF_WORKERS_FAILED;
+  }
+
+  request->size = worker->size;
+  if (worker_send(worker, request, NULL, true) == false || worker_receive(worker, reply, timeout) == false) {
+    girara_warning("worker %d failed to serve page %u", worker->pid, request->index);
+    worker_stop(worker);
+    workers_release(workers, worker);
+    return MUPDF_WORKERS_LOST;
+  }
+
+  *served = worker;
+  return MUPDF_WORKERS_OK;
+}
+
+mupdf_workers_t* mupdf_workers_new(const char* path, const char* password, unsigned int count, unsigned int memory,
+                                   unsigned int timeout) {
+  mupdf_workers_t* workers = g_malloc0(sizeof(mupdf_workers_t));
+  g_mutex_init(&workers->mutex);
+  g_cond_init(&workers->cond);
+  workers->path     = g_strdup(path);
+  workers->password = g_strdup(password);
+  workers->memory   = memory;
+  workers->timeout  = timeout;
+  workers->count    = count;
+  workers->workers  = g_malloc0_n(count, sizeof(mupdf_worker_t));
+  workers->renders  = mupdf_cache_new(MUPDF_WORKERS_CACHE_BUDGET, workers_key_hash, workers_key_equal, g_free,
+                                      workers_render_free);
+
+  for (unsigned int i = 0; i < count; i++) {
+    workers->workers[i].socket = -1;
+    workers->workers[i].memfd  = -1;
+  }
+
+  /* the first worker is started right away, so a missing helper is noticed
+   * before any page is rendered */
+  mupdf_worker_status_t status = MUPDF_WORKER_ERROR;
+  if (worker_start(workers, &workers->workers[0], &status) == false) {
+    mupdf_workers_free(workers);
+    return NULL;
+  }
+
+  return workers;
+}
+
+void mupdf_workers_free(mupdf_workers_t* workers) {
+  if (workers == NULL) {
+    return;
+  }
+
+  for (unsigned int i = 0; i < workers->count; i++) {
+    worker_free(&workers->workers[i]);
+  }
+  mupdf_cache_free(workers->renders);
+  g_free(workers->workers);
+  g_free(workers->password);
+  g_free(workers->path);
+  g_cond_clear(&workers->cond);
+  g_mutex_clear(&workers->mutex);
+  g_free(workers);
+}
+
+/* Restores a page rendered before */
+static bool workers_cache_lookup(mupdf_workers_t* workers, const mupdf_workers_key_t* key, unsigned char* image,
+                                 int rowstride) {
+  g_mutex_lock(&workers->mutex);
+  const mupdf_workers_render_t* render = mupdf_cache_lookup(workers->renders, key);
+  const bool found = render != NULL && mupdf_rle_decompress(render->data, render->length, image, key->width,
+                                                            key->height, rowstride) == true;
+  g_mutex_unlock(&workers->mutex);
+
+  return found;
+}
+
+/* Keeps a compressed copy of a rendered page, if it compresses well */
+static void workers_cache_insert(mupdf_workers_t* workers, const mupdf_workers_key_t* key, const unsigned char* image,
+                                 int rowstride) {
+  const size_t size   = (size_t)key->width * key->height * 4;
+  size_t length       = 0;
+  unsigned char* data = mupdf_rle_compress(image, key->width, key->height, rowstride,
+                                           size / MUPDF_WORKERS_CACHE_MIN_RATIO, &length);
+  if (data == NULL) {
+    return;
+  }
+
+  mupdf_workers_render_t* render = g_malloc(sizeof(mupdf_workers_render_t));
+  render->data                   = data;
+  render->length                 = length;
+  mupdf_workers_key_t* key_copy  = g_malloc(sizeof(mupdf_workers_key_t));
+  *key_copy                      = *key;
+
+  g_mutex_lock(&workers->mutex);
+  mupdf_cache_insert(workers->renders, key_copy, render, length);
+  g_mutex_unlock(&workers->mutex);
+}
+
+mupdf_workers_result_t mupdf_workers_render(mupdf_workers_t* workers, unsigned int index, unsigned char* image,
+                                            int rowstride, unsigned int width, unsigned int height, fz_irect clip,
+                                            const mupdf_recolor_t* recolor, const gint* generation, gint current) {
+  /* pages rendered before are restored as a whole */
+  const mupdf_workers_key_t key = {.index = index, .width = width, .height = height};
+  if (workers_cache_lookup(workers, &key, image, rowstride) == true) {
+    return MUPDF_WORKERS_OK;
+  }
+
+  mupdf_worker_request_t request = {
+      .type      = MUPDF_WORKER_RENDER,
+      .index     = index,
+      .width     = width,
+      .height    = height,
+      .rowstride = rowstride,
+      .clip      = clip,
+  };
+  if (recolor != NULL && recolor->enabled == true) {
+    request.recolor     = 1;
+    request.dark_color  = recolor->dark_color;
+    request.light_color = recolor->light_color;
+  }
+
+  /* large renders take longer before the worker is considered hanging */
+  const uint64_t pixels = (uint64_t)(clip.x1 - clip.x0) * (clip.y1 - clip.y0);
+  const uint64_t timeout = workers->timeout + pixels * MUPDF_WORKERS_TIMEOUT_PER_MEGAPIXEL / (1024 * 1024);
+
+  mupdf_worker_reply_t reply          = {.status = MUPDF_WORKER_ERROR};
+  mupdf_worker_t* worker              = NULL;
+  const mupdf_workers_result_t result = workers_request(workers, &request, (size_t)rowstride * height,
+                                                        MIN(timeout, G_MAXUINT), generation, current, &reply,
+                                                        &worker);
+  if (result != MUPDF_WORKERS_OK) {
+    return result;
+  }
+
+  /* the surface belongs to zathura, so only the rendered rows are copied */
+  const bool rendered = reply.status == MUPDF_WORKER_OK;
+  if (rendered == true) {
+    for (int y = clip.y0; y < clip.y1; y++) {
+      const size_t offset = (size_t)y * rowstride + (size_t)clip.x0 * 4;
+      memcpy(image + offset, worker->shared + offset, (size_t)(clip.x1 - clip.x0) * 4);
+    }
+  }
+
+  workers_release(workers, worker);
+
+  if (rendered == true && clip.x0 == 0 && clip.y0 == 0 && clip.x1 == (int)width && clip.y1 == (int)height) {
+    workers_cache_insert(workers, &key, image, rowstride);
+  }
+
+  return rendered == true ? MUPDF_WORKERS_OK : MUPDF_WORKERS_FAILED;
+}
@@ -0,0 +1,234 @@
+/* SPDX-License-Identifier: Zlib */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <girara/utils.h>
+#include <mupdf/pdf.h>
+
+#include "utils.h"
+
+/* Name of the cache directory */
+#define MUPDF_XREF_CACHE_NAME "xref"
+/* Maximal size of the cache directory */
+#define MUPDF_XREF_CACHE_LIMIT (64 * 1024 * 1024)
+/* Widths of the fields of the cross-reference stream: type, offset or number
+ * of the object stream, generation or index in the object stream */
+#define MUPDF_XREF_WIDTH_TYPE 1
+#define MUPDF_XREF_WIDTH_OFFSET 8
+#define MUPDF_XREF_WIDTH_GENERATION 2
+#define MUPDF_XREF_ENTRY_LENGTH (MUPDF_XREF_WIDTH_TYPE + MUPDF_XREF_WIDTH_OFFSET + MUPDF_XREF_WIDTH_GENERATION)
+
+typedef struct mupdf_xref_entry_s {
+  unsigned char type; /**< 0 (free), 1 (in the file), 2 (in an object stream) or 'w' (to be written) */
+  int64_t offset;     /**< File offset or number of the object stream */
+  unsigned int gen;   /**< Generation or index in the object stream */
+} mupdf_xref_entry_t;
+
+fz_buffer* mupdf_xref_cache_load(fz_context* ctx, const char* fingerprint) {
+  char* path = mupdf_cache_path(MUPDF_XREF_CACHE_NAME, fingerprint);
+  if (path == NULL) {
+    return NULL;
+  }
+
+  fz_buffer* volatile xref = NULL;
+  if (g_file_test(path, G_FILE_TEST_IS_REGULAR) == TRUE) {
+    fz_try(ctx) {
+      xref = fz_read_file(ctx, path);
+      /* the modification time orders entries for the clean up */
+      utimensat(AT_FDCWD, path, NULL, 0);
+    }
+    fz_catch(ctx) {
+      girara_debug("failed to read %s: %s", path, fz_caught_message(ctx));
+    }
+  }
+
+  g_free(path);
+  return xref;
+}
+
+static void write_field(unsigned char* data, uint64_t value, unsigned int width) {
+  for (unsigned int i = 0; i < width; i++) {
+    data[i] = value >> (8 * (width - 1 - i));
+  }
+}
+
+/* Writes an object that only exists in memory, e.g. a stream whose length was
+ * corrected during the repair */
+static void write_object(fz_context* ctx, pdf_document* pdf, fz_output* out, int num, unsigned int gen) {
+  pdf_obj* volatile obj    = NULL;
+  pdf_obj* volatile copy   = NULL;
+  fz_buffer* volatile data = NULL;
+
+  fz_try(ctx) {
+    obj = pdf_load_object(ctx, pdf, num);
+
+    fz_write_printf(ctx, out, "%d %u obj\n", num, gen);
+    if (pdf_obj_num_is_stream(ctx, pdf, num) != 0) {
+      data = pdf_load_raw_stream_number(ctx, pdf, num);
+      copy = pdf_copy_dict(ctx, obj);
+      pdf_dict_put_int(ctx, copy, PDF_NAME(Length), data->len);
+
+      pdf_print_obj(ctx, out, copy, 1, 0);
+      fz_write_string(ctx, out, "\nstream\n");
+      fz_write_data(ctx, out, data->data, data->len);
+      fz_write_string(ctx, out, "\nendstream");
+    } else {
+      pdf_print_obj(ctx, out, obj, 1, 0);
+    }
+    fz_write_string(ctx, out, "\nendobj\n");
+  }
+  fz_always(ctx) {
+    fz_drop_buffer(ctx, data);
+    pdf_drop_obj(ctx, copy);
+    pdf_drop_obj(ctx, obj);
+  }
+  fz_catch(ctx) {
+    fz_rethrow(ctx);
+  }
+}
+
+/* Builds a cross-reference section, which is valid if appended to the file,
+ * from the reconstructed table of a repaired document */
+static fz_buffer* build_xref(fz_context* ctx, pdf_document* pdf) {
+  pdf_obj* trailer = pdf_trailer(ctx, pdf);
+  if (pdf_dict_get(ctx, trailer, PDF_NAME(Root)) == NULL) {
+    fz_throw(ctx, FZ_ERROR_FORMAT, "no document catalog");
+  }
+
+  /* the last entry is the cross-reference stream itself */
+  const int length                     = pdf_xref_len(ctx, pdf);
+  mupdf_xref_entry_t* volatile entries = NULL;
+  unsigned char* volatile data         = NULL;
+  unsigned char* volatile deflated     = NULL;
+  fz_buffer* volatile xref             = NULL;
+  fz_output* volatile out              = NULL;
+  size_t deflated_length               = 0;
+
+  fz_try(ctx) {
+    entries = fz_malloc_array(ctx, length + 1, mupdf_xref_entry_t);
+
+    bool rewrite = false;
+    for (int i = 0; i < length; i++) {
+      mupdf_xref_entry_t* entry     = &entries[i];
+      const pdf_xref_entry* current = pdf_get_xref_entry(ctx, pdf, i);
+      *entry                        = (mupdf_xref_entry_t){.type = 0, .gen = i == 0 ? 65535 : 0};
+
+      if (current == NULL) {
+        continue;
+      } else if (current->type == 'o') {
+        *entry = (mupdf_xref_entry_t){.type = 2, .offset = current->ofs, .gen = current->gen};
+      } else if (current->type == 'n') {
+        const bool modified =
+            current->stm_buf != NULL || (current->obj != NULL && pdf_obj_is_dirty(ctx, current->obj));
+        if (modified == true || (current->ofs <= 0 && current->obj != NULL)) {
+          *entry  = (mupdf_xref_entry_t){.type = 'w', .gen = current->gen};
+          rewrite = true;
+        } else if (current->ofs > 0) {
+          *entry = (mupdf_xref_entry_t){.type = 1, .offset = current->ofs, .gen = current->gen};
+        }
+      }
+    }
+
+    /* objects of encrypted documents would have to be encrypted again */
+    if (rewrite == true && pdf->crypt != NULL) {
+      fz_throw(ctx, FZ_ERROR_UNSUPPORTED, "encrypted document with modified objects");
+    }
+
+    xref = fz_new_buffer(ctx, 1024);
+    out  = fz_new_output_with_buffer(ctx, xref);
+    fz_write_byte(ctx, out, '\n');
+
+    for (int i = 0; i < length; i++) {
+      if (entries[i].type == 'w') {
+        entries[i].type   = 1;
+        entries[i].offset = pdf->file_size + fz_tell_output(ctx, out);
+        write_object(ctx, pdf, out, i, entries[i].gen);
+      }
+    }
+
+    const int64_t offset = pdf->file_size + fz_tell_output(ctx, out);
+    entries[length]      = (mupdf_xref_entry_t){.type = 1, .offset = offset};
+
+    data = fz_malloc(ctx, (size_t)(length + 1) * MUPDF_XREF_ENTRY_LENGTH);
+    for (int i = 0; i <= length; i++) {
+      unsigned char* field = data + (size_t)i * MUPDF_XREF_ENTRY_LENGTH;
+      write_field(field, entries[i].type, MUPDF_XREF_WIDTH_TYPE);
+      write_field(field + MUPDF_XREF_WIDTH_TYPE, entries[i].offset, MUPDF_XREF_WIDTH_OFFSET);
+      write_field(field + MUPDF_XREF_WIDTH_TYPE + MUPDF_XREF_WIDTH_OFFSET, entries[i].gen,
+                  MUPDF_XREF_WIDTH_GENERATION);
+    }
+    deflated = fz_new_deflated_data(ctx, &deflated_length, data, (size_t)(length + 1) * MUPDF_XREF_ENTRY_LENGTH,
+                                    FZ_DEFLATE_DEFAULT);
+
+    fz_write_printf(ctx, out, "%d 0 obj\n<</Type/XRef/Size %d/W[%d %d %d]/Filter/FlateDecode/Length %zu", length,
+                    length + 1, MUPDF_XREF_WIDTH_TYPE, MUPDF_XREF_WIDTH_OFFSET, MUPDF_XREF_WIDTH_GENERATION,
+                    deflated_length);
+
+    static const char* const keys[] = {"Root", "Info", "ID", "Encrypt"};
+    for (unsigned int i = 0; i < G_N_ELEMENTS(keys); i++) {
+      pdf_obj* value = pdf_dict_gets(ctx, trailer, keys[i]);
+      if (value != NULL) {
+        fz_write_printf(ctx, out, "/%s ", keys[i]);
+        pdf_print_obj(ctx, out, value, 1, 0);
+      }
+    }
+
+    fz_write_string(ctx, out, ">>\nstream\n");
+    fz_write_data(ctx, out, deflated, deflated_length);
+    fz_write_printf(ctx, out, "\nendstream\nendobj\nstartxref\n%" PRId64 "\n%%%%EOF\n", offset);
+    fz_close_output(ctx, out);
+  }
+  fz_always(ctx) {
+    fz_drop_output(ctx, out);
+    fz_free(ctx, deflated);
+    fz_free(ctx, data);
+    fz_free(ctx, entries);
+  }
+  fz_catch(ctx) {
+    fz_drop_buffer(ctx, xref);
+    fz_rethrow(ctx);
+  }
+
+  return xref;
+}
+
+void mupdf_xref_cache_update(fz_context* ctx, fz_document* document, const char* fingerprint, bool loaded) {
+  pdf_document* pdf = pdf_specifics(ctx, document);
+  if (pdf == NULL || pdf_was_repaired(ctx, pdf) == 0) {
+    return;
+  }
+
+  char* path = mupdf_cache_path(MUPDF_XREF_CACHE_NAME, fingerprint);
+  if (path == NULL) {
+    return;
+  }
+
+  /* a cached section that did not prevent the repair is useless; the next
+   * open repairs the plain file and saves a new one */
+  if (loaded == true) {
+    girara_debug("removing unusable cross-reference section %s", path);
+    g_unlink(path);
+    g_free(path);
+    return;
+  }
+
+  fz_buffer* volatile xref = NULL;
+  fz_try(ctx) {
+    xref = build_xref(ctx, pdf);
+    if (g_file_set_contents(path, (const gchar*)xref->data, xref->len, NULL) == FALSE) {
+      girara_debug("failed to write %s", path);
+    }
+    mupdf_cache_trim(MUPDF_XREF_CACHE_NAME, MUPDF_XREF_CACHE_LIMIT);
+  }
+  fz_always(ctx) {
+    fz_drop_buffer(ctx, xref);
+  }
+  fz_catch(ctx) {
+    girara_debug("not caching the cross-reference table: %s", fz_caught_message(ctx));
+  }
+
+  g_free(path);
+}